@@ -0,0 +1,550 @@
+#define _GNU_SOURCE
+#include "stepper.h"
+#include "shallow2d.h"
+#include "kernels.h"
+#include "roofline.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#elif defined SYSTIME
+#include <sys/time.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+//ldoc on
+/**
+ * # Kernel benchmarks
+ *
+ * The `kbench` driver times the inner kernels of the solver on their
+ * own, so that a change to one of them can be judged without the
+ * noise of a full run.  The usage is
+ *
+ *     kbench [-t seconds] [-o file.csv] [kernel ...]
+ *
+ * With no kernel names, we run all of them.  Each kernel is timed on
+ * a sweep of row lengths (or, for the ones that work on a whole tile,
+ * tile edges) at every instruction set level the CPU supports (capped
+ * by `SHALLOW_SIMD`, as in the solver).  For each case we report the
+ * best time per cell out of a few samples of about `seconds / 5`
+ * each (0.5 seconds in all by default), the rates in GFLOP/s and GB/s,
+ * and the largest difference from the scalar version, relative to
+ * the size of the result.  With `-o`, the rows are also appended to
+ * a CSV file.  The vector versions are meant to match the scalar ones
+ * bit for bit, so any difference at all counts as a failure: we say
+ * so at the end and exit with a nonzero status.
+ *
+ * The flop and byte counts are nominal per-cell counts from the
+ * source: flops are the adds, multiplies, divides, square roots,
+ * and min/max operations (the sign manipulations in the limiter are
+ * free), and bytes are the arrays each cell reads and writes once,
+ * assuming that neighboring cells come from cache.  They are meant
+ * for comparing versions, not for an exact roofline.
+ *
+ * The kernels are
+ *
+ * - `deriv1`: limited derivative along a row (`limited_deriv1`)
+ * - `derivk`: limited derivative across rows (`limited_derivk`)
+ * - `correct_sd`: corrector terms for one row
+ * - `flux`: shallow water fluxes (`shallow2dv_flux`)
+ * - `speed`: wave speed bound (`shallow2dv_speed`; scalar only)
+ * - `periodic`: ghost cell fill (`copy_subgrid`) for a tile
+ * - `step`: the whole fused stepper on one tile, one thread, with a
+ *   fixed time step (this is where the predictor is timed)
+ * - `wavefront`: a sweep of the wavefront scheme on four threads,
+ *   checked against halo tiles of the same depth rather than against
+ *   the scalar kernels
+ */
+
+#define KB_NFIELD 3
+#define KB_NG     4
+#define KB_NSAMPLE 5
+
+static const int row_sizes[]  = { 64, 256, 1024, 4096, 16384 };
+static const int tile_sizes[] = { 32, 64, 128, 256, 512 };
+#define KB_MAXROW  16384
+
+static double wall_time(void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#elif defined SYSTIME
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec * 1e-6;
+#else
+    return 0;
+#endif
+}
+
+
+/**
+ * ## Data
+ *
+ * The row kernels all work on a set of input arrays filled with a
+ * smooth flow plus some noise (so the limiter takes all its branches),
+ * and write to a few output rows that we compare against the scalar
+ * version.  Input rows are padded on either side so that the stencils
+ * can reach past the ends.
+ */
+
+typedef struct kb_data_t {
+    int n;              // Cells per row
+    int stride;         // Distance between rows
+    float* in;          // Input rows (with padding)
+    float* out;         // Output rows of the current run
+    float* ref;         // Output rows of the scalar run
+    void (*run)(struct kb_data_t* d);  // Kernel being timed
+} kb_data_t;
+
+
+static float* kb_alloc(size_t n)
+{
+    void* p = NULL;
+    if (posix_memalign(&p, 64, n * sizeof(float)) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+    return (float*) p;
+}
+
+
+static void kb_fill(float* u, size_t n, unsigned seed)
+{
+    for (size_t i = 0; i < n; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        float noise = (seed >> 8) * (1.0f / 16777216.0f) - 0.5f;
+        u[i] = 0.1f * sinf(0.01f * i) + 0.05f * noise;
+    }
+}
+
+
+// Input row k (of ten)
+static inline float* kb_row(kb_data_t* d, int k)
+{
+    return d->in + KB_NG + k * d->stride;
+}
+
+
+/**
+ * ## Row kernels
+ *
+ * Each row kernel is a function that runs once on the data; the
+ * table below gives its nominal counts and says whether it has vector
+ * versions to check.
+ */
+
+static void run_deriv1(kb_data_t* d)
+{
+    float* u = kb_row(d, 0);
+    central2d_kernels.limited_deriv3(d->out, u-1, u, u+1, d->n);
+}
+
+
+static void run_derivk(kb_data_t* d)
+{
+    float* u = kb_row(d, 1);
+    central2d_kernels.limited_deriv3(d->out, u-d->stride, u, u+d->stride,
+                                     d->n);
+}
+
+
+static void run_correct_sd(kb_data_t* d)
+{
+    central2d_kernels.correct_sd(d->out, d->out + d->stride,
+                                 kb_row(d, 0), kb_row(d, 1), kb_row(d, 2),
+                                 kb_row(d, 3), kb_row(d, 4),
+                                 0.01f, 0.01f, 0, d->n);
+}
+
+
+static void run_flux(kb_data_t* d)
+{
+    shallow2d_flux(d->out, d->out + KB_NFIELD*d->stride, kb_row(d, 2),
+                   d->n, d->stride);
+}
+
+
+static void run_speed(kb_data_t* d)
+{
+    d->out[0] = 0;
+    d->out[1] = 0;
+    shallow2d_speed(d->out, kb_row(d, 2), d->n, d->stride);
+}
+
+
+typedef struct kb_kernel_t {
+    const char* name;
+    void (*run)(kb_data_t* d);
+    bool vector;        // Has vector versions
+    double flops;       // Nominal flops per cell
+    double bytes;       // Nominal bytes moved per cell
+} kb_kernel_t;
+
+static const kb_kernel_t row_kernels[] = {
+    { "deriv1",     run_deriv1,     true,   9,  8 },
+    { "derivk",     run_derivk,     true,   9, 16 },
+    { "correct_sd", run_correct_sd, true,  13, 28 },
+    { "flux",       run_flux,       true,  15, 36 },
+    { "speed",      run_speed,      false, 10, 12 },
+};
+#define KB_NROW_KERNELS (int) (sizeof(row_kernels) / sizeof(row_kernels[0]))
+
+
+/**
+ * ## Timing and reporting
+ *
+ * We call a kernel often enough that a sample takes about the time
+ * we were given, and keep the best of a few samples.
+ */
+
+typedef struct kb_opts_t {
+    double seconds;     // Total time to spend on each case
+    FILE* csv;          // Where to append results (or NULL)
+} kb_opts_t;
+
+static int kb_failures = 0;     // Cases that differ from the reference
+
+
+static double kb_time(void (*run)(void*), void* arg, double seconds)
+{
+    double sample = seconds / KB_NSAMPLE;
+    int iters = 1;
+    for (;;) {
+        double t0 = wall_time();
+        for (int i = 0; i < iters; ++i)
+            run(arg);
+        double t = wall_time() - t0;
+        if (t >= 0.1 * sample || iters >= (1 << 30))
+            break;
+        iters *= (t > 0 ? (int) fmin(0.1 * sample / t + 1, 16) : 16);
+    }
+    iters = (int) fmax(1, fmin(iters * 10.0, 1 << 30));
+
+    double best = INFINITY;
+    for (int k = 0; k < KB_NSAMPLE; ++k) {
+        double t0 = wall_time();
+        for (int i = 0; i < iters; ++i)
+            run(arg);
+        best = fmin(best, (wall_time() - t0) / iters);
+    }
+    return best;
+}
+
+
+static double kb_error(const float* x, const float* ref, int n)
+{
+    double err = 0, scale = 0;
+    for (int i = 0; i < n; ++i) {
+        err = fmax(err, fabs((double) x[i] - ref[i]));
+        scale = fmax(scale, fabs(ref[i]));
+    }
+    return scale > 0 ? err / scale : err;
+}
+
+
+static void kb_report(const kb_opts_t* opts, const char* name,
+                      simd_level_t level, int n, double cells,
+                      double flops, double bytes, double t, double err)
+{
+    double ns = 1e9 * t / cells;
+    if (err != 0)
+        ++kb_failures;
+    printf("%-10s %-7s %6d %10.3f %9.2f %9.2f %10.2e\n",
+           name, simd_name(level), n, ns,
+           flops * cells / t * 1e-9, bytes * cells / t * 1e-9, err);
+    if (opts->csv)
+        fprintf(opts->csv, "%s,%s,%d,%.6e,%.6e,%.6e,%.6e\n",
+                name, simd_name(level), n, ns,
+                flops * cells / t * 1e-9, bytes * cells / t * 1e-9, err);
+}
+
+
+static void kb_select(simd_level_t level)
+{
+    central2d_kernels_select(level);
+    shallow2d_select(level);
+}
+
+
+static void kb_run_row(void* arg)
+{
+    kb_data_t* d = (kb_data_t*) arg;
+    d->run(d);
+}
+
+
+static void bench_row(const kb_opts_t* opts, const kb_kernel_t* kernel)
+{
+    kb_data_t d;
+    d.stride = KB_MAXROW + 2*KB_NG;
+    d.run = kernel->run;
+    size_t nout = 6 * (size_t) d.stride;
+    d.in  = kb_alloc(10 * (size_t) d.stride);
+    d.out = kb_alloc(nout);
+    d.ref = kb_alloc(nout);
+    kb_fill(d.in, 10 * (size_t) d.stride, 1);
+    memset(d.out, 0, nout * sizeof(float));
+
+    // Rows 2-4 hold h, hu, hv for the physics kernels; keep h positive
+    for (int i = 0; i < d.stride; ++i)
+        d.in[2*d.stride + i] += 1.5f;
+
+    int nsize = (int) (sizeof(row_sizes) / sizeof(row_sizes[0]));
+    for (int s = 0; s < nsize; ++s) {
+        d.n = row_sizes[s];
+        int top = kernel->vector ? simd_detect() : SIMD_SCALAR;
+        for (int level = SIMD_SCALAR; level <= top; ++level) {
+            kb_select((simd_level_t) level);
+            kernel->run(&d);
+            if (level == SIMD_SCALAR)
+                memcpy(d.ref, d.out, nout * sizeof(float));
+            double err = kb_error(d.out, d.ref, nout);
+            double t = kb_time(kb_run_row, &d, opts->seconds);
+            kb_report(opts, kernel->name, (simd_level_t) level, d.n, d.n,
+                      kernel->flops, kernel->bytes, t, err);
+        }
+    }
+    free(d.ref);
+    free(d.out);
+    free(d.in);
+}
+
+/**
+ * ## Tile kernels
+ *
+ * The ghost cell fill copies strips of width `ng` from each side of
+ * a tile to the other, for every field; it reads and writes each
+ * ghost cell once.  The full step works on a square grid of one tile
+ * with a fixed time step, so that every run does the same work; its
+ * counts per cell and step are the ones in `roofline.h`.
+ */
+
+typedef struct kb_tile_t {
+    int n;
+    int threads;
+    central2d_t* sim;
+    double steps;       // Steps taken in the last run
+} kb_tile_t;
+
+
+// Largest difference between the cells of two simulators of the same
+// size, relative to the size of the reference (as in kb_error); the
+// padding and ghost cells are left out
+static double kb_sim_error(central2d_t* sim, central2d_t* ref)
+{
+    double err = 0, scale = 0;
+    for (int k = 0; k < ref->nfield; ++k)
+        for (int iy = 0; iy < ref->ny; ++iy)
+            for (int ix = 0; ix < ref->nx; ++ix) {
+                float x = sim->u[central2d_offset(sim, k, ix, iy)];
+                float r = ref->u[central2d_offset(ref, k, ix, iy)];
+                err = fmax(err, fabs((double) x - r));
+                scale = fmax(scale, fabs(r));
+            }
+    return scale > 0 ? err / scale : err;
+}
+
+
+static void kb_run_periodic(void* arg)
+{
+    kb_tile_t* t = (kb_tile_t*) arg;
+    central2d_periodic_full(t->sim);
+}
+
+
+static void kb_run_step(void* arg)
+{
+    kb_tile_t* t = (kb_tile_t*) arg;
+    t->steps = central2d_run(t->sim, 4 * t->sim->dt_fixed, t->threads);
+}
+
+
+static central2d_t* kb_tile_sim(int n)
+{
+    central2d_t* sim = central2d_init(1, 1, n, n, KB_NFIELD,
+                                      shallow2d_flux, shallow2d_speed, 0.45);
+    for (int iy = 0; iy < n; ++iy)
+        for (int ix = 0; ix < n; ++ix) {
+            float x = (ix + 0.5f) / n, y = (iy + 0.5f) / n;
+            sim->u[central2d_offset(sim, 0, ix, iy)] =
+                1.0f + 0.2f * sinf(6.28318f * x) * cosf(6.28318f * y);
+            sim->u[central2d_offset(sim, 1, ix, iy)] = 0.1f;
+            sim->u[central2d_offset(sim, 2, ix, iy)] = -0.05f;
+        }
+    sim->tbatch = 1;
+    sim->tile_nx = n;
+    sim->tile_ny = n;
+    sim->dt_mode = CENTRAL2D_DT_FIXED;
+    sim->dt_fixed = 0.1f / n;
+    return sim;
+}
+
+
+static void bench_periodic(const kb_opts_t* opts)
+{
+    int nsize = (int) (sizeof(tile_sizes) / sizeof(tile_sizes[0]));
+    kb_tile_t t;
+    for (int s = 0; s < nsize; ++s) {
+        t.n = tile_sizes[s];
+        t.sim = kb_tile_sim(t.n);
+        double cells = KB_NFIELD * 4.0 * KB_NG * (t.n + 2*KB_NG);
+        double time = kb_time(kb_run_periodic, &t, opts->seconds);
+        kb_report(opts, "periodic", SIMD_SCALAR, t.n, cells,
+                  0, 8, time, 0);
+        central2d_free(t.sim);
+    }
+}
+
+
+static void bench_step(const kb_opts_t* opts)
+{
+    int nsize = (int) (sizeof(tile_sizes) / sizeof(tile_sizes[0]));
+    for (int s = 0; s < nsize; ++s) {
+        int n = tile_sizes[s];
+
+        // Check a few steps from the same start against scalar
+        kb_tile_t ref;
+        ref.n = n;
+        ref.threads = 1;
+        ref.sim = kb_tile_sim(n);
+        kb_select(SIMD_SCALAR);
+        kb_run_step(&ref);
+        central2d_sync(ref.sim);
+
+        for (int level = SIMD_SCALAR; level <= simd_detect(); ++level) {
+            kb_select((simd_level_t) level);
+            kb_tile_t t;
+            t.n = n;
+            t.threads = 1;
+            t.sim = kb_tile_sim(n);
+            kb_run_step(&t);
+            central2d_sync(t.sim);
+            double err = kb_sim_error(t.sim, ref.sim);
+
+            double time = kb_time(kb_run_step, &t, opts->seconds);
+            kb_report(opts, "step", (simd_level_t) level, n,
+                      (double) n * n * t.steps, ROOFLINE_STEP_FLOPS,
+                      ROOFLINE_STEP_BYTES, time, err);
+            central2d_free(t.sim);
+        }
+        central2d_free(ref.sim);
+    }
+}
+
+
+/**
+ * The wavefront scheme does the same arithmetic on every cell as the
+ * halo tiles with the same `tbatch`, so the two should agree bit for
+ * bit; any difference is counted as a failure, like a difference
+ * between a vector kernel and the scalar one.  We run both with the
+ * CFL time step (so the wave speeds go through the check too) on a
+ * grid of sixteen tiles, two step pairs per sweep, and time the
+ * wavefront run at the default instruction set level.
+ */
+
+static void bench_wavefront(const kb_opts_t* opts)
+{
+    int nsize = (int) (sizeof(tile_sizes) / sizeof(tile_sizes[0]));
+    simd_level_t level = simd_detect();
+    kb_select(level);
+    for (int s = 0; s < nsize; ++s) {
+        kb_tile_t t, h;
+        t.n = h.n = tile_sizes[s];
+        t.threads = h.threads = 4;
+        t.sim = kb_tile_sim(t.n);
+        h.sim = kb_tile_sim(h.n);
+        t.sim->dt_mode = h.sim->dt_mode = CENTRAL2D_DT_CFL;
+        t.sim->tbatch = h.sim->tbatch = 2;
+        t.sim->tiling = CENTRAL2D_TILING_WAVEFRONT;
+        h.sim->tile_nx = h.sim->tile_ny = h.n / 4;
+
+        kb_run_step(&t);
+        kb_run_step(&h);
+        central2d_sync(h.sim);
+        double err = kb_sim_error(t.sim, h.sim);
+        central2d_free(h.sim);
+
+        double time = kb_time(kb_run_step, &t, opts->seconds);
+        kb_report(opts, "wavefront", level, t.n,
+                  (double) t.n * t.n * t.steps, ROOFLINE_STEP_FLOPS,
+                  ROOFLINE_STEP_BYTES, time, err);
+        central2d_free(t.sim);
+    }
+}
+
+
+/**
+ * ## Main
+ */
+
+static bool kb_wanted(const char* name, int argc, char** argv)
+{
+    if (argc == 0)
+        return true;
+    for (int i = 0; i < argc; ++i)
+        if (strcmp(argv[i], name) == 0)
+            return true;
+    return false;
+}
+
+
+int main(int argc, char** argv)
+{
+    kb_opts_t opts = { 0.5, NULL };
+    const char* csv = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "t:o:")) != -1) {
+        switch (c) {
+        case 't':
+            opts.seconds = atof(optarg);
+            break;
+        case 'o':
+            csv = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t seconds] [-o file.csv] "
+                    "[kernel ...]\n", argv[0]);
+            return -1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (csv) {
+        opts.csv = fopen(csv, "a");
+        if (!opts.csv) {
+            fprintf(stderr, "Could not open %s\n", csv);
+            return -1;
+        }
+        if (ftell(opts.csv) == 0)
+            fprintf(opts.csv, "kernel,simd,n,ns_per_cell,gflops,gbytes,"
+                    "error\n");
+    }
+
+    printf("%-10s %-7s %6s %10s %9s %9s %10s\n", "kernel", "simd", "n",
+           "ns/cell", "GFLOP/s", "GB/s", "error");
+    for (int k = 0; k < KB_NROW_KERNELS; ++k)
+        if (kb_wanted(row_kernels[k].name, argc, argv))
+            bench_row(&opts, row_kernels + k);
+    if (kb_wanted("periodic", argc, argv))
+        bench_periodic(&opts);
+    if (kb_wanted("step", argc, argv))
+        bench_step(&opts);
+    if (kb_wanted("wavefront", argc, argv))
+        bench_wavefront(&opts);
+
+    if (opts.csv)
+        fclose(opts.csv);
+    if (kb_failures) {
+        fprintf(stderr, "%d cases differ from the reference version\n",
+                kb_failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include "kernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#endif
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * ### Picking an instruction set
+ *
+ * We ask the CPU once (via `cpuid`, wrapped by the compiler's
+ * `__builtin_cpu_supports`) and remember the answer.
+ */
+
+static const char* simd_names[SIMD_NLEVELS] = {
+    "scalar", "sse4.2", "avx2", "avx512"
+};
+
+
+const char* simd_name(simd_level_t level)
+{
+    return simd_names[level];
+}
+
+
+simd_level_t simd_detect(void)
+{
+    static int detected = -1;
+    if (detected >= 0)
+        return (simd_level_t) detected;
+
+    simd_level_t level = SIMD_SCALAR;
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        level = SIMD_SSE42;
+    if (__builtin_cpu_supports("avx2"))
+        level = SIMD_AVX2;
+    if (__builtin_cpu_supports("avx512f"))
+        level = SIMD_AVX512;
+#endif
+
+    const char* cap = getenv("SHALLOW_SIMD");
+    for (int i = 0; cap && i < level; ++i)
+        if (strcmp(cap, simd_names[i]) == 0)
+            level = (simd_level_t) i;
+
+    detected = level;
+    return level;
+}
+
+
+/**
+ * ### Derivatives with limiters
+ *
+ * In order to advance the time step, we also need to estimate
+ * derivatives of the fluxes and the solution values at each cell.
+ * In order to maintain stability, we apply a limiter here.
+ *
+ * The minmod limiter *looks* like it should be expensive to computer,
+ * since superficially it seems to require a number of branches.
+ * We do something a little tricky, getting rid of the condition
+ * on the sign of the arguments using the `copysign` instruction.
+ * If the compiler does the "right" thing with `max` and `min`
+ * for floating point arguments (translating them to branch-free
+ * intrinsic operations), this implementation should be relatively fast.
+ * The vector versions do the same thing by hand, with `copysign`
+ * written as bit operations on the sign bit.
+ */
+
+
+// Branch-free computation of minmod of two numbers times 2s
+static inline
+float xmin2s(float s, float a, float b) {
+    float sa = copysignf(s, a);
+    float sb = copysignf(s, b);
+    float abs_a = fabsf(a);
+    float abs_b = fabsf(b);
+    float min_abs = (abs_a < abs_b ? abs_a : abs_b);
+    return (sa+sb) * min_abs;
+}
+
+
+// Limited combined slope estimate
+static inline
+float limdiff(float um, float u0, float up) {
+    const float theta = 2.0;
+    const float quarter = 0.25;
+    float du1 = u0-um;   // Difference to left
+    float du2 = up-u0;   // Difference to right
+    float duc = up-um;   // Twice centered difference
+    return xmin2s( quarter, xmin2s(theta, du1, du2), duc );
+}
+
+
+// Compute limited derivs from three rows
+static
+void limited_deriv3_scalar(float* restrict du,
+                           const float* restrict um,
+                           const float* restrict u0,
+                           const float* restrict up,
+                           int ncell)
+{
+    for (int i = 0; i < ncell; ++i)
+        du[i] = limdiff(um[i], u0[i], up[i]);
+}
+
+
+/**
+ * ### Corrector terms
+ *
+ * See the stepper for how the $s$ and $d$ terms are used.
+ */
+
+static
+void correct_sd_scalar(float* restrict s,
+                       float* restrict d,
+                       const float* restrict ux,
+                       const float* restrict uy,
+                       const float* restrict u,
+                       const float* restrict f,
+                       const float* restrict g,
+                       float dtcdx2, float dtcdy2,
+                       int xlo, int xhi)
+{
+    for (int ix = xlo; ix < xhi; ++ix)
+        s[ix] =
+            0.2500f * (u [ix] + u [ix+1]) +
+            0.0625f * (ux[ix] - ux[ix+1]) +
+            dtcdx2  * (f [ix] - f [ix+1]);
+    for (int ix = xlo; ix < xhi; ++ix)
+        d[ix] =
+            0.0625f * (uy[ix] + uy[ix+1]) +
+            dtcdy2  * (g [ix] + g [ix+1]);
+}
+
+
+/**
+ * ### Vector versions
+ *
+ * The vector kernels are written once, in `kernels_vec.h`, in terms
+ * of the macros in `vec.h`, and instantiated for each instruction set.
+ */
+
+#ifdef KERNELS_X86
+#define VEC_ISA VEC_SSE42
+#include "vec.h"
+#include "kernels_vec.h"
+#undef VEC_ISA
+
+#define VEC_ISA VEC_AVX2
+#include "vec.h"
+#include "kernels_vec.h"
+#undef VEC_ISA
+
+#define VEC_ISA VEC_AVX512
+#include "vec.h"
+#include "kernels_vec.h"
+#undef VEC_ISA
+#endif
+
+
+/**
+ * ### Dispatch
+ *
+ * The table starts out pointing at resolver functions, which fill in
+ * the table for the detected level and then forward the call.  After
+ * the first call, we go straight to the chosen kernel.  (If several
+ * threads race through the resolvers, they all store the same thing.)
+ */
+
+static const central2d_kernels_t kernels_by_level[SIMD_NLEVELS] = {
+    { limited_deriv3_scalar, correct_sd_scalar },
+#ifdef KERNELS_X86
+    { limited_deriv3_sse42,  correct_sd_sse42  },
+    { limited_deriv3_avx2,   correct_sd_avx2   },
+    { limited_deriv3_avx512, correct_sd_avx512 },
+#endif
+};
+
+
+simd_level_t central2d_kernels_select(simd_level_t level)
+{
+    simd_level_t best = simd_detect();
+    if (level > best)
+        level = best;
+    central2d_kernels = kernels_by_level[level];
+    return level;
+}
+
+
+static
+void limited_deriv3_resolve(float* restrict du,
+                            const float* restrict um,
+                            const float* restrict u0,
+                            const float* restrict up,
+                            int ncell)
+{
+    central2d_kernels_select(simd_detect());
+    central2d_kernels.limited_deriv3(du, um, u0, up, ncell);
+}
+
+
+static
+void correct_sd_resolve(float* restrict s,
+                        float* restrict d,
+                        const float* restrict ux,
+                        const float* restrict uy,
+                        const float* restrict u,
+                        const float* restrict f,
+                        const float* restrict g,
+                        float dtcdx2, float dtcdy2,
+                        int xlo, int xhi)
+{
+    central2d_kernels_select(simd_detect());
+    central2d_kernels.correct_sd(s, d, ux, uy, u, f, g,
+                                 dtcdx2, dtcdy2, xlo, xhi);
+}
+
+
+central2d_kernels_t central2d_kernels = {
+    limited_deriv3_resolve, correct_sd_resolve
+};
@@ -0,0 +1,77 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+//ldoc on
+/**
+ * # Vector kernels
+ *
+ * ## Interface
+ *
+ * The innermost loops of the stepper (the limited derivatives and
+ * the corrector) and of the physics (the flux evaluation) come in
+ * several versions: a plain C version, which we leave to the
+ * compiler, and hand-vectorized versions for SSE4.2, AVX2, and
+ * AVX-512.  All of them are compiled into every binary, and the
+ * best one the CPU supports is picked the first time a kernel is
+ * called, so that one build runs at full width on any node.
+ * Every version does the same operations in the same order, and
+ * `kernels.c` and `shallow2d.c` are built with `KERNELFLAGS`
+ * (without fast-math or contraction into fused multiply-adds), so
+ * they all give the same bits; which one a cell goes through (a
+ * vector lane or the leftovers at the end of a row) doesn't matter.
+ *
+ * ### Instruction set levels
+ *
+ * `simd_detect` returns the widest level the CPU supports.  Setting
+ * the `SHALLOW_SIMD` environment variable to one of the level names
+ * (`scalar`, `sse4.2`, `avx2`, `avx512`) caps the level, which is
+ * handy for comparing versions.
+ *
+ */
+typedef enum {
+    SIMD_SCALAR,
+    SIMD_SSE42,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_NLEVELS
+} simd_level_t;
+
+simd_level_t simd_detect(void);
+const char*  simd_name(simd_level_t level);
+
+/**
+ * ### Stepper kernels
+ *
+ * The stepper calls its kernels through the `central2d_kernels`
+ * table.  `limited_deriv3` computes limited derivatives from three
+ * rows of data (the rows may be the same array shifted by a stride,
+ * or three separate buffers); `correct_sd` computes the $s$ and $d$
+ * terms of the corrector for one row (see the stepper).
+ * `central2d_kernels_select` fills the table for a given level,
+ * clipped to what the CPU supports, and returns the level used.
+ * Calling it is optional.
+ *
+ */
+typedef struct central2d_kernels_t {
+    void (*limited_deriv3)(float* restrict du,
+                           const float* restrict um,
+                           const float* restrict u0,
+                           const float* restrict up,
+                           int ncell);
+    void (*correct_sd)(float* restrict s,
+                       float* restrict d,
+                       const float* restrict ux,
+                       const float* restrict uy,
+                       const float* restrict u,
+                       const float* restrict f,
+                       const float* restrict g,
+                       float dtcdx2, float dtcdy2,
+                       int xlo, int xhi);
+} central2d_kernels_t;
+
+extern central2d_kernels_t central2d_kernels;
+
+simd_level_t central2d_kernels_select(simd_level_t level);
+
+//ldoc off
+#endif /* KERNELS_H */
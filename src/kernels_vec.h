@@ -0,0 +1,70 @@
+/*
+ * Stepper kernel template, included by kernels.c once per
+ * instruction set after vec.h.  The vector code does the same
+ * operations in the same order as the scalar code, and leftover
+ * cells at the end of a row go through the scalar code (which, built
+ * with KERNELFLAGS, rounds the same way).
+ */
+
+// Branch-free minmod of two vectors times 2s (s > 0)
+VEC_TARGET static inline
+VEC VNAME(xmin2s)(VEC s, VEC a, VEC b)
+{
+    const VEC sign = VSET1(-0.0f);
+    VEC sa = VOR(s, VAND(sign, a));
+    VEC sb = VOR(s, VAND(sign, b));
+    VEC abs_a = VANDNOT(sign, a);
+    VEC abs_b = VANDNOT(sign, b);
+    return VMUL(VADD(sa, sb), VMIN(abs_a, abs_b));
+}
+
+
+VEC_TARGET static
+void VNAME(limited_deriv3)(float* restrict du,
+                           const float* restrict um,
+                           const float* restrict u0,
+                           const float* restrict up,
+                           int ncell)
+{
+    const VEC theta = VSET1(2.0f);
+    const VEC quarter = VSET1(0.25f);
+    int i = 0;
+    for (; i + VW <= ncell; i += VW) {
+        VEC a = VLOAD(um+i);
+        VEC b = VLOAD(u0+i);
+        VEC c = VLOAD(up+i);
+        VEC lim = VNAME(xmin2s)(theta, VSUB(b, a), VSUB(c, b));
+        VSTORE(du+i, VNAME(xmin2s)(quarter, lim, VSUB(c, a)));
+    }
+    for (; i < ncell; ++i)
+        du[i] = limdiff(um[i], u0[i], up[i]);
+}
+
+
+VEC_TARGET static
+void VNAME(correct_sd)(float* restrict s,
+                       float* restrict d,
+                       const float* restrict ux,
+                       const float* restrict uy,
+                       const float* restrict u,
+                       const float* restrict f,
+                       const float* restrict g,
+                       float dtcdx2, float dtcdy2,
+                       int xlo, int xhi)
+{
+    const VEC c0 = VSET1(0.2500f);
+    const VEC c1 = VSET1(0.0625f);
+    const VEC cx = VSET1(dtcdx2);
+    const VEC cy = VSET1(dtcdy2);
+    int ix = xlo;
+    for (; ix + VW <= xhi; ix += VW) {
+        VEC su = VMUL(c0, VADD(VLOAD(u +ix), VLOAD(u +ix+1)));
+        VEC sx = VMUL(c1, VSUB(VLOAD(ux+ix), VLOAD(ux+ix+1)));
+        VEC sf = VMUL(cx, VSUB(VLOAD(f +ix), VLOAD(f +ix+1)));
+        VSTORE(s+ix, VADD(VADD(su, sx), sf));
+        VEC dy = VMUL(c1, VADD(VLOAD(uy+ix), VLOAD(uy+ix+1)));
+        VEC dg = VMUL(cy, VADD(VLOAD(g +ix), VLOAD(g +ix+1)));
+        VSTORE(d+ix, VADD(dy, dg));
+    }
+    correct_sd_scalar(s, d, ux, uy, u, f, g, dtcdx2, dtcdy2, ix, xhi);
+}
@@ -1,5 +1,11 @@
+#define _GNU_SOURCE
 #include "stepper.h"
 #include "shallow2d.h"
+#include "viz.h"
+#include "vizshm.h"
+#include "kernels.h"
+#include "roofline.h"
+#include "trace.h"
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -12,7 +18,13 @@
 #include <lualib.h>
 
 #include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
 #include <gperftools/profiler.h>
 
 //ldoc on
@@ -31,33 +43,19 @@
  * since that will cause the system of equations to blow up.  For
  * debugging convenience, we'll plan to periodically print diagnostic
  * information about these conserved quantities (and about the range
- * of water heights).
+ * of water heights).  The stepper keeps per-tile sums and ranges up to
+ * date as it steps, so this costs next to nothing; the sums are done
+ * in double precision.
  */
 
 void solution_check(central2d_t *sim)
 {
-    int nx = sim->nx, ny = sim->ny;
-    float *u = sim->u;
-    float h_sum = 0, hu_sum = 0, hv_sum = 0;
-    float hmin = u[central2d_offset(sim, 0, 0, 0)];
-    float hmax = hmin;
-    for (int j = 0; j < ny; ++j)
-        for (int i = 0; i < nx; ++i)
-        {
-            float h = u[central2d_offset(sim, 0, i, j)];
-            h_sum += h;
-            hu_sum += u[central2d_offset(sim, 1, i, j)];
-            hv_sum += u[central2d_offset(sim, 2, i, j)];
-            hmax = fmaxf(h, hmax);
-            hmin = fminf(h, hmin);
-        }
-    float cell_area = sim->dx * sim->dy;
-    h_sum *= cell_area;
-    hu_sum *= cell_area;
-    hv_sum *= cell_area;
+    double total[3];
+    float lo[3], hi[3];
+    central2d_stats(sim, total, lo, hi);
     printf("-\n  Volume: %g\n  Momentum: (%g, %g)\n  Range: [%g, %g]\n",
-           h_sum, hu_sum, hv_sum, hmin, hmax);
-    assert(hmin > 0);
+           total[0], total[1], total[2], lo[0], hi[0]);
+    assert(lo[0] > 0);
 }
 
 /**
@@ -65,37 +63,19 @@ void solution_check(central2d_t *sim)
  *
  * After finishing a run (or every several steps), we might want to
  * write out a data file for further processing by some other program
- * -- in this case, a Python visualizer.  The visualizer takes the
- * number of pixels in x and y in the first two entries, then raw
- * single-precision raster pictures.
+ * -- in this case, a Python visualizer.  The file format and the
+ * background writer live in `viz.c`; here we just pick the options
+ * from the simulation table: `out_fields` is `"h"` (the default) to
+ * write only the water height or `"all"` for the momenta as well,
+ * `out_bits = 16` quantizes to 16 bits, `out_error` quantizes to a
+ * given absolute error instead, and `out_compress` sets the zlib level
+ * (1 by default, 0 for no compression).
+ *
+ * Setting `stream` to a shared memory name (e.g. `"/shallow"`) also
+ * publishes every frame into a ring of `stream_slots` slots (4 by
+ * default) for a live consumer; see `vizshm.h`.
  */
 
-FILE *viz_open(const char *fname, central2d_t *sim, int vskip)
-{
-    FILE *fp = fopen(fname, "w");
-    if (fp)
-    {
-        float xy[2] = {sim->nx / vskip, sim->ny / vskip};
-        fwrite(xy, sizeof(float), 2, fp);
-    }
-    return fp;
-}
-
-void viz_close(FILE *fp)
-{
-    fclose(fp);
-}
-
-void viz_frame(FILE *fp, central2d_t *sim, int vskip)
-{
-    if (!fp)
-        return;
-    for (int iy = 0; iy < sim->ny; iy += vskip)
-        for (int ix = 0; ix < sim->nx; ix += vskip)
-            fwrite(sim->u + central2d_offset(sim, 0, ix, iy),
-                   sizeof(float), 1, fp);
-}
-
 /**
  * ## Lua driver routines
  *
@@ -110,36 +90,760 @@ void viz_frame(FILE *fp, central2d_t *sim, int vskip)
  * We specify the initial conditions by providing the simulator
  * with a callback function to be called at each cell center.
  * The callback function is assumed to be the `init` field of
- * a table at index 1.
+ * a table at index 1.  We go through the grid a row at a time,
+ * so that the writes to `u` are contiguous.
  */
 
-void lua_init_sim(lua_State *L, central2d_t *sim)
+static int lua_init_rows(lua_State *L, central2d_t *sim, int iy0, int iy1)
 {
-    lua_getfield(L, 1, "init");
-    if (lua_type(L, -1) != LUA_TFUNCTION)
-        luaL_error(L, "Expected init to be a string");
-
-    int nx = sim->nx, ny = sim->ny, nfield = sim->nfield;
+    int nx = sim->nx, nfield = sim->nfield;
     float dx = sim->dx, dy = sim->dy;
     float *u = sim->u;
 
-    for (int ix = 0; ix < nx; ++ix)
+    for (int iy = iy0; iy < iy1; ++iy)
     {
-        float x = (ix + 0.5) * dx;
-        for (int iy = 0; iy < ny; ++iy)
+        float y = (iy + 0.5) * dy;
+        for (int ix = 0; ix < nx; ++ix)
         {
-            float y = (iy + 0.5) * dy;
+            float x = (ix + 0.5) * dx;
             lua_pushvalue(L, -1);
             lua_pushnumber(L, x);
             lua_pushnumber(L, y);
-            lua_call(L, 2, nfield);
+            int status = lua_pcall(L, 2, nfield, 0);
+            if (status != LUA_OK)
+                return status;
             for (int k = 0; k < nfield; ++k)
                 u[central2d_offset(sim, k, ix, iy)] = lua_tonumber(L, k - nfield);
             lua_pop(L, nfield);
         }
     }
+    return LUA_OK;
+}
+
+/**
+ * On a big grid, calling Lua once per cell takes longer than the
+ * simulation, so we call it from all the threads at once.  A Lua
+ * state can only be used by one thread at a time, so each thread
+ * gets a fresh state with a copy of the `init` function (made with
+ * `string.dump`) and of the global variables that are plain numbers,
+ * strings, or booleans, and fills its own band of rows.  A dumped
+ * function loses its upvalues apart from the global table, so if
+ * `init` refers to local variables of the script (or is a C function),
+ * we quietly fall back to calling it from the main state.  We can't
+ * tell up front whether `init` needs a global we didn't copy (a
+ * helper function or a table of parameters), so if any thread's call
+ * fails, we do the same: the main state fills the whole grid again,
+ * and raises the error itself if `init` really is broken.
+ */
+
+static void lua_copy_globals(lua_State *to, lua_State *from)
+{
+    lua_pushglobaltable(from);
+    lua_pushnil(from);
+    while (lua_next(from, -2))
+    {
+        if (lua_type(from, -2) == LUA_TSTRING)
+        {
+            const char *name = lua_tostring(from, -2);
+            lua_getglobal(to, name);
+            bool unset = lua_isnil(to, -1);
+            lua_pop(to, 1);
+            size_t len;
+            switch (unset ? lua_type(from, -1) : LUA_TNONE)
+            {
+            case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+                if (lua_isinteger(from, -1))
+                    lua_pushinteger(to, lua_tointeger(from, -1));
+                else
+#endif
+                    lua_pushnumber(to, lua_tonumber(from, -1));
+                lua_setglobal(to, name);
+                break;
+            case LUA_TSTRING:
+                lua_pushlstring(to, lua_tolstring(from, -1, &len), len);
+                lua_setglobal(to, name);
+                break;
+            case LUA_TBOOLEAN:
+                lua_pushboolean(to, lua_toboolean(from, -1));
+                lua_setglobal(to, name);
+                break;
+            }
+        }
+        lua_pop(from, 1);
+    }
+    lua_pop(from, 1);
+}
+
+static bool lua_init_parallel(lua_State *L, central2d_t *sim, int threads)
+{
+#ifdef _OPENMP
+    // Only the first upvalue (the global table) survives the copy
+    const char *up1 = lua_getupvalue(L, -1, 1);
+    if (up1)
+        lua_pop(L, 1);
+    const char *up2 = lua_getupvalue(L, -1, 2);
+    if (up2)
+        lua_pop(L, 1);
+    if (up2 || (up1 && strcmp(up1, "_ENV") != 0))
+        return false;
+
+    lua_getglobal(L, "string");
+    lua_getfield(L, -1, "dump");
+    lua_remove(L, -2);
+    lua_pushvalue(L, -2);
+    if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+    {
+        lua_pop(L, 1);
+        return false;
+    }
+    size_t len;
+    const char *code = lua_tolstring(L, -1, &len);
+
+    lua_State **Ls = (lua_State **) malloc(threads * sizeof(lua_State *));
+    bool loaded = true;
+    for (int t = 0; t < threads; ++t)
+    {
+        Ls[t] = luaL_newstate();
+        luaL_openlibs(Ls[t]);
+        lua_copy_globals(Ls[t], L);
+        loaded = loaded && (luaL_loadbuffer(Ls[t], code, len, "init") == LUA_OK);
+    }
+    lua_pop(L, 1);
+
+    bool ok = loaded;
+    if (loaded)
+    {
+        int ny = sim->ny;
+#pragma omp parallel num_threads(threads)
+        {
+            int t = omp_get_thread_num();
+            int iy0 = (long)t * ny / threads;
+            int iy1 = (long)(t + 1) * ny / threads;
+            if (lua_init_rows(Ls[t], sim, iy0, iy1) != LUA_OK)
+            {
+#pragma omp critical
+                ok = false;
+            }
+        }
+    }
+
+    for (int t = 0; t < threads; ++t)
+        lua_close(Ls[t]);
+    free(Ls);
+    return ok;
+#else
+    return false;
+#endif
+}
+
+/**
+ * We can skip Lua altogether if the initial conditions are already
+ * on hand (e.g. from a file).  In that case, `init` is a table with
+ * an entry per field, which is either a number (for a constant
+ * field), a string holding `nx*ny` packed single-precision values in
+ * row-major order (as written by `string.pack` or read from a raw
+ * file), or a Lua array of `nx*ny` numbers in the same order.
+ */
+
+static void lua_init_raster(lua_State *L, central2d_t *sim, int threads)
+{
+    int nx = sim->nx, ny = sim->ny;
+    float *u = sim->u;
+
+    for (int k = 0; k < sim->nfield; ++k)
+    {
+        lua_rawgeti(L, -1, k + 1);
+        int type = lua_type(L, -1);
+        if (type == LUA_TNUMBER)
+        {
+            float value = lua_tonumber(L, -1);
+#pragma omp parallel for num_threads(threads)
+            for (int iy = 0; iy < ny; ++iy)
+                for (int ix = 0; ix < nx; ++ix)
+                    u[central2d_offset(sim, k, ix, iy)] = value;
+        }
+        else if (type == LUA_TSTRING)
+        {
+            size_t len;
+            const char *raster = lua_tolstring(L, -1, &len);
+            if (len != (size_t)nx * ny * sizeof(float))
+                luaL_error(L, "init[%d] should hold %d x %d floats", k + 1, nx, ny);
+#pragma omp parallel for num_threads(threads)
+            for (int iy = 0; iy < ny; ++iy)
+                memcpy(u + central2d_offset(sim, k, 0, iy),
+                       raster + (size_t)iy * nx * sizeof(float),
+                       nx * sizeof(float));
+        }
+        else if (type == LUA_TTABLE)
+        {
+            if (lua_rawlen(L, -1) != (size_t)nx * ny)
+                luaL_error(L, "init[%d] should hold %d x %d values", k + 1, nx, ny);
+            for (int iy = 0; iy < ny; ++iy)
+                for (int ix = 0; ix < nx; ++ix)
+                {
+                    lua_rawgeti(L, -1, (lua_Integer)iy * nx + ix + 1);
+                    u[central2d_offset(sim, k, ix, iy)] = lua_tonumber(L, -1);
+                    lua_pop(L, 1);
+                }
+        }
+        else
+            luaL_error(L, "init[%d] should be a number, a string, or an array", k + 1);
+        lua_pop(L, 1);
+    }
+}
+
+void lua_init_sim(lua_State *L, central2d_t *sim, int threads)
+{
+    lua_getfield(L, 1, "init");
+#ifdef _OPENMP
+    if (threads < 1)
+        threads = omp_get_max_threads();
+#endif
+    if (lua_type(L, -1) == LUA_TTABLE)
+        lua_init_raster(L, sim, threads);
+    else if (lua_type(L, -1) != LUA_TFUNCTION)
+        luaL_error(L, "Expected init to be a function or a table");
+    else if (threads <= 1 || !lua_init_parallel(L, sim, threads))
+    {
+        if (lua_init_rows(L, sim, 0, sim->ny) != LUA_OK)
+            lua_error(L);
+    }
+    lua_pop(L, 1);
+}
+
+/**
+ * ### Blocking parameters
+ *
+ * The `tbatch` field of the simulation table sets how many pairs of
+ * time steps the solver takes between halo exchanges, and `tile_nx`
+ * and `tile_ny` fix the tile size (by default the solver sizes tiles
+ * to fit in cache).  Setting `tbatch` to `"auto"` (passed to us as
+ * zero) has the solver time a few choices on the actual grid and
+ * thread count and keep the fastest.  Setting `tiling` to
+ * `"wavefront"` replaces the halo tiles with bands swept by
+ * trapezoids in space and time, which take `tbatch` step pairs per
+ * sweep without redoing any cells (the default is `"halo"`).
+ * Setting `layout` to `"rows"` interleaves the fields a row at a time
+ * rather than keeping each in a plane of its own (`"planes"`); if it
+ * isn't set, we keep the layout the solution came in (planes for a
+ * fresh start, whatever the checkpoint had for a restart).
+ */
+
+static int layout_parse(lua_State *L, int idx)
+{
+    if (lua_isnoneornil(L, idx))
+        return -1;
+    const char *name = luaL_checkstring(L, idx);
+    if (strcmp(name, "planes") == 0)
+        return CENTRAL2D_LAYOUT_PLANES;
+    if (strcmp(name, "rows") == 0)
+        return CENTRAL2D_LAYOUT_ROWS;
+    return luaL_error(L, "layout must be \"planes\" or \"rows\"");
+}
+
+static const char *layout_name(int layout)
+{
+    return layout == CENTRAL2D_LAYOUT_ROWS ? "rows" : "planes";
+}
+
+void set_blocking(central2d_t *sim, int tiling, int layout, int tbatch,
+                  int tile_nx, int tile_ny, int threads)
+{
+    if (layout >= 0)
+        central2d_set_layout(sim, layout);
+    sim->tiling = tiling;
+    sim->tile_nx = tile_nx;
+    sim->tile_ny = tile_ny;
+    if (tbatch > 0)
+        sim->tbatch = tbatch;
+    else {
+        central2d_autotune(sim, threads);
+        printf("Autotuned tbatch: %d, tile size: %d x %d\n",
+               sim->tbatch, sim->tile_nx, sim->tile_ny);
+    }
+}
+
+/**
+ * ### Time step
+ *
+ * By default, every batch of steps takes the largest time step the
+ * CFL condition allows.  Setting the `dt` field of the simulation
+ * table to a number fixes the time step instead, and setting it to
+ * `"lagged"` picks the time step from the wave speeds one batch back
+ * (scaled by `dt_safety`, 0.9 by default) and has the solver check
+ * it afterward.
+ */
+
+void set_timestep(central2d_t *sim, int dt_mode, double dt, double dt_safety)
+{
+    sim->dt_mode = dt_mode;
+    sim->dt_fixed = dt;
+    sim->dt_safety = dt_safety;
+}
+
+/**
+ * ### Probes
+ *
+ * The `probes` field of the simulation table is a list of probes.
+ * Each one is either a point, `{x, y}`, or a polyline through two or
+ * more points, `{{x1, y1}, {x2, y2}, ...}`, and may have a `name`.
+ * The solver samples every field at the probe cells after every pair
+ * of time steps, and we write all the samples to `probe_out`
+ * (`"probes.out"` by default) at the end of the run; see `stepper.h`
+ * for the format.  With probes in place, setting `out = false` turns
+ * off the frame output altogether.
+ */
+
+static float lua_probe_coord(lua_State *L, int index, int i, int p)
+{
+    lua_rawgeti(L, index, i);
+    if (lua_type(L, -1) != LUA_TNUMBER)
+        luaL_error(L, "Probe %d: expected a number", p);
+    float x = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return x;
+}
+
+void lua_add_probes(lua_State *L, central2d_t *sim)
+{
+    lua_getfield(L, 1, "probes");
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        return;
+    }
+    if (!lua_istable(L, -1))
+        luaL_error(L, "Expected probes to be a table");
+    int nprobe = lua_rawlen(L, -1);
+    for (int p = 1; p <= nprobe; ++p)
+    {
+        lua_rawgeti(L, -1, p);
+        if (!lua_istable(L, -1))
+            luaL_error(L, "Probe %d must be a table", p);
+        int n = lua_rawlen(L, -1);
+        float *xy = (float *) lua_newuserdata(L, 2 * (n > 1 ? n : 1) * sizeof(float));
+        lua_rawgeti(L, -2, 1);
+        bool point = (lua_type(L, -1) == LUA_TNUMBER);
+        lua_pop(L, 1);
+        if (point)
+        {
+            xy[0] = lua_probe_coord(L, -2, 1, p);
+            xy[1] = lua_probe_coord(L, -2, 2, p);
+            n = 1;
+        }
+        for (int i = 0; !point && i < n; ++i)
+        {
+            lua_rawgeti(L, -2, i + 1);
+            if (!lua_istable(L, -1))
+                luaL_error(L, "Probe %d: expected {x, y} pairs", p);
+            xy[2 * i + 0] = lua_probe_coord(L, -1, 1, p);
+            xy[2 * i + 1] = lua_probe_coord(L, -1, 2, p);
+            lua_pop(L, 1);
+        }
+        lua_getfield(L, -2, "name");
+        char name[32];
+        if (lua_type(L, -1) == LUA_TSTRING)
+            snprintf(name, sizeof(name), "%s", lua_tostring(L, -1));
+        else
+            snprintf(name, sizeof(name), "probe%d", p);
+        if (n < 1 || central2d_probe(sim, name, xy, n) < 0)
+            luaL_error(L, "Could not add probe %d", p);
+        lua_pop(L, 3);
+    }
+    lua_pop(L, 1);
+}
+
+/**
+ * ### Checkpoints
+ *
+ * If the simulation table names a `restart` file, we pick up the
+ * solver state (grid, fields, and time) from that checkpoint rather
+ * than evaluating the initial conditions, and a normal run carries
+ * on from the frame the checkpoint was taken at.  The strong scaling
+ * trials also start from the checkpoint, so they skip the initial
+ * conditions too.  With `checkpoint` set, a normal run saves its state
+ * there every `checkpoint_every` frames (10 by default, and at least
+ * 1) and at the end.
+ */
+
+central2d_t *start_sim(lua_State *L, const char *restart,
+                       double w, double h, int nx, int ny, double cfl,
+                       int threads)
+{
+    central2d_t *sim;
+    if (restart)
+    {
+        sim = central2d_restart(restart, shallow2d_flux, shallow2d_speed);
+        if (!sim || sim->nfield != 3)
+        {
+            if (sim)
+                central2d_free(sim);
+            luaL_error(L, "Could not restart from %s", restart);
+        }
+    }
+    else
+    {
+        sim = central2d_init(w, h, nx, ny,
+                             3, shallow2d_flux, shallow2d_speed, cfl);
+        lua_init_sim(L, sim, threads);
+    }
+    return sim;
+}
 
+/**
+ * ### Timing
+ *
+ * We can use the OpenMP timing routines (preferable if OpenMP is
+ * available) or the POSIX `gettimeofday` if the `SYSTIME` macro is
+ * defined.  If there's no OpenMP and `SYSTIME` is undefined, all times
+ * are zero, and we just report step counts.
+ */
+
+static double wall_time(void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#elif defined SYSTIME
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec * 1e-6;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * ### Benchmarks
+ *
+ * If no thread count is given, we benchmark instead of running the
+ * simulation once.  The settings come from the `bench` field of the
+ * simulation table, all optional:
+ *
+ * - `threads`: list of thread counts (default: powers of two up to
+ *   the number of processors)
+ * - `nx`: list of grid sizes (default: just the `nx` of the table;
+ *   grids are square unless the table sets `ny`, and then keep its
+ *   aspect ratio)
+ * - `scaling`: `"strong"` to keep the grid fixed as the thread count
+ *   changes, `"weak"` to grow `ny` with the thread count (relative to
+ *   the first one), or `"both"` (the default)
+ * - `reps`: timed repetitions per case (default 5)
+ * - `warmup`: untimed repetitions before those (default 1)
+ * - `csv`: file to append one line per case to (default
+ *   `"bench.csv"`; the header is written when the file is new)
+ * - `json`: file to write all the cases of this run to (default none)
+ * - `profile`: file for a gperftools CPU profile of the whole
+ *   benchmark (default none; the profiler is off otherwise)
+ *
+ * Each repetition starts from the same initial state (evaluated once
+ * per grid; strong scaling starts from the `restart` checkpoint if
+ * there is one, and then only uses its grid) and runs `frames` frames of `ftime`; the
+ * tiles are set up before the clock starts.  So that every case takes
+ * some steps to divide by, `frames` must be at least 1 and `ftime`
+ * positive.  For each case we report
+ * the median, minimum and standard deviation of the run time, the
+ * time per step (from the step counts that `central2d_run` returns)
+ * and the cell updates per second, both based on the median.  If
+ * `tbatch` is `"auto"`, we tune once per case, in the first warmup
+ * run (or the first timed run if there is no warmup).
+ */
+
+typedef struct solver_opts_t {
+    double w, h, cfl, ftime;
+    int nx, ny, frames;
+    int tiling, layout, tbatch, tile_nx, tile_ny;
+    int dt_mode;
+    double dt, dt_safety;
+    const char *restart;
+} solver_opts_t;
+
+typedef struct bench_result_t {
+    const char *scaling;
+    const char *layout;
+    int threads, nx, ny;
+    int tbatch, tile_sx, tile_sy;
+    int steps, reps;
+    double median, min, stddev;
+} bench_result_t;
+
+#define BENCH_MAX_LIST 64
+
+// Read a list of positive integers from field `name` of the table on top
+static int lua_int_list(lua_State *L, const char *name, int *list)
+{
+    lua_getfield(L, -1, name);
+    int n = 0;
+    if (lua_istable(L, -1))
+    {
+        int len = lua_rawlen(L, -1);
+        for (int i = 1; i <= len && n < BENCH_MAX_LIST; ++i)
+        {
+            lua_rawgeti(L, -1, i);
+            int v = lua_tointeger(L, -1);
+            if (v > 0)
+                list[n++] = v;
+            lua_pop(L, 1);
+        }
+    }
+    else if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0)
+        list[n++] = lua_tointeger(L, -1);
     lua_pop(L, 1);
+    return n;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Time one case; returns the median time, and fills in the rest
+static void bench_case(central2d_t *init,
+                       const solver_opts_t *opts, int threads,
+                       int reps, int warmup, bench_result_t *r)
+{
+    double *times = (double *) malloc(reps * sizeof(double));
+    int tbatch = opts->tbatch;
+    int tile_nx = opts->tile_nx, tile_ny = opts->tile_ny;
+
+    for (int k = 0; k < warmup + reps; ++k)
+    {
+        central2d_t *sim = central2d_init(init->dx * init->nx,
+                                          init->dy * init->ny,
+                                          init->nx, init->ny, init->nfield,
+                                          init->flux, init->speed, init->cfl);
+        central2d_set_layout(sim, init->layout);
+        for (int f = 0; f < init->nfield; ++f)
+            for (int iy = 0; iy < init->ny; ++iy)
+                memcpy(sim->u + central2d_offset(sim, f, 0, iy),
+                       init->u + central2d_offset(init, f, 0, iy),
+                       init->nx * sizeof(float));
+        sim->time = init->time;
+        set_timestep(sim, opts->dt_mode, opts->dt, opts->dt_safety);
+        set_blocking(sim, opts->tiling, opts->layout, tbatch,
+                     tile_nx, tile_ny, threads);
+        tbatch = sim->tbatch;
+        tile_nx = sim->tile_nx;
+        tile_ny = sim->tile_ny;
+        central2d_setup(sim, threads);
+
+        int steps = 0;
+        double t0 = wall_time();
+        for (int i = 0; i < opts->frames; ++i)
+            steps += central2d_run(sim, opts->ftime, threads);
+        double elapsed = wall_time() - t0;
+        if (k >= warmup)
+            times[k - warmup] = elapsed;
+        r->steps = steps;
+        r->tbatch = sim->tbatch;
+        r->layout = layout_name(sim->layout);
+        int x0, y0;
+        r->tile_sx = r->tile_sy = 0;
+        if (central2d_tile_count(sim) > 0)
+            central2d_tile_rect(sim, 0, &x0, &y0, &r->tile_sx, &r->tile_sy);
+        central2d_free(sim);
+    }
+
+    double mean = 0, var = 0;
+    for (int k = 0; k < reps; ++k)
+        mean += times[k] / reps;
+    for (int k = 0; k < reps; ++k)
+        var += (times[k] - mean) * (times[k] - mean);
+    qsort(times, reps, sizeof(double), compare_double);
+    r->threads = threads;
+    r->nx = init->nx;
+    r->ny = init->ny;
+    r->reps = reps;
+    r->min = times[0];
+    r->median = (reps % 2 ? times[reps / 2] :
+                 0.5 * (times[reps / 2 - 1] + times[reps / 2]));
+    r->stddev = (reps > 1 ? sqrt(var / (reps - 1)) : 0);
+    free(times);
+}
+
+static double bench_updates(const bench_result_t *r)
+{
+    return r->median > 0 ? (double) r->nx * r->ny * r->steps / r->median : 0;
+}
+
+static void bench_write(const char *csv, const char *json,
+                        bench_result_t *results, int nresult)
+{
+    char host[256] = "unknown", date[64];
+    gethostname(host, sizeof(host));
+    host[sizeof(host) - 1] = 0;
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+#ifdef __VERSION__
+    const char *compiler = __VERSION__;
+#else
+    const char *compiler = "unknown";
+#endif
+    const char *simd = simd_name(simd_detect());
+
+    FILE *fp = NULL;
+    if (csv && (fp = fopen(csv, "a")) != NULL)
+    {
+        if (ftell(fp) == 0)
+            fprintf(fp, "date,host,compiler,simd,scaling,threads,nx,ny,"
+                    "layout,tbatch,tile_sx,tile_sy,steps,reps,median_s,"
+                    "min_s,stddev_s,step_s,cell_updates_per_s\n");
+        for (int i = 0; i < nresult; ++i)
+        {
+            bench_result_t *r = results + i;
+            fprintf(fp, "%s,%s,\"%s\",%s,%s,%d,%d,%d,%s,%d,%d,%d,%d,%d,"
+                    "%.6e,%.6e,%.6e,%.6e,%.6e\n",
+                    date, host, compiler, simd, r->scaling, r->threads,
+                    r->nx, r->ny, r->layout, r->tbatch, r->tile_sx,
+                    r->tile_sy, r->steps, r->reps, r->median, r->min,
+                    r->stddev,
+                    r->median / r->steps, bench_updates(r));
+        }
+        fclose(fp);
+    }
+    else if (csv)
+        fprintf(stderr, "Could not write %s\n", csv);
+
+    if (json && (fp = fopen(json, "w")) != NULL)
+    {
+        fprintf(fp, "{\n  \"date\": \"%s\",\n  \"host\": \"%s\",\n"
+                "  \"compiler\": \"%s\",\n  \"simd\": \"%s\",\n"
+                "  \"results\": [\n", date, host, compiler, simd);
+        for (int i = 0; i < nresult; ++i)
+        {
+            bench_result_t *r = results + i;
+            fprintf(fp, "    {\"scaling\": \"%s\", \"threads\": %d, "
+                    "\"nx\": %d, \"ny\": %d, \"layout\": \"%s\", "
+                    "\"tbatch\": %d, "
+                    "\"tile_sx\": %d, \"tile_sy\": %d, \"steps\": %d, "
+                    "\"reps\": %d, \"median_s\": %.6e, \"min_s\": %.6e, "
+                    "\"stddev_s\": %.6e, \"step_s\": %.6e, "
+                    "\"cell_updates_per_s\": %.6e}%s\n",
+                    r->scaling, r->threads, r->nx, r->ny, r->layout,
+                    r->tbatch,
+                    r->tile_sx, r->tile_sy, r->steps, r->reps, r->median,
+                    r->min, r->stddev, r->median / r->steps,
+                    bench_updates(r), i + 1 < nresult ? "," : "");
+        }
+        fprintf(fp, "  ]\n}\n");
+        fclose(fp);
+    }
+    else if (json)
+        fprintf(stderr, "Could not write %s\n", json);
+}
+
+void run_bench(lua_State *L, const solver_opts_t *opts)
+{
+    int thread_list[BENCH_MAX_LIST], nx_list[BENCH_MAX_LIST];
+    int nthread = 0, ngrid = 0;
+    int reps = 5, warmup = 1;
+    const char *scaling = "both";
+    const char *csv = "bench.csv", *json = NULL, *profile = NULL;
+
+    lua_getfield(L, 1, "bench");
+    if (lua_istable(L, -1))
+    {
+        nthread = lua_int_list(L, "threads", thread_list);
+        ngrid = lua_int_list(L, "nx", nx_list);
+        lua_getfield(L, -1, "reps");
+        lua_getfield(L, -2, "warmup");
+        lua_getfield(L, -3, "scaling");
+        lua_getfield(L, -4, "csv");
+        lua_getfield(L, -5, "json");
+        lua_getfield(L, -6, "profile");
+        reps = luaL_optinteger(L, -6, 5);
+        warmup = luaL_optinteger(L, -5, 1);
+        scaling = luaL_optstring(L, -4, "both");
+        csv = luaL_optstring(L, -3, "bench.csv");
+        json = luaL_optstring(L, -2, NULL);
+        profile = luaL_optstring(L, -1, NULL);
+        lua_pop(L, 6);
+    }
+    else if (!lua_isnil(L, -1))
+        luaL_error(L, "Expected bench to be a table");
+    lua_pop(L, 1);
+    if (reps < 1)
+        reps = 1;
+    if (warmup < 0)
+        warmup = 0;
+    bool strong = strcmp(scaling, "weak") != 0;
+    bool weak = strcmp(scaling, "strong") != 0;
+    if (!strong && !weak)
+        luaL_error(L, "bench.scaling must be \"strong\", \"weak\" or \"both\"");
+    if (opts->frames < 1)
+        luaL_argerror(L, 1, "frames must be at least 1 to benchmark");
+    if (!(opts->ftime > 0))
+        luaL_argerror(L, 1, "ftime must be positive to benchmark");
+
+    if (nthread == 0)
+    {
+        int nproc = 1;
+#ifdef _OPENMP
+        nproc = omp_get_num_procs();
+#endif
+        for (int t = 1; t <= nproc && nthread < BENCH_MAX_LIST; t *= 2)
+            thread_list[nthread++] = t;
+    }
+    if (ngrid == 0 || opts->restart)
+    {
+        nx_list[0] = opts->nx;
+        ngrid = 1;
+    }
+
+    int ncase = ngrid * nthread * ((int) strong + (int) weak);
+    bench_result_t *results =
+        (bench_result_t *) calloc(ncase, sizeof(bench_result_t));
+    int nresult = 0;
+    if (profile)
+        ProfilerStart(profile);
+
+    printf("%-6s %7s %6s %6s %-6s %6s %5s %11s %11s %11s %11s %11s\n",
+           "scale", "threads", "nx", "ny", "layout", "tbatch", "steps",
+           "median(s)", "min(s)", "stddev(s)", "step(s)", "updates/s");
+    for (int g = 0; g < ngrid; ++g)
+    {
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            bool weak_pass = (pass == 1);
+            if ((weak_pass && !weak) || (!weak_pass && !strong))
+                continue;
+            central2d_t *init = NULL;
+            for (int i = 0; i < nthread; ++i)
+            {
+                int threads = thread_list[i];
+                int nx = nx_list[g];
+                int ny = (int) ((double) opts->ny * nx / opts->nx + 0.5);
+                if (weak_pass)
+                    ny = (int) ((double) ny * threads / thread_list[0] + 0.5);
+                double h = opts->h * ny / opts->ny * opts->nx / nx;
+                bool from_restart = opts->restart && !weak_pass;
+                if (!init || (!from_restart &&
+                              (init->nx != nx || init->ny != ny)))
+                {
+                    if (init)
+                        central2d_free(init);
+                    init = start_sim(L, from_restart ? opts->restart : NULL,
+                                     opts->w, h, nx, ny, opts->cfl, threads);
+                }
+
+                bench_result_t *r = results + nresult++;
+                r->scaling = weak_pass ? "weak" : "strong";
+                bench_case(init, opts, threads, reps, warmup, r);
+                printf("%-6s %7d %6d %6d %-6s %6d %5d %11.4e %11.4e %11.4e "
+                       "%11.4e %11.4e\n", r->scaling, r->threads, r->nx,
+                       r->ny, r->layout, r->tbatch, r->steps, r->median,
+                       r->min, r->stddev, r->median / r->steps,
+                       bench_updates(r));
+            }
+            central2d_free(init);
+        }
+    }
+
+    if (profile)
+        ProfilerStop();
+    bench_write(csv, json, results, nresult);
+    free(results);
 }
 
 /**
@@ -148,12 +852,14 @@ void lua_init_sim(lua_State *L, central2d_t *sim)
  * The `run_sim` function looks a lot like the main routine of the
  * "ordinary" command line driver.  We specify the initial conditions
  * by providing the simulator with a callback function to be called at
- * each cell center.  Note that we have two different options for
- * timing the steps -- we can use the OpenMP timing routines
- * (preferable if OpenMP is available) or the POSIX `gettimeofday`
- * if the `SYSTIME` macro is defined.  If there's no OpenMP and
- * `SYSTIME` is undefined, we fall back to just printing the number
- * of steps without timing information.
+ * each cell center.  Without a thread count, it runs the benchmarks
+ * above instead.  Setting `roofline = true` in the simulation table
+ * adds a roofline report at the end of a normal run (see
+ * `roofline.h`), with the time stepping, the conservation checks, and
+ * the frame output as separate phases.  Setting `trace` to a file
+ * name records a timeline of the run there (see `trace.h`).  Setting
+ * `pages` to `"thp"` or `"hugetlb"` backs the solver's large arrays
+ * with transparent or explicit huge pages (see `stepper.h`).
  */
 
 int run_sim(lua_State *L)
@@ -172,6 +878,27 @@ int run_sim(lua_State *L)
     lua_getfield(L, 1, "frames");
     lua_getfield(L, 1, "out");
     lua_getfield(L, 1, "threads");
+    lua_getfield(L, 1, "tbatch");
+    lua_getfield(L, 1, "tile_nx");
+    lua_getfield(L, 1, "tile_ny");
+    lua_getfield(L, 1, "dt");
+    lua_getfield(L, 1, "dt_safety");
+    lua_getfield(L, 1, "restart");
+    lua_getfield(L, 1, "checkpoint");
+    lua_getfield(L, 1, "checkpoint_every");
+    lua_getfield(L, 1, "write_lag");
+    lua_getfield(L, 1, "out_fields");
+    lua_getfield(L, 1, "out_bits");
+    lua_getfield(L, 1, "out_error");
+    lua_getfield(L, 1, "out_compress");
+    lua_getfield(L, 1, "stream");
+    lua_getfield(L, 1, "stream_slots");
+    lua_getfield(L, 1, "probe_out");
+    lua_getfield(L, 1, "roofline");
+    lua_getfield(L, 1, "trace");
+    lua_getfield(L, 1, "tiling");
+    lua_getfield(L, 1, "layout");
+    lua_getfield(L, 1, "pages");
 
     double w = luaL_optnumber(L, 2, 2.0);
     double h = luaL_optnumber(L, 3, w);
@@ -181,145 +908,164 @@ int run_sim(lua_State *L)
     int ny = luaL_optinteger(L, 7, nx);
     int vskip = luaL_optinteger(L, 8, 1);
     int frames = luaL_optinteger(L, 9, 50);
-    const char *fname = luaL_optstring(L, 10, "sim.out");
+    const char *fname = NULL;
+    if (lua_type(L, 10) != LUA_TBOOLEAN || lua_toboolean(L, 10))
+        fname = luaL_optstring(L, 10, "sim.out");
     int threads = luaL_optinteger(L, 11, -1);
-    lua_pop(L, 9);
+    int tbatch = 0;
+    if (lua_type(L, 12) != LUA_TSTRING || strcmp(lua_tostring(L, 12), "auto"))
+        tbatch = luaL_optinteger(L, 12, 1);
+    int tile_nx = luaL_optinteger(L, 13, 0);
+    int tile_ny = luaL_optinteger(L, 14, tile_nx);
+    int dt_mode = CENTRAL2D_DT_CFL;
+    double dt = 0;
+    if (lua_type(L, 15) == LUA_TSTRING) {
+        const char *mode = lua_tostring(L, 15);
+        if (strcmp(mode, "lagged") == 0)
+            dt_mode = CENTRAL2D_DT_LAGGED;
+        else if (strcmp(mode, "cfl") != 0)
+            luaL_error(L, "dt must be a number, \"cfl\", or \"lagged\"");
+    } else if (!lua_isnoneornil(L, 15)) {
+        dt_mode = CENTRAL2D_DT_FIXED;
+        dt = luaL_checknumber(L, 15);
+    }
+    double dt_safety = luaL_optnumber(L, 16, 0.9);
+    const char *restart = luaL_optstring(L, 17, NULL);
+    const char *checkpoint = luaL_optstring(L, 18, NULL);
+    int checkpoint_every = luaL_optinteger(L, 19, 10);
+    if (checkpoint_every < 1)
+        luaL_argerror(L, 1, "checkpoint_every must be at least 1");
+    viz_opts_t viz_opts;
+    viz_opts.vskip = vskip;
+    viz_opts.lag = luaL_optinteger(L, 20, 2);
+    const char *out_fields = luaL_optstring(L, 21, "h");
+    if (strcmp(out_fields, "h") == 0)
+        viz_opts.nfield = 1;
+    else if (strcmp(out_fields, "all") == 0)
+        viz_opts.nfield = 3;
+    else
+        luaL_error(L, "out_fields must be \"h\" or \"all\"");
+    viz_opts.bits = luaL_optinteger(L, 22, 0);
+    viz_opts.error = luaL_optnumber(L, 23, 0);
+    viz_opts.compress = luaL_optinteger(L, 24, 1);
+    viz_opts.threads = (threads > 0 ? threads : 1);
+    const char *stream = luaL_optstring(L, 25, NULL);
+    int stream_slots = luaL_optinteger(L, 26, 4);
+    const char *probe_out = luaL_optstring(L, 27, "probes.out");
+    bool roofline = lua_toboolean(L, 28);
+    const char *trace = luaL_optstring(L, 29, NULL);
+    const char *tiling_name = luaL_optstring(L, 30, "halo");
+    int tiling = CENTRAL2D_TILING_HALO;
+    if (strcmp(tiling_name, "wavefront") == 0)
+        tiling = CENTRAL2D_TILING_WAVEFRONT;
+    else if (strcmp(tiling_name, "halo") != 0)
+        luaL_error(L, "tiling must be \"halo\" or \"wavefront\"");
+    int layout = layout_parse(L, 31);
+    const char *pages = luaL_optstring(L, 32, "default");
+    if (strcmp(pages, "thp") == 0)
+        central2d_set_pages(CENTRAL2D_PAGES_THP);
+    else if (strcmp(pages, "hugetlb") == 0)
+        central2d_set_pages(CENTRAL2D_PAGES_HUGETLB);
+    else if (strcmp(pages, "default") != 0)
+        luaL_error(L, "pages must be \"default\", \"thp\" or \"hugetlb\"");
+    lua_pop(L, 31);
     setvbuf(stdout, NULL, _IONBF, 0);
 
-    printf("%i\n",threads);
     if (threads == -1)
     {
-        ProfilerStart("shallow.prof");
-        printf("Begin strong scaling\n");
-        for (int threads = 1; threads <= 8; threads *= 2)
-        {
-            double avg_time = 0.0;
-            for (int k = 0; k < 3; k++)
-            {
-                central2d_t *sim = central2d_init(w, h, nx, ny,
-                                                  3, shallow2d_flux, shallow2d_speed, cfl);
-                lua_init_sim(L, sim);
-                // printf("%g %g %d %d %g %d %g\n", w, h, nx, ny, cfl, frames, ftime);
-                //FILE* viz = viz_open(fname, sim, vskip);
-                //solution_check(sim);
-                //viz_frame(viz, sim, vskip);
-
-                double tcompute = 0;
-                for (int i = 0; i < frames; ++i)
-                {
-#ifdef _OPENMP
-                    double t0 = omp_get_wtime();
-                    int nstep = central2d_run(sim, ftime, threads);
-                    double t1 = omp_get_wtime();
-                    double elapsed = t1 - t0;
-#elif defined SYSTIME
-                    struct timeval t0, t1;
-                    gettimeofday(&t0, NULL);
-                    int nstep = central2d_run(sim, ftime, threads);
-                    gettimeofday(&t1, NULL);
-                    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) * 1e-6;
-#else
-                    int nstep = central2d_run(sim, ftime, threads);
-                    double elapsed = 0;
-#endif
-                    // solution_check(sim);
-                    tcompute += elapsed;
-                    //printf("  Time: %e (%e for %d steps)\n", elapsed, elapsed/nstep, nstep);
-                    //viz_frame(viz, sim, vskip);
-                }
-                avg_time += tcompute;
+        solver_opts_t opts = {w, h, cfl, ftime, nx, ny, frames,
+                              tiling, layout, tbatch, tile_nx, tile_ny,
+                              dt_mode, dt, dt_safety, restart};
+        run_bench(L, &opts);
+    }
+    else
+    {
+        central2d_t *sim = start_sim(L, restart, w, h, nx, ny, cfl, threads);
+        int first = (int)(sim->time / ftime + 0.5);
+        if (trace && !trace_open(trace))
+            fprintf(stderr, "Could not open trace %s\n", trace);
 
-                //viz_close(viz);
-                central2d_free(sim);
-            }
-            avg_time /= 3.0;
-            printf("Threads %i: Height: %i, Average compute time: %e\n", threads, ny, avg_time);
+        lua_add_probes(L, sim);
+
+        // Start the writer before the solver pins this thread to a CPU
+        viz_t *viz = NULL;
+        if (fname && restart)
+            viz = viz_reopen(fname, sim, &viz_opts, first);
+        else if (fname)
+        {
+            viz = viz_open(fname, sim, &viz_opts);
+            viz_frame(viz, sim);
         }
-        printf("Begin weak scaling\n");
-        for (int threads = 1; threads <= 8; threads *= 2)
+        vizshm_t *shm = NULL;
+        if (stream)
         {
-            double avg_time = 0.0;
-            for (int k = 0; k < 3; k++)
-            {
-                central2d_t *sim = central2d_init(w, h, nx, ny,
-                                                  3, shallow2d_flux, shallow2d_speed, cfl);
-                lua_init_sim(L, sim);
-                // printf("%g %g %d %d %g %d %g\n", w, h, nx, ny, cfl, frames, ftime);
-                //FILE* viz = viz_open(fname, sim, vskip);
-                //solution_check(sim);
-                //viz_frame(viz, sim, vskip);
-
-                double tcompute = 0;
-                for (int i = 0; i < frames; ++i)
-                {
-#ifdef _OPENMP
-                    double t0 = omp_get_wtime();
-                    int nstep = central2d_run(sim, ftime, threads);
-                    double t1 = omp_get_wtime();
-                    double elapsed = t1 - t0;
-#elif defined SYSTIME
-                    struct timeval t0, t1;
-                    gettimeofday(&t0, NULL);
-                    int nstep = central2d_run(sim, ftime, threads);
-                    gettimeofday(&t1, NULL);
-                    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) * 1e-6;
-#else
-                    int nstep = central2d_run(sim, ftime, threads);
-                    double elapsed = 0;
-#endif
-                    //solution_check(sim);
-                    tcompute += elapsed;
-                    //printf("  Time: %e (%e for %d steps)\n", elapsed, elapsed/nstep, nstep);
-                    //viz_frame(viz, sim, vskip);
-                }
-                avg_time += tcompute;
-
-                //viz_close(viz);
-                central2d_free(sim);
-            }
-            avg_time /= 3.0;
-            printf("Threads %i: Height: %i, Average compute time: %e\n", threads, ny, avg_time);
-            ny *= 2;
+            shm = vizshm_open(stream, sim, &viz_opts, stream_slots);
+            if (!shm)
+                fprintf(stderr, "Could not set up stream %s\n", stream);
+            vizshm_frame(shm, sim);
         }
-        ProfilerStop();
-    }
-    else
-    {
-        central2d_t *sim = central2d_init(w, h, nx, ny,
-                                          3, shallow2d_flux, shallow2d_speed, cfl);
-        lua_init_sim(L, sim);
-        printf("%g %g %d %d %g %d %g\n", w, h, nx, ny, cfl, frames, ftime);
-        FILE *viz = viz_open(fname, sim, vskip);
+
+        set_timestep(sim, dt_mode, dt, dt_safety);
+        set_blocking(sim, tiling, layout, tbatch, tile_nx, tile_ny, threads);
+        printf("%g %g %d %d %g %d %g\n", sim->dx * sim->nx, sim->dy * sim->ny,
+               sim->nx, sim->ny, sim->cfl, frames, ftime);
+        if (restart)
+            printf("Restarting from %s at frame %d (t = %g)\n",
+                   restart, first, sim->time);
+        central2d_placement(sim, threads, stdout);
         solution_check(sim);
-        viz_frame(viz, sim, vskip);
+        roofline_t *rl = (roofline ? roofline_open(threads) : NULL);
+        double cells = (double) sim->nx * sim->ny;
+        double state_bytes = cells * sim->nfield * sizeof(float);
 
         double tcompute = 0;
-        for (int i = 0; i < frames; ++i)
+        for (int i = first; i < frames; ++i)
         {
-#ifdef _OPENMP
-            double t0 = omp_get_wtime();
-            int nstep = central2d_run(sim, ftime, threads);
-            double t1 = omp_get_wtime();
-            double elapsed = t1 - t0;
-#elif defined SYSTIME
-            struct timeval t0, t1;
-            gettimeofday(&t0, NULL);
+            roofline_start(rl);
+            double t0 = wall_time();
+            double tr = trace_begin();
             int nstep = central2d_run(sim, ftime, threads);
-            gettimeofday(&t1, NULL);
-            double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) * 1e-6;
-#else
-            int nstep = central2d_run(sim, ftime, threads);
-            double elapsed = 0;
-#endif
+            trace_end("run", tr, i);
+            double elapsed = wall_time() - t0;
+            roofline_stop(rl, "step", nstep * cells * ROOFLINE_STEP_FLOPS,
+                          nstep * cells * ROOFLINE_STEP_BYTES);
+            roofline_start(rl);
+            tr = trace_begin();
             solution_check(sim);
+            trace_end("check", tr, i);
+            roofline_stop(rl, "check", 0, 0);
             tcompute += elapsed;
             printf("  Time: %e (%e for %d steps)\n", elapsed, elapsed / nstep, nstep);
-            viz_frame(viz, sim, vskip);
-
+            roofline_start(rl);
+            tr = trace_begin();
+            viz_frame(viz, sim);
+            trace_end("viz_frame", tr, i);
+            tr = trace_begin();
+            vizshm_frame(shm, sim);
+            trace_end("vizshm_frame", tr, i);
+            tr = trace_begin();
+            if (checkpoint && ((i + 1) % checkpoint_every == 0 || i + 1 == frames) &&
+                central2d_checkpoint(sim, checkpoint) != 0)
+                fprintf(stderr, "Could not write checkpoint %s\n", checkpoint);
+            trace_end("checkpoint", tr, i);
+            roofline_stop(rl, "output", 0,
+                          (viz || shm || checkpoint ? 2 * state_bytes : 0));
         }
         printf("Total compute time: %e\n", tcompute);
+        central2d_timers(sim, stdout);
+        roofline_report(rl, stdout);
+        roofline_close(rl);
+        if (dt_mode == CENTRAL2D_DT_LAGGED)
+            printf("Batches redone after CFL check: %d\n", sim->rollbacks);
+        if (shm)
+            printf("Frames dropped from stream: %lld\n", vizshm_close(shm));
+        if (sim->probes && central2d_probe_write(sim, probe_out) != 0)
+            fprintf(stderr, "Could not write probes to %s\n", probe_out);
         central2d_free(sim);
-        viz_close(viz);
+        if (viz_close(viz) != 0)
+            fprintf(stderr, "Could not write %s\n", fname);
+        if (trace_close() != 0)
+            fprintf(stderr, "Could not write trace %s\n", trace);
     }
     return 0;
 }
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include "roofline.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <omp.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * ### Counters
+ *
+ * Each thread of the team opens its own counters (counting only that
+ * thread, in user mode, which is all an unprivileged process may do
+ * under the usual `perf_event_paranoid` setting).  A counter fd can
+ * be read from any thread, so the master sums over the team between
+ * parallel regions.  The kernel may multiplex counters if there are
+ * more than the PMU has room for, so we scale each count by the
+ * fraction of time it was actually running.
+ */
+
+#define RL_NEVENT 5
+#define RL_MAXPHASE 8
+
+enum { RL_CYCLES, RL_INSTRUCTIONS, RL_LLC_MISSES, RL_LL_READ, RL_LL_WRITE };
+
+static const char* rl_event_names[RL_NEVENT] = {
+    "cycles", "instructions", "LLC misses", "LL read misses",
+    "LL write misses"
+};
+
+typedef struct roofline_phase_t {
+    const char* name;
+    double time;               // Wall time
+    double flops, bytes;       // Analytic counts
+    double count[RL_NEVENT];   // Hardware counts (summed over threads)
+} roofline_phase_t;
+
+struct roofline_t {
+    int threads;
+    int* fd;                   // Counter fds, RL_NEVENT per thread (or -1)
+    bool have[RL_NEVENT];      // Did every thread get this counter?
+    double bandwidth;          // STREAM triad bandwidth (bytes/s)
+    double peak_flops;         // FMA loop rate (flops/s)
+    double t0;                 // Start of the current phase
+    double c0[RL_NEVENT];      // Counts at the start of the current phase
+    int nphase;
+    roofline_phase_t phase[RL_MAXPHASE];
+};
+
+
+#ifdef __linux__
+static int rl_open_event(int e)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (e) {
+    case RL_CYCLES:
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case RL_INSTRUCTIONS:
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case RL_LLC_MISSES:
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    default:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_LL |
+            ((e == RL_LL_READ ? PERF_COUNT_HW_CACHE_OP_READ :
+                                PERF_COUNT_HW_CACHE_OP_WRITE) << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+
+// Current count of a counter, scaled up for multiplexing
+static double rl_read(int fd)
+{
+    uint64_t v[3];
+    if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v) || v[2] == 0)
+        return 0;
+    return (double) v[0] * ((double) v[1] / v[2]);
+}
+
+
+static void rl_counts(roofline_t* rl, double* count)
+{
+    for (int e = 0; e < RL_NEVENT; ++e) {
+        count[e] = 0;
+        for (int t = 0; rl->have[e] && t < rl->threads; ++t)
+            count[e] += rl_read(rl->fd[t*RL_NEVENT + e]);
+    }
+}
+
+
+/**
+ * ### Probes
+ *
+ * The triad arrays are sized to four times the last-level cache (and
+ * at least 32 MB each), touched first in the same static schedule
+ * that uses them, and we keep the best of a few sweeps.  As in
+ * STREAM, the triad moves 24 bytes per element (we don't count the
+ * write-allocate reads).  The compute probe keeps enough independent
+ * accumulators going to cover the latency of the FMA units, in a form
+ * the compiler will put in vector registers.
+ */
+
+static double rl_stream(int threads)
+{
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (llc <= 0)
+        llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    size_t n = (size_t) (llc > 0 ? 4*llc : 0) / sizeof(double);
+    if (n < (32 << 20) / sizeof(double))
+        n = (32 << 20) / sizeof(double);
+    double* a = (double*) malloc(3 * n * sizeof(double));
+    double* b = a + n;
+    double* c = b + n;
+    if (!a)
+        return 0;
+
+    #pragma omp parallel for num_threads(threads) schedule(static)
+    for (size_t i = 0; i < n; ++i) {
+        a[i] = 0;
+        b[i] = 1;
+        c[i] = 2;
+    }
+
+    double best = INFINITY;
+    for (int k = 0; k < 5; ++k) {
+        double t0 = omp_get_wtime();
+        #pragma omp parallel for num_threads(threads) schedule(static)
+        for (size_t i = 0; i < n; ++i)
+            a[i] = b[i] + 3.0 * c[i];
+        best = fmin(best, omp_get_wtime() - t0);
+    }
+    free(a);
+    return 24.0 * n / best;
+}
+
+
+#define RL_FMA_LANES 128
+#define RL_FMA_ITERS 200000
+
+static double rl_peak_flops(int threads)
+{
+    double t0 = omp_get_wtime();
+    float sink = 0;
+    #pragma omp parallel num_threads(threads) reduction(+:sink)
+    {
+        float acc[RL_FMA_LANES];
+        for (int j = 0; j < RL_FMA_LANES; ++j)
+            acc[j] = (float) j;
+        float x = 0.999999f, y = 1e-6f * omp_get_thread_num();
+        for (int i = 0; i < RL_FMA_ITERS; ++i)
+            for (int j = 0; j < RL_FMA_LANES; ++j)
+                acc[j] = acc[j] * x + y;
+        for (int j = 0; j < RL_FMA_LANES; ++j)
+            sink += acc[j];
+    }
+    double t = omp_get_wtime() - t0;
+    if (sink == 12345.0f)  // Keep the loop alive
+        printf(" ");
+    return 2.0 * RL_FMA_LANES * RL_FMA_ITERS * threads / t;
+}
+
+
+roofline_t* roofline_open(int threads)
+{
+    roofline_t* rl = (roofline_t*) calloc(1, sizeof(roofline_t));
+    rl->threads = threads;
+    rl->fd = (int*) malloc(threads * RL_NEVENT * sizeof(int));
+    int got[RL_NEVENT] = {0};
+
+    #pragma omp parallel num_threads(threads)
+    {
+        int t = omp_get_thread_num();
+        for (int e = 0; e < RL_NEVENT; ++e) {
+            int fd = -1;
+#ifdef __linux__
+            fd = rl_open_event(e);
+#endif
+            rl->fd[t*RL_NEVENT + e] = fd;
+            if (fd >= 0) {
+                #pragma omp atomic
+                ++got[e];
+            }
+        }
+    }
+    for (int e = 0; e < RL_NEVENT; ++e)
+        rl->have[e] = (got[e] == threads);
+
+    rl->bandwidth = rl_stream(threads);
+    rl->peak_flops = rl_peak_flops(threads);
+    return rl;
+}
+
+
+void roofline_start(roofline_t* rl)
+{
+    if (!rl)
+        return;
+    rl_counts(rl, rl->c0);
+    rl->t0 = omp_get_wtime();
+}
+
+
+void roofline_stop(roofline_t* rl, const char* name,
+                   double flops, double bytes)
+{
+    if (!rl)
+        return;
+    double t = omp_get_wtime() - rl->t0;
+    double c[RL_NEVENT];
+    rl_counts(rl, c);
+
+    int i = 0;
+    while (i < rl->nphase && strcmp(rl->phase[i].name, name) != 0)
+        ++i;
+    if (i == RL_MAXPHASE)
+        return;
+    if (i == rl->nphase)
+        rl->phase[rl->nphase++].name = name;
+    roofline_phase_t* p = rl->phase + i;
+    p->time += t;
+    p->flops += flops;
+    p->bytes += bytes;
+    for (int e = 0; e < RL_NEVENT; ++e)
+        p->count[e] += c[e] - rl->c0[e];
+}
+
+
+/**
+ * ### Report
+ *
+ * For each phase we give the analytic rates and arithmetic intensity,
+ * and the fractions of the compute and bandwidth roofs they reach.
+ * Where we have the counters, we also give the measured memory
+ * traffic (read and write misses in the last-level cache, or all
+ * misses if the read/write split isn't available), the intensity
+ * based on it, and the instructions per cycle.  A phase whose
+ * intensity is below the ridge point (peak flops over bandwidth) can
+ * at best reach the bandwidth roof.
+ */
+
+void roofline_report(roofline_t* rl, FILE* fp)
+{
+    if (!rl)
+        return;
+    double ridge = rl->peak_flops / rl->bandwidth;
+    fprintf(fp, "Roofline: %.2f GB/s (STREAM triad), %.2f GFLOP/s (FMA "
+            "loop), ridge at %.2f flop/byte\n", rl->bandwidth * 1e-9,
+            rl->peak_flops * 1e-9, ridge);
+    bool counters = rl->have[RL_CYCLES];
+    bool rw = rl->have[RL_LL_READ] && rl->have[RL_LL_WRITE];
+    bool llc = rw || rl->have[RL_LLC_MISSES];
+    if (!counters)
+        fprintf(fp, "  (hardware counters unavailable; "
+                "showing analytic counts only)\n");
+    for (int e = 0; e < RL_NEVENT; ++e)
+        if (counters && !rl->have[e])
+            fprintf(fp, "  (no counter for %s)\n", rl_event_names[e]);
+
+    fprintf(fp, "  %-8s %10s %9s %6s %9s %6s %8s", "phase", "time(s)",
+            "GFLOP/s", "%peak", "GB/s", "%bw", "flop/B");
+    if (counters)
+        fprintf(fp, " %6s", "IPC");
+    if (llc)
+        fprintf(fp, " %9s %6s %8s", "mem GB/s", "%bw", "flop/B");
+    fprintf(fp, "\n");
+
+    for (int i = 0; i < rl->nphase; ++i) {
+        roofline_phase_t* p = rl->phase + i;
+        double t = p->time > 0 ? p->time : 1;
+        double gflops = p->flops / t, gbytes = p->bytes / t;
+        fprintf(fp, "  %-8s %10.3e %9.2f %6.1f %9.2f %6.1f %8.2f",
+                p->name, p->time, gflops * 1e-9,
+                100 * gflops / rl->peak_flops, gbytes * 1e-9,
+                100 * gbytes / rl->bandwidth,
+                p->bytes > 0 ? p->flops / p->bytes : 0);
+        if (counters)
+            fprintf(fp, " %6.2f", p->count[RL_CYCLES] > 0 ?
+                    p->count[RL_INSTRUCTIONS] / p->count[RL_CYCLES] : 0);
+        if (llc) {
+            double lines = rw ? p->count[RL_LL_READ] + p->count[RL_LL_WRITE]
+                              : p->count[RL_LLC_MISSES];
+            double mem = 64 * lines;
+            fprintf(fp, " %9.2f %6.1f %8.2f", mem / t * 1e-9,
+                    100 * mem / t / rl->bandwidth,
+                    mem > 0 ? p->flops / mem : 0);
+        }
+        fprintf(fp, "\n");
+    }
+}
+
+
+void roofline_close(roofline_t* rl)
+{
+    if (!rl)
+        return;
+    for (int i = 0; i < rl->threads * RL_NEVENT; ++i)
+        if (rl->fd[i] >= 0)
+            close(rl->fd[i]);
+    free(rl->fd);
+    free(rl);
+}
@@ -0,0 +1,66 @@
+#ifndef ROOFLINE_H
+#define ROOFLINE_H
+
+#include <stdio.h>
+
+//ldoc on
+/**
+ * # Roofline report
+ *
+ * To tell whether a phase of the run is limited by memory bandwidth
+ * or by arithmetic, we compare what it achieves against what the
+ * machine can do.  The machine side comes from two short probes run
+ * when the report is set up: a STREAM-style triad over arrays much
+ * larger than the last-level cache (the bandwidth roof), and a loop
+ * of independent fused multiply-adds on registers (the compute roof).
+ * The run side comes from hardware counters read with
+ * `perf_event_open` (cycles, instructions, last-level cache misses,
+ * and last-level read and write misses, which we take as the memory
+ * traffic in 64-byte lines), together with analytic flop and byte
+ * counts supplied by the caller.  If the counters are not available
+ * (no permission, or no PMU in a virtual machine), the report still
+ * gives the analytic rates.
+ *
+ * ## Work per cell
+ *
+ * For a step of the Jiang-Tadmor scheme on the shallow water
+ * equations, each cell costs, per field, two limited derivatives
+ * (9 flops each) and the predictor update (4), then two more limited
+ * derivatives, the corrector terms (13) and the output combination
+ * (3): 56 flops.  On top of the three fields come two flux evaluations
+ * (15 flops each) and the wave speed bound (10), for 208 flops in all.
+ * The unavoidable memory traffic is reading the three fields of the
+ * old state and writing the new one, 24 bytes, since everything else
+ * lives in row buffers in cache.  (The halo exchange adds a little
+ * on top, which we leave out.)
+ *
+ */
+
+#define ROOFLINE_STEP_FLOPS 208
+#define ROOFLINE_STEP_BYTES 24
+
+/**
+ * ## Interface
+ *
+ * `roofline_open` runs the probes with the given number of threads
+ * and attaches counters to each thread of an OpenMP team of that
+ * size, which the solver reuses for its own work.  Calls to
+ * `roofline_start` and `roofline_stop` bracket a phase (from the
+ * master thread, outside any parallel region); the stop call adds
+ * the counts since the start, along with the analytic flops and
+ * bytes of the work done, to the totals of the named phase.
+ * `roofline_report` prints a line per phase.
+ *
+ */
+
+typedef struct roofline_t roofline_t;
+
+roofline_t* roofline_open(int threads);
+void roofline_start(roofline_t* rl);
+void roofline_stop(roofline_t* rl, const char* phase,
+                   double flops, double bytes);
+void roofline_report(roofline_t* rl, FILE* fp);
+void roofline_close(roofline_t* rl);
+
+//ldoc off
+#endif /* ROOFLINE_H */
@@ -1,6 +1,8 @@
 #ifndef SHALLOW2D_H
 #define SHALLOW2D_H
 
+#include "kernels.h"
+
 //ldoc on
 /**
  * # Shallow water equations
@@ -56,5 +58,13 @@ void shallow2d_flux(float* FU, float* GU, const float* U,
 void shallow2d_speed(float* cxy, const float* U,
                      int ncell, int field_stride);
 
+/**
+ * The flux evaluation is vectorized by hand for several instruction
+ * sets; by default we use the widest one the CPU supports (see
+ * `kernels.h`).  `shallow2d_select` picks a particular level (clipped
+ * to what the CPU supports) and returns the level used.
+ */
+simd_level_t shallow2d_select(simd_level_t level);
+
 //ldoc off
 #endif /* SHALLOW2D_H */
@@ -0,0 +1,85 @@
+#ifndef SHALLOW2D_INLINE_H
+#define SHALLOW2D_INLINE_H
+
+#include <string.h>
+#include <math.h>
+
+//ldoc on
+/**
+ * ## Inline physics
+ *
+ * The scalar flux and wave speed loops live in this header as
+ * `static inline` functions, so that a stepper specialized for the
+ * shallow water equations (see "Specialized steppers" in `stepper.c`)
+ * can compile the speed loop straight into its own loops instead of
+ * calling through `speed_t` a row at a time.  (It calls the flux
+ * directly, to keep the hand-vectorized versions.)  `shallow2d.c` uses
+ * the same code for its scalar versions, so the two can't drift apart.
+ */
+
+#define SHALLOW2D_G 9.8f
+
+static inline
+void shallow2dv_flux_scalar(float* restrict fh,
+                            float* restrict fhu,
+                            float* restrict fhv,
+                            float* restrict gh,
+                            float* restrict ghu,
+                            float* restrict ghv,
+                            const float* restrict h,
+                            const float* restrict hu,
+                            const float* restrict hv,
+                            float g,
+                            int ncell)
+{
+    memcpy(fh, hu, ncell * sizeof(float));
+    memcpy(gh, hv, ncell * sizeof(float));
+    for (int i = 0; i < ncell; ++i) {
+        float hi = h[i], hui = hu[i], hvi = hv[i];
+        float inv_h = 1.0f/hi;
+        fhu[i] = hui*hui*inv_h + (0.5f*g)*hi*hi;
+        fhv[i] = hui*hvi*inv_h;
+        ghu[i] = hui*hvi*inv_h;
+        ghv[i] = hvi*hvi*inv_h + (0.5f*g)*hi*hi;
+    }
+}
+
+
+static inline
+void shallow2dv_speed(float* restrict cxy,
+                      const float* restrict h,
+                      const float* restrict hu,
+                      const float* restrict hv,
+                      float g,
+                      int ncell)
+{
+    float cx = cxy[0];
+    float cy = cxy[1];
+    for (int i = 0; i < ncell; ++i) {
+        float hi = h[i];
+        if (fabsf(hi) < 0.00001) {
+            continue;
+        }
+        float inv_hi = 1.0f/h[i];
+        float root_gh = sqrtf(g * hi);
+        float cxi = fabsf(hu[i] * inv_hi) + root_gh;
+        float cyi = fabsf(hv[i] * inv_hi) + root_gh;
+        cx = fmaxf(cx,cxi);
+        cy = fmaxf(cy,cyi);
+    }
+    cxy[0] = cx;
+    cxy[1] = cy;
+}
+
+
+// The same with the fields separated by field_stride
+static inline
+void shallow2d_speed_inline(float* cxy, const float* U,
+                            int ncell, int field_stride)
+{
+    shallow2dv_speed(cxy, U, U+field_stride, U+2*field_stride,
+                     SHALLOW2D_G, ncell);
+}
+
+//ldoc off
+#endif /* SHALLOW2D_INLINE_H */
@@ -0,0 +1,70 @@
+/*
+ * Shallow water flux template, included by shallow2d.c once per
+ * instruction set after vec.h.  Same operations in the same order as
+ * the scalar version, and leftover cells go through the same vector
+ * code, so the result for a cell doesn't depend on where it falls in
+ * the row.
+ */
+
+// One vector of cells: the x and y momentum fluxes (the mass fluxes
+// are just copies)
+VEC_TARGET static inline
+void VNAME(shallow2dv_flux_block)(float* restrict fhu,
+                                  float* restrict fhv,
+                                  float* restrict ghu,
+                                  float* restrict ghv,
+                                  const float* restrict h,
+                                  const float* restrict hu,
+                                  const float* restrict hv,
+                                  VEC half_g)
+{
+    const VEC one = VSET1(1.0f);
+    VEC hi = VLOAD(h), hui = VLOAD(hu), hvi = VLOAD(hv);
+    VEC inv_h = VDIV(one, hi);
+    VEC p = VMUL(VMUL(half_g, hi), hi);
+    VEC uv = VMUL(VMUL(hui, hvi), inv_h);
+    VSTORE(fhu, VADD(VMUL(VMUL(hui, hui), inv_h), p));
+    VSTORE(fhv, uv);
+    VSTORE(ghu, uv);
+    VSTORE(ghv, VADD(VMUL(VMUL(hvi, hvi), inv_h), p));
+}
+
+
+VEC_TARGET static
+void VNAME(shallow2dv_flux)(float* restrict fh,
+                            float* restrict fhu,
+                            float* restrict fhv,
+                            float* restrict gh,
+                            float* restrict ghu,
+                            float* restrict ghv,
+                            const float* restrict h,
+                            const float* restrict hu,
+                            const float* restrict hv,
+                            float g,
+                            int ncell)
+{
+    memcpy(fh, hu, ncell * sizeof(float));
+    memcpy(gh, hv, ncell * sizeof(float));
+    const VEC half_g = VSET1(0.5f*g);
+    int i = 0;
+    for (; i + VW <= ncell; i += VW)
+        VNAME(shallow2dv_flux_block)(fhu+i, fhv+i, ghu+i, ghv+i,
+                                     h+i, hu+i, hv+i, half_g);
+
+    // Leftover cells go through the same code, padded out with h = 1
+    int n = ncell - i;
+    if (n > 0) {
+        float in[3][VW], out[4][VW];
+        for (int k = 0; k < VW; ++k) {
+            in[0][k] = (k < n ? h [i+k] : 1.0f);
+            in[1][k] = (k < n ? hu[i+k] : 0.0f);
+            in[2][k] = (k < n ? hv[i+k] : 0.0f);
+        }
+        VNAME(shallow2dv_flux_block)(out[0], out[1], out[2], out[3],
+                                     in[0], in[1], in[2], half_g);
+        memcpy(fhu+i, out[0], n * sizeof(float));
+        memcpy(fhv+i, out[1], n * sizeof(float));
+        memcpy(ghu+i, out[2], n * sizeof(float));
+        memcpy(ghv+i, out[3], n * sizeof(float));
+    }
+}
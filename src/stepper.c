@@ -1,67 +1,274 @@
+#define _GNU_SOURCE
 #include "stepper.h"
+#include "kernels.h"
+#include "shallow2d.h"
+#include "shallow2d_inline.h"
+#include "timers.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <omp.h>
 #include <stdio.h>
-
-#define BLOCK_SIZE 4
+#include <unistd.h>
+#include <stdint.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// L2 size to assume if the system won't tell us
+#define L2_CACHE_DEFAULT (256*1024)
 
 //ldoc on
 /**
  * ## Implementation
  *
  * ### Structure allocation
+ *
+ * On a machine with several memory nodes, a page lives on the node
+ * of the thread that first writes it.  So the big arrays come straight
+ * from `mmap` rather than from `malloc` (which might hand back pages
+ * already placed by some earlier owner), and whichever thread will
+ * use an array writes it first.  A header in front of the data says
+ * where the mapping starts and how long it is, so that we can give
+ * it back; this also lets the solution array be a private mapping of
+ * a checkpoint file (see `central2d_restart`).  The header is a cache
+ * line long, so the data starts on a cache line (we align the `malloc`
+ * block by hand on other systems).  Blocks of a huge page or more get
+ * huge pages if the caller asked for them: explicit ones are mapped
+ * with `MAP_HUGETLB` (and the length rounded up to whole huge pages),
+ * and transparent ones are asked for with `madvise`.
  */
 
-central2d_t* central2d_init(float w, float h, int nx, int ny,
-                            int nfield, flux_t flux, speed_t speed,
-                            float cfl)
+#define CENTRAL2D_ALLOC_HEADER 64
+#define CENTRAL2D_HUGE_PAGE (2 << 20)
+
+static int central2d_pages = CENTRAL2D_PAGES_DEFAULT;
+
+void central2d_set_pages(int mode)
 {
-    // We extend to a four cell buffer to avoid BC comm on odd time steps
-    int ng = 4;
+    central2d_pages = mode;
+}
+
+typedef struct central2d_alloc_t {
+    void* base;         // Start of the mapping (or malloc block)
+    size_t bytes;       // Length of the mapping (0 if malloc'd)
+} central2d_alloc_t;
+
+static inline
+central2d_alloc_t* central2d_alloc_header(float* u)
+{
+    return (central2d_alloc_t*) ((char*) u - CENTRAL2D_ALLOC_HEADER);
+}
+
+
+static
+float* central2d_alloc(size_t n)
+{
+    size_t bytes = n * sizeof(float) + CENTRAL2D_ALLOC_HEADER;
+    bool huge = (bytes >= CENTRAL2D_HUGE_PAGE &&
+                 central2d_pages != CENTRAL2D_PAGES_DEFAULT);
+#ifdef __linux__
+    char* p = (char*) MAP_FAILED;
+    if (huge && central2d_pages == CENTRAL2D_PAGES_HUGETLB) {
+        size_t hbytes = (bytes + CENTRAL2D_HUGE_PAGE-1) /
+            CENTRAL2D_HUGE_PAGE * CENTRAL2D_HUGE_PAGE;
+        p = (char*) mmap(NULL, hbytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        static int warned = 0;
+        if (p != MAP_FAILED)
+            bytes = hbytes;
+        else if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+            fprintf(stderr, "No explicit huge pages free; "
+                    "using transparent ones\n");
+    }
+    if (p == MAP_FAILED) {
+        p = (char*) mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(p != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+        if (huge)
+            madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    float* u = (float*) (p + CENTRAL2D_ALLOC_HEADER);
+#else
+    (void) huge;
+    char* p = (char*) malloc(bytes + CENTRAL2D_ALLOC_HEADER);
+    assert(p);
+    bytes = 0;
+    float* u = (float*) (p + 2*CENTRAL2D_ALLOC_HEADER -
+                         (uintptr_t) p % CENTRAL2D_ALLOC_HEADER);
+#endif
+    central2d_alloc_header(u)->base = p;
+    central2d_alloc_header(u)->bytes = bytes;
+    return u;
+}
+
+
+static
+void central2d_release(float* u)
+{
+    if (!u)
+        return;
+    central2d_alloc_t* header = central2d_alloc_header(u);
+    if (header->bytes)
+        munmap(header->base, header->bytes);
+    else
+        free(header->base);
+}
+
+
+/**
+ * ### Padding
+ *
+ * Rows are padded out to a whole number of cache lines (16 floats),
+ * so that they all start on a line.  But a pitch that is a multiple
+ * of a large power of two is trouble: the cells above and below one
+ * another, which the stencil reads together, then fall in the same
+ * cache sets, and loads and stores a multiple of 4 KB apart look to
+ * the CPU as if they might alias.  So if the padded length is a
+ * multiple of 1 KB, we add one more line.  The planes of the fields
+ * get the same treatment, as do the tile buffers and the row buffers
+ * of the step kernel.  The global `u` keeps its strides in the
+ * simulator (an old checkpoint may have none of this padding); the
+ * stepper's own arrays always use the padded ones.
+ */
 
+#define CENTRAL2D_LINE 16
+
+static inline
+int central2d_pad(int n)
+{
+    n = (n + CENTRAL2D_LINE-1) / CENTRAL2D_LINE * CENTRAL2D_LINE;
+    return n % (16*CENTRAL2D_LINE) == 0 ? n + CENTRAL2D_LINE : n;
+}
+
+// Field and row strides and size (in floats) of nfield fields on a
+// grid of ny_all rows of nx_all cells (ghost cells included)
+static inline
+int layout_field_stride(int layout, int nx_all, int ny_all)
+{
+    int pitch = central2d_pad(nx_all);
+    return (layout == CENTRAL2D_LAYOUT_ROWS ? pitch :
+            central2d_pad(pitch * ny_all));
+}
+
+static inline
+int layout_row_stride(int layout, int nfield, int nx_all)
+{
+    int pitch = central2d_pad(nx_all);
+    return layout == CENTRAL2D_LAYOUT_ROWS ? nfield * pitch : pitch;
+}
+
+static inline
+int layout_size(int layout, int nfield, int nx_all, int ny_all)
+{
+    return (layout == CENTRAL2D_LAYOUT_ROWS ?
+            ny_all * layout_row_stride(layout, nfield, nx_all) :
+            nfield * layout_field_stride(layout, nx_all, ny_all));
+}
+
+// Floats from the start of u to the end of its last row
+static inline
+size_t central2d_size(const central2d_t* sim)
+{
+    return (size_t) (sim->nfield-1) * sim->field_stride +
+        (size_t) (sim->ny + 2*sim->ng - 1) * sim->row_stride +
+        sim->nx + 2*sim->ng;
+}
+
+
+// Fill in everything but the storage
+static
+central2d_t* central2d_new(int nx, int ny, int ng, float dx, float dy,
+                           int nfield, flux_t flux, speed_t speed,
+                           float cfl)
+{
     central2d_t* sim = (central2d_t*) malloc(sizeof(central2d_t));
     sim->nx = nx;
     sim->ny = ny;
     sim->ng = ng;
     sim->nfield = nfield;
-    sim->dx = w/nx;
-    sim->dy = h/ny;
+    sim->dx = dx;
+    sim->dy = dy;
     sim->flux = flux;
     sim->speed = speed;
     sim->cfl = cfl;
+    sim->tbatch = 1;
+    sim->tile_nx = 0;
+    sim->tile_ny = 0;
+    sim->tiling = CENTRAL2D_TILING_HALO;
+    sim->layout = CENTRAL2D_LAYOUT_PLANES;
+    sim->field_stride = layout_field_stride(sim->layout, nx + 2*ng,
+                                            ny + 2*ng);
+    sim->row_stride = layout_row_stride(sim->layout, nfield, nx + 2*ng);
+    sim->dt_mode = CENTRAL2D_DT_CFL;
+    sim->dt_fixed = 0;
+    sim->dt_safety = 0.9f;
+    sim->rollbacks = 0;
+    sim->time = 0;
+    sim->u = NULL;
+    sim->tiles = NULL;
+    sim->wave = NULL;
+    sim->probes = NULL;
+    return sim;
+}
+
+
+central2d_t* central2d_init(float w, float h, int nx, int ny,
+                            int nfield, flux_t flux, speed_t speed,
+                            float cfl)
+{
+    // We extend to a four cell buffer to avoid BC comm on odd time steps
+    int ng = 4;
+    central2d_t* sim = central2d_new(nx, ny, ng, w/nx, h/ny,
+                                     nfield, flux, speed, cfl);
 
+    // The fluxes and other work arrays live with the tiles
     int nx_all = nx + 2*ng;
     int ny_all = ny + 2*ng;
-    int nc = nx_all * ny_all;
-    int N  = nfield * nc;
-    sim->u  = (float*) malloc((4*N + 6*nx_all)* sizeof(float));
-    sim->v  = sim->u +   N;
-    sim->f  = sim->u + 2*N;
-    sim->g  = sim->u + 3*N;
-    sim->scratch = sim->u + 4*N;
+    int c = sim->field_stride, rs = sim->row_stride;
+    sim->u = central2d_alloc(layout_size(sim->layout, nfield,
+                                         nx_all, ny_all));
+
+    // Touch u in row bands from all threads (tiles are handed out to
+    // threads in row-major order, so the bands roughly match)
+    #pragma omp parallel for schedule(static)
+    for (int iy = 0; iy < ny_all; ++iy)
+        for (int k = 0; k < nfield; ++k)
+            memset(sim->u + k*c + iy*rs, 0, nx_all * sizeof(float));
 
     return sim;
 }
 
 
+static void central2d_tiles_free(central2d_tiles_t* tiles);
+static void central2d_wave_free(central2d_wave_t* wave);
+static void central2d_probes_free(central2d_probes_t* probes);
+
 void central2d_free(central2d_t* sim)
 {
-    free(sim->u);
+    central2d_tiles_free(sim->tiles);
+    central2d_wave_free(sim->wave);
+    central2d_probes_free(sim->probes);
+    central2d_release(sim->u);
     free(sim);
 }
 
 
 int central2d_offset(central2d_t* sim, int k, int ix, int iy)
 {
-    int nx = sim->nx, ny = sim->ny, ng = sim->ng;
-    int nx_all = nx + 2*ng;
-    int ny_all = ny + 2*ng;
-    return (k*ny_all+(ng+iy))*nx_all+(ng+ix);
+    int ng = sim->ng;
+    return k*sim->field_stride + (ng+iy)*sim->row_stride + (ng+ix);
 }
 
 
@@ -112,22 +319,23 @@ void print_grid(const float* restrict u, int nx, int ny, int stride)
     printf("\n");
 }
 
-void central2d_periodic_full(float* restrict u,
-                        int nx, int ny, int ng, int nfield)
+void central2d_periodic_full(central2d_t* sim)
 {
-    // Stride and number per field
-    int s = nx + 2*ng;
-    int field_stride = (ny+2*ng)*s;
+    int nx = sim->nx, ny = sim->ny, ng = sim->ng;
+
+    // Row and field strides (which depend on the layout and padding)
+    int s = sim->row_stride;
+    int field_stride = sim->field_stride;
 
     // Offsets of left, right, top, and bottom data blocks and ghost blocks
     int l = nx,   lg = 0;
     int r = ng,   rg = nx+ng;
     int b = ny*s, bg = 0;
-    int t = ng*s, tg = (nx+ng)*s;
+    int t = ng*s, tg = (ny+ng)*s;
 
     // Copy data into ghost cells on each side
-    for (int k = 0; k < nfield; ++k) {
-        float* uk = u + k*field_stride;
+    for (int k = 0; k < sim->nfield; ++k) {
+        float* uk = sim->u + k*field_stride;
         copy_subgrid(uk+lg, uk+l, ng, ny+2*ng, s, s);
         copy_subgrid(uk+rg, uk+r, ng, ny+2*ng, s, s);
         copy_subgrid(uk+tg, uk+t, nx+2*ng, ng, s, s);
@@ -135,92 +343,25 @@ void central2d_periodic_full(float* restrict u,
     }
 }
 
-void central2d_periodic(float* restrict u, const float* restrict src,
-                        int nx, int ny, int ng, int partx, int party, int px, int py, int nfield, int tbatch)
-{
-    // Stride and number per field
-    int ngu = ng*tbatch;
-    int backng = ng*(tbatch-1);
-    int s = nx + 2*ngu;
-    int s2 = nx*partx + 2*ng;
-    int field_stride = (ny+2*ngu)*s;
-    int field_stride2 = (ny*party+2*ng)*s2;
-
-
-    // Copy data into ghost cells on each side
-    for (int k = 0; k < nfield; ++k) {
-        float* uk = u + k*field_stride;
-        const float* srck = src + k*field_stride2;
-
-        int modxl = (px == 0? partx : px);
-        int modxr = (px == partx-1? 0 : px+1);
-        int modyb = (py == 0? party : py);
-        int modyt = (py == party-1? 0 : py+1);
-
-        copy_subgrid(uk, srck+(modyb*ny-backng)*s2+(modxl*nx-backng), ngu, ngu, s, s2);
-        copy_subgrid(uk+ngu*s, srck+(ng+py*ny)*s2+modxl*nx-backng, ngu, ny, s, s2);
-        copy_subgrid(uk+(ngu+ny)*s, srck+(ng+modyt*ny)*s2+modxl*nx-backng, ngu, ngu, s, s2);
-
-        copy_subgrid(uk+ngu, srck+(modyb*ny-backng)*s2+px*nx+ng, nx, ngu, s, s2);
-        copy_subgrid(uk+ngu*s+ngu, srck+(ng+py*ny)*s2+px*nx+ng, nx, ny, s, s2);
-        copy_subgrid(uk+(ngu+ny)*s+ngu, srck+(ng+modyt*ny)*s2+px*nx+ng, nx, ngu, s, s2);
-
-        copy_subgrid(uk+ngu+nx, srck+(modyb*ny-backng)*s2+modxr*nx+ng, ngu, ngu, s, s2);
-        copy_subgrid(uk+ngu*s+nx+ngu, srck+(ng+py*ny)*s2+modxr*nx+ng, ngu, ny, s, s2);
-        copy_subgrid(uk+(ngu+ny)*s+ngu+nx, srck+(ng+modyt*ny)*s2+modxr*nx+ng, ngu, ngu, s, s2);
-    }
-}
-
-
 /**
  * ### Derivatives with limiters
  *
  * In order to advance the time step, we also need to estimate
- * derivatives of the fluxes and the solution values at each cell.
- * In order to maintain stability, we apply a limiter here.
- *
- * The minmod limiter *looks* like it should be expensive to computer,
- * since superficially it seems to require a number of branches.
- * We do something a little tricky, getting rid of the condition
- * on the sign of the arguments using the `copysign` instruction.
- * If the compiler does the "right" thing with `max` and `min`
- * for floating point arguments (translating them to branch-free
- * intrinsic operations), this implementation should be relatively fast.
+ * derivatives of the fluxes and the solution values at each cell,
+ * with a minmod limiter to maintain stability.  The limiter and the
+ * corrector arithmetic are the hottest loops in the code, so they
+ * live with the hand-vectorized kernels (see `kernels.c`); here we
+ * just dress up the three-row limiter for the cases we need.
  */
 
 
-// Branch-free computation of minmod of two numbers times 2s
-static inline
-float xmin2s(float s, float a, float b) {
-    float sa = copysignf(s, a);
-    float sb = copysignf(s, b);
-    float abs_a = fabsf(a);
-    float abs_b = fabsf(b);
-    float min_abs = (abs_a < abs_b ? abs_a : abs_b);
-    return (sa+sb) * min_abs;
-}
-
-
-// Limited combined slope estimate
-static inline
-float limdiff(float um, float u0, float up) {
-    const float theta = 2.0;
-    const float quarter = 0.25;
-    float du1 = u0-um;   // Difference to left
-    float du2 = up-u0;   // Difference to right
-    float duc = up-um;   // Twice centered difference
-    return xmin2s( quarter, xmin2s(theta, du1, du2), duc );
-}
-
-
 // Compute limited derivs
 static inline
 void limited_deriv1(float* restrict du,
                     const float* restrict u,
                     int ncell)
 {
-    for (int i = 0; i < ncell; ++i)
-        du[i] = limdiff(u[i-1], u[i], u[i+1]);
+    central2d_kernels.limited_deriv3(du, u-1, u, u+1, ncell);
 }
 
 
@@ -231,8 +372,19 @@ void limited_derivk(float* restrict du,
                     int ncell, int stride)
 {
     assert(stride > 0);
-    for (int i = 0; i < ncell; ++i)
-        du[i] = limdiff(u[i-stride], u[i], u[i+stride]);
+    central2d_kernels.limited_deriv3(du, u-stride, u, u+stride, ncell);
+}
+
+
+// Compute limited derivs from three separate rows
+static inline
+void limited_deriv3(float* restrict du,
+                    const float* restrict um,
+                    const float* restrict u0,
+                    const float* restrict up,
+                    int ncell)
+{
+    central2d_kernels.limited_deriv3(du, um, u0, up, ncell);
 }
 
 
@@ -266,261 +418,2328 @@ void limited_derivk(float* restrict du,
  * the arithmetic cost a little (not that it's that big to start).
  * It also makes it more obvious that we only need four rows worth
  * of scratch space.
+ *
+ * Rather than sweeping over the whole grid once for each stage, we
+ * stream through it a row at a time.  When row $j+1$ of $u$ comes in,
+ * we evaluate its fluxes; that is enough to run the predictor on row
+ * $j$, evaluate the fluxes of the predicted values on row $j$, form
+ * $s$ and $d$ for row $j$, and finish output row $j-1$.  So the only
+ * full-size arrays are the input and output; the fluxes live in a
+ * three-row ring buffer and everything else in single-row buffers,
+ * all of which stay in cache.  Each stage is only evaluated on the
+ * columns and rows that the output actually depends on.
+ *
+ * The row buffers hold all the fields for one row, separated by
+ * `nx` (the full row length with ghost cells), so that we can hand
+ * them directly to the flux function.  We copy each incoming row of
+ * `u` into such a buffer before evaluating its fluxes.
+ *
+ * If `cxy` is non-null, we also fold each finished output row into
+ * the wave speed maxima as soon as it is written (while it is still
+ * in cache), which saves a separate sweep to get the next time step.
+ * Likewise, if `stats` is non-null, we fold each output row of field
+ * `k` into a running sum (in double precision), minimum and maximum in
+ * `stats[3*k]` to `stats[3*k+2]`; this gives the conservation checks
+ * for free.  The caller is responsible for initializing `cxy` and
+ * `stats`.  Each stage ends with a lap of the phase timers (see
+ * `timers.h`), which is nothing at all unless they are compiled in.
+ *
+ * The real work is in `central2d_step_rows`, which does the part of
+ * the sweep for incoming rows `ja` to `jb-1`, and writes output rows
+ * `ylo+io` to `yhi-1+io` of arrays with field stride `c`.  Everything
+ * carried from one row to the next lives in the scratch rings, so a
+ * sweep can be done in several calls over consecutive ranges (with the
+ * same scratch), as the wavefront scheme below does.  The whole sweep
+ * runs from `ylo-1` to `yhi+1`, and reads input rows `ylo-1` to
+ * `yhi+1`.  If `xwrap` is set, each output row also gets its ghost
+ * cells in x filled periodically as soon as it is written.
  */
 
 
-// Predictor half-step
-static
-void central2d_predict(float* restrict v,
-                       float* restrict scratch,
-                       const float* restrict u,
-                       const float* restrict f,
-                       const float* restrict g,
-                       float dtcdx2, float dtcdy2,
-                       int nx, int ny, int nfield)
+// Fold a row into a running sum, min and max (the row is short enough
+// that summing it in double loses nothing worth mentioning)
+static inline
+void row_stats(double* restrict stats, const float* restrict row, int n)
 {
-    float* restrict fx = scratch;
-    float* restrict gy = scratch+nx;
-    for (int k = 0; k < nfield; ++k) {
-        for (int iy = 1; iy < ny-1; ++iy) {
-            int offset = (k*ny+iy)*nx+1;
-            limited_deriv1(fx+1, f+offset, nx-2);
-            limited_derivk(gy+1, g+offset, nx-2, nx);
-            for (int ix = 1; ix < nx-1; ++ix) {
-                int offset = (k*ny+iy)*nx+ix;
-                v[offset] = u[offset] - dtcdx2 * fx[ix] - dtcdy2 * gy[ix];
-            }
-        }
+    double sum = 0;
+    float lo = stats[1], hi = stats[2];
+    for (int i = 0; i < n; ++i) {
+        sum += row[i];
+        lo = fminf(lo, row[i]);
+        hi = fmaxf(hi, row[i]);
     }
+    stats[0] += sum;
+    stats[1] = lo;
+    stats[2] = hi;
 }
 
 
-// Corrector
-static
-void central2d_correct_sd(float* restrict s,
-                          float* restrict d,
-                          const float* restrict ux,
-                          const float* restrict uy,
-                          const float* restrict u,
-                          const float* restrict f,
-                          const float* restrict g,
-                          float dtcdx2, float dtcdy2,
-                          int xlo, int xhi)
+// Start the statistics for nfield fields
+static inline
+void stats_clear(double* stats, int nfield)
 {
-    for (int ix = xlo; ix < xhi; ++ix)
-        s[ix] =
-            0.2500f * (u [ix] + u [ix+1]) +
-            0.0625f * (ux[ix] - ux[ix+1]) +
-            dtcdx2  * (f [ix] - f [ix+1]);
-    for (int ix = xlo; ix < xhi; ++ix)
-        d[ix] =
-            0.0625f * (uy[ix] + uy[ix+1]) +
-            dtcdy2  * (g [ix] + g [ix+1]);
+    for (int k = 0; k < nfield; ++k) {
+        stats[3*k+0] = 0;
+        stats[3*k+1] = FLT_MAX;
+        stats[3*k+2] = -FLT_MAX;
+    }
 }
 
 
-// Corrector
-static
-void central2d_correct(float* restrict v,
-                       float* restrict scratch,
-                       const float* restrict u,
-                       const float* restrict f,
-                       const float* restrict g,
-                       float dtcdx2, float dtcdy2,
-                       int xlo, int xhi, int ylo, int yhi,
-                       int nx, int ny, int nfield)
+// Scratch space needed by central2d_step for rows of length nx
+static inline
+int central2d_step_scratch(int nx, int nfield)
 {
-    assert(0 <= xlo && xlo < xhi && xhi <= nx);
-    assert(0 <= ylo && ylo < yhi && yhi <= ny);
-
-    float* restrict ux = scratch;
-    float* restrict uy = scratch +   nx;
-    float* restrict s0 = scratch + 2*nx;
-    float* restrict d0 = scratch + 3*nx;
-    float* restrict s1 = scratch + 4*nx;
-    float* restrict d1 = scratch + 5*nx;
-
-    for (int k = 0; k < nfield; ++k) {
+    return (14*nfield + 2) * central2d_pad(nx);
+}
 
-        float*       restrict vk = v + k*ny*nx;
-        const float* restrict uk = u + k*ny*nx;
-        const float* restrict fk = f + k*ny*nx;
-        const float* restrict gk = g + k*ny*nx;
 
-        limited_deriv1(ux+1, uk+ylo*nx+1, nx-2);
-        limited_derivk(uy+1, uk+ylo*nx+1, nx-2, nx);
-        central2d_correct_sd(s1, d1, ux, uy,
-                             uk + ylo*nx, fk + ylo*nx, gk + ylo*nx,
-                             dtcdx2, dtcdy2, xlo, xhi);
+/**
+ * ### Specialized steppers
+ *
+ * Through `flux_t` and `speed_t`, the kernel calls the physics twice
+ * per row and can't see what it does, and with `nfield` only known at
+ * run time, it can't unroll the loops over the fields either.  So the
+ * kernel is written once, as a template (`stepper_step.h`), and
+ * instantiated twice: a generic version that works for any physics,
+ * and one for the shallow water equations with three fields and the
+ * speed loop of `shallow2d_inline.h` compiled in.  The flux still
+ * goes through `shallow2d_flux`, called directly rather than through
+ * a pointer, so that it keeps the hand-vectorized loop picked at run
+ * time; it is the more expensive of the two, and the scalar loop only
+ * gets whatever vectors the build's `ARCHFLAGS` allow.  The stepper
+ * takes the specialized version whenever the simulator was set up
+ * with `shallow2d_flux` and `shallow2d_speed`, and the generic one
+ * otherwise.  Building with `-DSTEPPER_GENERIC` leaves out the
+ * specialized version.
+ */
 
-        for (int iy = ylo; iy < yhi; ++iy) {
+#define STEP_ROWS central2d_step_rows_generic
+#define STEP_NFIELD nfield
+#define STEP_FLUX(fu, gu, u, n, stride) flux(fu, gu, u, n, stride)
+#define STEP_SPEED(cxy, u, n, stride) speed(cxy, u, n, stride)
+#include "stepper_step.h"
 
-            float* tmp;
-            tmp = s0; s0 = s1; s1 = tmp;
-            tmp = d0; d0 = d1; d1 = tmp;
+#ifndef STEPPER_GENERIC
+#define STEP_ROWS central2d_step_rows_shallow2d
+#define STEP_NFIELD 3
+#define STEP_FLUX(fu, gu, u, n, stride) \
+    shallow2d_flux(fu, gu, u, n, stride)
+#define STEP_SPEED(cxy, u, n, stride) \
+    shallow2d_speed_inline(cxy, u, n, stride)
+#include "stepper_step.h"
+#endif
 
-            limited_deriv1(ux+1, uk+(iy+1)*nx+1, nx-2);
-            limited_derivk(uy+1, uk+(iy+1)*nx+1, nx-2, nx);
-            central2d_correct_sd(s1, d1, ux, uy,
-                                 uk + (iy+1)*nx, fk + (iy+1)*nx, gk + (iy+1)*nx,
-                                 dtcdx2, dtcdy2, xlo, xhi);
 
-            for (int ix = xlo; ix < xhi; ++ix)
-                vk[iy*nx+ix] = (s1[ix]+s0[ix])-(d1[ix]-d0[ix]);
-        }
+static inline
+void central2d_step_rows(float* restrict u, float* restrict v,
+                         float* restrict scratch,
+                         int io, int nx, int ng, int c, int rs,
+                         int ylo, int yhi, int ja, int jb, bool xwrap,
+                         int nfield, flux_t flux, speed_t speed,
+                         float* cxy, double* stats,
+                         float dt, float dx, float dy)
+{
+#ifndef STEPPER_GENERIC
+    if (nfield == 3 && flux == shallow2d_flux && speed == shallow2d_speed) {
+        central2d_step_rows_shallow2d(u, v, scratch, io, nx, ng, c, rs,
+                                      ylo, yhi, ja, jb, xwrap,
+                                      nfield, flux, speed, cxy, stats,
+                                      dt, dx, dy);
+        return;
     }
+#endif
+    central2d_step_rows_generic(u, v, scratch, io, nx, ng, c, rs,
+                                ylo, yhi, ja, jb, xwrap,
+                                nfield, flux, speed, cxy, stats,
+                                dt, dx, dy);
 }
 
 
-static
+// One full step over an nx-by-ny grid with ng ghost cells
+static inline
 void central2d_step(float* restrict u, float* restrict v,
                     float* restrict scratch,
-                    float* restrict f,
-                    float* restrict g,
-                    int io, int nx, int ny, int ng,
+                    int io, int nx, int ny, int ng, int layout,
                     int nfield, flux_t flux, speed_t speed,
+                    float* cxy, double* stats,
                     float dt, float dx, float dy)
 {
-    int nx_all = nx + 2*ng;
-    int ny_all = ny + 2*ng;
+    int c = layout_field_stride(layout, nx + 2*ng, ny + 2*ng);
+    int rs = layout_row_stride(layout, nfield, nx + 2*ng);
+    int ylo = ng-io, yhi = ny+ng-io;
+    central2d_step_rows(u, v, scratch, io, nx, ng, c, rs,
+                        ylo, yhi, ylo-1, yhi+2, false,
+                        nfield, flux, speed, cxy, stats, dt, dx, dy);
+}
 
-    float dtcdx2 = 0.5 * dt / dx;
-    float dtcdy2 = 0.5 * dt / dy;
 
-    flux(f, g, u, nx_all * ny_all, nx_all * ny_all);
+// Probe points in one tile, sampled after every pair of steps (see
+// "Probes" below)
+typedef struct central2d_probe_buf_t {
+    int n, cap;         // Samples recorded and allocated
+    long long* key;     // Sample index times point count, plus point id
+    float* val;         // Values of the fields for each sample
+} central2d_probe_buf_t;
 
-    central2d_predict(v, scratch, u, f, g, dtcdx2, dtcdy2,
-                      nx_all, ny_all, nfield);
+typedef struct central2d_probe_batch_t {
+    int n;                       // Points in the tile
+    const int* id;               // Point ids
+    const int* cell;             // Offsets of the points in a tile buffer
+    int npoint;                  // Points in all probes
+    long long sample;            // Sample index after the first pair
+    central2d_probe_buf_t* buf;  // Where the samples go
+} central2d_probe_batch_t;
 
-    // Flux values of f and g at half step
-    for (int iy = 1; iy < ny_all-1; ++iy) {
-        int jj = iy*nx_all+1;
-        flux(f+jj, g+jj, v+jj, nx_all-2, nx_all * ny_all);
-    }
 
-    central2d_correct(v+io*(nx_all+1), scratch, u, f, g, dtcdx2, dtcdy2,
-                      ng-io, nx+ng-io,
-                      ng-io, ny+ng-io,
-                      nx_all, ny_all, nfield);
+static
+void probe_record(central2d_probe_batch_t* pb, const float* w,
+                  int field_stride, int nfield, int pair)
+{
+    central2d_probe_buf_t* buf = pb->buf;
+    if (buf->n + pb->n > buf->cap) {
+        buf->cap = 2*(buf->n + pb->n);
+        buf->key = (long long*) realloc(buf->key, buf->cap * sizeof(long long));
+        buf->val = (float*) realloc(buf->val, buf->cap * nfield * sizeof(float));
+    }
+    for (int i = 0; i < pb->n; ++i) {
+        buf->key[buf->n] = (pb->sample + pair) * pb->npoint + pb->id[i];
+        for (int k = 0; k < nfield; ++k)
+            buf->val[buf->n*nfield + k] = w[pb->cell[i] + k*field_stride];
+        ++buf->n;
+    }
 }
 
+
+// Step from u into w (v is work space).  The last step of the batch
+// writes exactly the interior, and if cxy is non-null we collect the
+// wave speeds for the next time step from it (and the same for stats).
+// Every pair of steps leaves the interior of w on the main grid, so
+// that is when we sample the probes (if any).
 static
-void central2d_step_batch(float* restrict u, float* restrict v,
-                    float* restrict scratch,
-                    float* restrict f,
-                    float* restrict g,
-                    int nx, int ny, int ng,
+void central2d_step_batch(float* restrict u, float* restrict w,
+                    float* restrict v, float* restrict scratch,
+                    int nx, int ny, int ng, int layout,
                     int nfield, flux_t flux, speed_t speed,
+                    float* cxy, double* stats,
+                    central2d_probe_batch_t* probe,
                     float dt, float dx, float dy, int tbatch)
 {
+    if (cxy) {
+        cxy[0] = 1.0e-15f;
+        cxy[1] = 1.0e-15f;
+    }
+    if (stats)
+        stats_clear(stats, nfield);
     for (int b = 0; b < tbatch; ++b) {
-        central2d_step(u, v, scratch, f, g,
+        central2d_step(b == 0 ? u : w, v, scratch,
                       0, nx+2*(ng*tbatch-(2*b+1)*ng/2), ny+2*(ng*tbatch-(2*b+1)*ng/2), (2*b+1)*ng/2,
-                      nfield, flux, speed,
+                      layout, nfield, flux, speed, NULL, NULL,
                       dt, dx, dy);
-        central2d_step(v, u, scratch, f, g,
+        central2d_step(v, w, scratch,
                       1, nx+2*ng*(tbatch-b-1), ny+2*ng*(tbatch-b-1), ng*(b+1),
-                      nfield, flux, speed,
+                      layout, nfield, flux, speed,
+                      (b == tbatch-1 ? cxy : NULL),
+                      (b == tbatch-1 ? stats : NULL),
                       dt, dx, dy);
+        if (probe && probe->n)
+            probe_record(probe, w,
+                         layout_field_stride(layout, nx+2*ng*tbatch,
+                                             ny+2*ng*tbatch),
+                         nfield, b);
     }
 }
 
+
 /**
- * ### Advance a fixed time
+ * ### Tiles
  *
- * The `run` method advances from time 0 (initial conditions) to time
- * `tfinal`.  Note that `run` can be called repeatedly; for example,
- * we might want to advance for a period of time, write out a picture,
- * advance more, and write another picture.  In this sense, `tfinal`
- * should be interpreted as an offset from the time represented by
- * the simulator at the start of the call, rather than as an absolute time.
+ * The grid is split into a `partx`-by-`party` array of tiles.  Tile
+ * boundaries are at `xs[0] = 0 < xs[1] < ... < xs[partx] = nx` (and
+ * similarly in y), with the cells spread as evenly as possible, so
+ * grids that don't divide evenly just get tiles that differ in size
+ * by one cell.  Every tile owns three buffers holding its cells plus
+ * a halo of `ngu = ng*tbatch` ghost cells on each side, which is
+ * enough to take `tbatch` pairs of steps between exchanges (see
+ * `central2d_step_batch`).  A batch reads one buffer and writes the
+ * next one (mod 3), and `cur` says which buffer holds the solution.
+ * The third buffer lets a tile start a new batch while its neighbors
+ * may still need the state from two batches back, either to read it
+ * or to go back to it (see below).  The buffers are allocated and
+ * first written once, by the thread that owns the tile, and live as
+ * long as the simulator does; so do the per-thread work arrays used
+ * for the intermediate solution and the row buffers of the step
+ * kernel.  Each thread is pinned to a CPU of its own (see
+ * `central2d_pin`), so its tiles stay in its local memory from one
+ * run to the next.
  *
- * We always take an even number of steps so that the solution
- * at the end lives on the main grid instead of the staggered grid.
+ * Before each batch of steps, a tile pulls the ghost strips it needs
+ * from the interiors of its eight neighbors (wrapping around the tile
+ * grid for periodic boundaries).  After the batch, the interior of
+ * the next buffer holds the new solution, the matching `cxy` holds
+ * its wave speeds, the matching block of `stats` holds the sum, min
+ * and max of each field over the interior, and the ghost cells are
+ * junk.  So a tile can take
+ * batch `b` as soon as it and its neighbors have finished batch
+ * `b-1`; each tile counts the batches it has finished in `done`, and
+ * that is all the synchronization the stepping needs.  The list of
+ * neighbors (including the tile itself) is worked out once.
  */
 
+typedef struct central2d_tile_t {
+    int x0, y0;         // Offset of first interior cell in global grid
+    int sx, sy;         // Tile size (without ghost cells)
+    int nbr[9];         // Neighboring tiles (and this one)
+    int done;           // Batches finished in the current run
+    float cxy[3][2];    // Max wave speeds for each buffer
+    double* stats;      // Sum, min, max of each field for each buffer
+    float* u[3];        // Tile data with ghost cells (three buffers)
+#ifdef PHASE_TIMERS
+    uint64_t ticks;     // Time spent on this tile's batches
+#endif
+} central2d_tile_t;
+
+
+struct central2d_tiles_t {
+    int threads;        // Number of threads we were set up for
+    int partx, party;   // Tile grid dimensions
+    int* xs;            // Tile boundaries in x (partx+1 entries)
+    int* ys;            // Tile boundaries in y (party+1 entries)
+    int* first;         // Thread t owns tiles first[t] to first[t+1]-1
+    int* cpu;           // CPU for thread t (-1 if we don't pin)
+    int sx_max, sy_max; // Largest tile size
+    int tile_nx;        // Requested tile sizes we were set up for
+    int tile_ny;
+    int tbatch;         // Step pairs per halo exchange
+    int layout;         // Field layout of the tile buffers
+    int nfield;
+    int ngu;            // Ghost cells per side in tile buffers
+    int cur;            // Which tile buffer holds the solution
+    bool cxy_valid;     // Are the wave speeds for cur up to date?
+    int reject[3];      // Last batch (mod 3) that failed a CFL check
+    int* seen;          // Last batch whose stamp thread t has looked at
+    bool synced;        // Is the global u up to date?
+    central2d_tile_t* tile;
+    float** work;       // Per-thread work arrays (v, scratch)
+#ifdef PHASE_TIMERS
+    uint64_t* phase;    // Ticks per phase for each thread
+    uint64_t tick0;     // Clock when we were set up
+    double wall0;
+#endif
+};
+
+
 static
-int central2d_xrun(float* restrict u, float* restrict v,
-                   float* restrict scratch,
-                   float* restrict f,
-                   float* restrict g,
-                   int nx, int ny, int ng,
-                   int nfield, flux_t flux, speed_t speed,
-                   float tfinal, float dx, float dy, float cfl, int threads)
+void central2d_tiles_free(central2d_tiles_t* tiles)
 {
-    int nstep = 0;
-    int tbatch = 1;
-    int nx_all = nx + 2*ng;
-    int ny_all = ny + 2*ng;
-    int c = nx_all * ny_all;
-    int N = nfield * c;
-    int partx = 2;
-    int party = fmaxf(1, BLOCK_SIZE*threads/partx);
-    omp_set_num_threads(threads);
-    int sx = nx/partx;
-    int sy = ny/party;
-    int sx_all = sx + 2*tbatch*ng;
-    int sy_all = sy + 2*tbatch*ng;
-    int pc = sx_all * sy_all;
-    int pN  = nfield * pc;
-    bool done = false;
-    float t = 0;
-
-    static float *pu;
-    #pragma omp threadprivate(pu)
-    #pragma omp parallel
-    {
-        pu = (float*) malloc((4*pN + 6*sx_all)* sizeof(float));
+    if (!tiles)
+        return;
+    int ntiles = tiles->partx * tiles->party;
+    for (int i = 0; i < ntiles; ++i) {
+        for (int b = 0; b < 3; ++b)
+            central2d_release(tiles->tile[i].u[b]);
+        free(tiles->tile[i].stats);
+    }
+    for (int i = 0; i < tiles->threads; ++i)
+        central2d_release(tiles->work[i]);
+    free(tiles->tile);
+    free(tiles->work);
+    free(tiles->xs);
+    free(tiles->ys);
+    free(tiles->first);
+    free(tiles->cpu);
+    free(tiles->seen);
+#ifdef PHASE_TIMERS
+    free(tiles->phase);
+#endif
+    free(tiles);
+}
+
+
+// Row stride, field stride and size (in floats) of a tile buffer
+static inline
+int tile_stride(const central2d_tiles_t* tiles, const central2d_tile_t* tile)
+{
+    return layout_row_stride(tiles->layout, tiles->nfield,
+                             tile->sx + 2*tiles->ngu);
+}
+
+static inline
+int tile_field_stride(const central2d_tiles_t* tiles,
+                      const central2d_tile_t* tile)
+{
+    return layout_field_stride(tiles->layout, tile->sx + 2*tiles->ngu,
+                               tile->sy + 2*tiles->ngu);
+}
+
+static inline
+int tile_size(const central2d_tiles_t* tiles, const central2d_tile_t* tile)
+{
+    return layout_size(tiles->layout, tiles->nfield,
+                       tile->sx + 2*tiles->ngu, tile->sy + 2*tiles->ngu);
+}
+
+
+// Pointer to interior cell (ix, iy) of the current tile buffer
+static inline
+float* tile_cell(const central2d_tiles_t* tiles, const central2d_tile_t* tile,
+                 int ix, int iy)
+{
+    int ngu = tiles->ngu;
+    return tile->u[tiles->cur] + (ngu+iy)*tile_stride(tiles, tile) + (ngu+ix);
+}
+
+
+// Copy tile interior from (load = true) or to (load = false) global grid
+static
+void tile_copy_global(central2d_t* sim, central2d_tiles_t* tiles,
+                      central2d_tile_t* tile, bool load)
+{
+    int c  = sim->field_stride;
+    int gs = sim->row_stride;
+    int s  = tile_stride(tiles, tile);
+    int pc = tile_field_stride(tiles, tile);
+    float* g = sim->u + central2d_offset(sim, 0, tile->x0, tile->y0);
+    float* t = tile_cell(tiles, tile, 0, 0);
+    if (load)
+        copy_subgrid_allfield(t, g, tile->sx, tile->sy,
+                              pc, c, s, gs, sim->nfield);
+    else
+        copy_subgrid_allfield(g, t, tile->sx, tile->sy,
+                              c, pc, gs, s, sim->nfield);
+}
+
+
+// Fill the ghost cells of buffer cur of tile (px, py) from its neighbors
+static
+void tile_exchange(central2d_tiles_t* tiles, int px, int py, int nfield,
+                   int cur)
+{
+    int partx = tiles->partx, party = tiles->party;
+    int ngu = tiles->ngu;
+    central2d_tile_t* tile = tiles->tile + py*partx + px;
+    int sx = tile->sx, sy = tile->sy;
+    int s  = tile_stride(tiles, tile);
+    int pc = tile_field_stride(tiles, tile);
+
+    // Destination offset and width for each side
+    int dstx[3] = { 0,   ngu, ngu+sx }, dsty[3] = { 0,   ngu, ngu+sy };
+    int lenx[3] = { ngu, sx,  ngu    }, leny[3] = { ngu, sy,  ngu    };
+
+    for (int j = 0; j < 3; ++j) {
+        int qy = (py + j-1 + party) % party;
+        for (int i = 0; i < 3; ++i) {
+            if (i == 1 && j == 1)
+                continue;
+            int qx = (px + i-1 + partx) % partx;
+            const central2d_tile_t* q = tiles->tile + qy*partx + qx;
+
+            // Take the last ngu interior cells of a left/lower neighbor,
+            // and the first ones otherwise
+            int srcx = (i == 0 ? q->sx : ngu);
+            int srcy = (j == 0 ? q->sy : ngu);
+            int qs = tile_stride(tiles, q);
+            copy_subgrid_allfield(tile->u[cur] + dsty[j]*s + dstx[i],
+                                  q->u[cur] + srcy*qs + srcx,
+                                  lenx[i], leny[j],
+                                  pc, tile_field_stride(tiles, q),
+                                  s, qs, nfield);
+        }
+    }
+}
+
+
+// Max wave speeds over the current tile interior (the stepper keeps
+// them up to date after that; this is for freshly loaded tiles)
+static
+void tile_speed(central2d_tiles_t* tiles, central2d_tile_t* tile,
+                speed_t speed)
+{
+    int pc = tile_field_stride(tiles, tile);
+    float* cxy = tile->cxy[tiles->cur];
+    cxy[0] = 1.0e-15f;
+    cxy[1] = 1.0e-15f;
+    for (int iy = 0; iy < tile->sy; ++iy)
+        speed(cxy, tile_cell(tiles, tile, 0, iy), tile->sx, pc);
+}
+
+
+// Field statistics over the current tile interior (likewise)
+static
+void tile_stats(central2d_tiles_t* tiles, central2d_tile_t* tile,
+                int nfield)
+{
+    int pc = tile_field_stride(tiles, tile);
+    double* stats = tile->stats + 3*nfield*tiles->cur;
+    stats_clear(stats, nfield);
+    for (int iy = 0; iy < tile->sy; ++iy)
+        for (int k = 0; k < nfield; ++k)
+            row_stats(stats + 3*k, tile_cell(tiles, tile, 0, iy) + k*pc,
+                      tile->sx);
+}
+
+
+/**
+ * #### Choosing the tiles
+ *
+ * Unless the caller asks for a particular tile size (`tile_nx` and
+ * `tile_ny`), we aim for roughly square tiles whose working set --
+ * the two tile buffers plus the `v` work array, with ghost cells --
+ * fits in the L2 cache.  (The row buffers in the step kernel are small
+ * enough to ignore.)  We then make sure there are
+ * at least as many tiles as threads, and, when there are only a few
+ * tiles per thread, nudge the counts up until the tiles divide evenly
+ * among the threads.  Tiles are never narrower than `ng` cells.
+ */
+
+static
+int central2d_tile_edge(int nfield, int ngu)
+{
+    long cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (cache <= 0)
+        cache = L2_CACHE_DEFAULT;
+    int edge = (int) sqrt(cache / (3.0 * nfield * sizeof(float))) - 2*ngu;
+    return (edge > 2*ngu ? edge : 2*ngu);
+}
+
+
+static
+void central2d_partition(int* xs, int n, int parts)
+{
+    for (int i = 0; i <= parts; ++i)
+        xs[i] = (int) ((long) i * n / parts);
+}
+
+
+static
+void central2d_tile_counts(central2d_t* sim, int threads,
+                           int* partx_out, int* party_out)
+{
+    int nx = sim->nx, ny = sim->ny, ng = sim->ng;
+    int edge = central2d_tile_edge(sim->nfield, ng*sim->tbatch);
+    int ex = (sim->tile_nx > 0 ? sim->tile_nx : edge);
+    int ey = (sim->tile_ny > 0 ? sim->tile_ny : edge);
+    int maxx = (nx/ng > 1 ? nx/ng : 1);
+    int maxy = (ny/ng > 1 ? ny/ng : 1);
+
+    int partx = (nx + ex-1)/ex;
+    int party = (ny + ey-1)/ey;
+    partx = (partx < maxx ? partx : maxx);
+    party = (party < maxy ? party : maxy);
+
+    // At least one tile per thread, splitting the longer side
+    while (partx*party < threads && (partx < maxx || party < maxy)) {
+        if ((nx/partx >= ny/party && partx < maxx) || party == maxy)
+            ++partx;
+        else
+            ++party;
+    }
+
+    // With few tiles per thread, prefer a count that balances evenly
+    if ((partx*party) % threads != 0 && partx*party < 4*threads) {
+        int best = 0;
+        for (int qx = partx; qx <= 2*partx && qx <= maxx; ++qx)
+            for (int qy = party; qy <= 2*party && qy <= maxy; ++qy)
+                if ((qx*qy) % threads == 0 && (!best || qx*qy < best)) {
+                    best = qx*qy;
+                    partx = qx;
+                    party = qy;
+                }
     }
-    while (!done) {
-        float cxy[2] = {1.0e-15f, 1.0e-15f};
 
-        speed(cxy, u, nx_all * ny_all, nx_all * ny_all);
+    *partx_out = partx;
+    *party_out = party;
+}
+
+
+/**
+ * #### Placing threads
+ *
+ * Left to itself, the OS may move a thread to another core (or
+ * another socket) between runs, away from the tiles it touched
+ * first.  So unless the user has asked OpenMP to bind threads
+ * (`OMP_PROC_BIND` or `OMP_PLACES`), we pin thread `t` to the `t`-th
+ * CPU the process may run on (wrapping around if there are more
+ * threads than CPUs), which puts neighboring tiles on the same
+ * socket.  The list of CPUs is taken once, before anyone is pinned.
+ * OpenMP does not promise that thread `t` of one parallel region is
+ * the same system thread as in the last one, so every region starts
+ * by calling `central2d_pin`; each system thread remembers where it
+ * is pinned, so this costs nothing when nothing has changed.
+ */
 
-        float dt = cfl / fmaxf(cxy[0]/dx, cxy[1]/dy);
-        if (t + 2*tbatch*dt >= tfinal) {
-            dt = (tfinal-t)/2/tbatch;
-            done = true;
+static
+void central2d_cpus(int* cpu, int threads)
+{
+    for (int t = 0; t < threads; ++t)
+        cpu[t] = -1;
+#ifdef __linux__
+    static int ncpu = -1;
+    static int* cpus = NULL;
+    if (getenv("OMP_PROC_BIND") || getenv("OMP_PLACES"))
+        return;
+    if (ncpu < 0) {
+        cpu_set_t set;
+        ncpu = 0;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            cpus = (int*) malloc(CPU_COUNT(&set) * sizeof(int));
+            for (int c = 0; c < CPU_SETSIZE; ++c)
+                if (CPU_ISSET(c, &set))
+                    cpus[ncpu++] = c;
         }
+    }
+    for (int t = 0; ncpu > 0 && t < threads; ++t)
+        cpu[t] = cpus[t % ncpu];
+#endif
+}
 
-        #pragma omp parallel for collapse(2)
-        for (int py = 0; py < party; py++) {
-            for (int px = 0; px < partx; px++) {
-                int thread = omp_get_thread_num();
-                float *pv  = pu + pN;
-                float *pf  = pu+ 2*pN;
-                float *pg  = pu + 3*pN;
-                float *pscratch = pu + 4*pN;
 
-                central2d_periodic(pu, u, sx, sy, ng, partx, party, px, py, nfield, tbatch);
+static
+void central2d_pin(const int* cpu, int thread)
+{
+#ifdef __linux__
+    static __thread int pinned = -1;
+    int c = cpu[thread];
+    if (c < 0 || c == pinned)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(c, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == 0)
+        pinned = c;
+#endif
+}
 
-                central2d_step_batch(pu, pv, pscratch, pf, pg,
-                                 sx, sy, ng,
-                                 nfield, flux, speed,
-                                 dt, dx, dy, tbatch);
 
-                copy_subgrid_allfield(u+nx_all*(ng+py*sy)+(ng+px*sx),pu+tbatch*ng*sx_all+ng*tbatch,
-                                  sx,sy,c,pc,nx_all,sx_all,nfield);
+static
+central2d_tiles_t* central2d_tiles_init(central2d_t* sim, int threads)
+{
+    int ng = sim->ng;
+    int nfield = sim->nfield;
+
+    central2d_tiles_t* tiles =
+        (central2d_tiles_t*) malloc(sizeof(central2d_tiles_t));
+    tiles->threads = threads;
+    tiles->tile_nx = sim->tile_nx;
+    tiles->tile_ny = sim->tile_ny;
+    tiles->layout = sim->layout;
+    tiles->nfield = nfield;
+    tiles->cur = 0;
+    tiles->cxy_valid = true;
+    tiles->synced = true;
+    central2d_tile_counts(sim, threads, &tiles->partx, &tiles->party);
+    int partx = tiles->partx, party = tiles->party;
+    tiles->xs = (int*) malloc((partx+1) * sizeof(int));
+    tiles->ys = (int*) malloc((party+1) * sizeof(int));
+    central2d_partition(tiles->xs, sim->nx, partx);
+    central2d_partition(tiles->ys, sim->ny, party);
+
+    // Halos can't be wider than the neighbors that fill them
+    int sx_min = sim->nx / partx, sy_min = sim->ny / party;
+    int tbatch_max = (sx_min < sy_min ? sx_min : sy_min) / ng;
+    assert(tbatch_max >= 1);
+    if (sim->tbatch > tbatch_max)
+        sim->tbatch = tbatch_max;
+    tiles->tbatch = sim->tbatch;
+    tiles->ngu = ng*tiles->tbatch;
+    tiles->sx_max = (sim->nx + partx-1) / partx;
+    tiles->sy_max = (sim->ny + party-1) / party;
+
+    int ntiles = partx * party;
+    int sx_all = tiles->sx_max + 2*tiles->ngu;
+    int sy_all = tiles->sy_max + 2*tiles->ngu;
+    int pN = layout_size(tiles->layout, nfield, sx_all, sy_all);
+    tiles->tile = (central2d_tile_t*) malloc(ntiles * sizeof(central2d_tile_t));
+    tiles->work = (float**) malloc(threads * sizeof(float*));
+
+    // Each thread owns a contiguous run of tiles (in row-major order)
+    tiles->first = (int*) malloc((threads+1) * sizeof(int));
+    central2d_partition(tiles->first, ntiles, threads);
+    tiles->cpu = (int*) malloc(threads * sizeof(int));
+    central2d_cpus(tiles->cpu, threads);
+    tiles->seen = (int*) malloc(threads * sizeof(int));
+
+    // Allocate and fill from the thread that will use the data
+    #pragma omp parallel num_threads(threads)
+    {
+        int t = omp_get_thread_num();
+        central2d_pin(tiles->cpu, t);
+        int nwork = pN + central2d_step_scratch(sx_all, nfield);
+        tiles->work[t] = central2d_alloc(nwork);
+        memset(tiles->work[t], 0, nwork * sizeof(float));
+
+        for (int i = tiles->first[t]; i < tiles->first[t+1]; ++i) {
+            central2d_tile_t* tile = tiles->tile + i;
+            int px = i % partx, py = i / partx;
+            tile->x0 = tiles->xs[px];
+            tile->y0 = tiles->ys[py];
+            tile->sx = tiles->xs[px+1] - tile->x0;
+            tile->sy = tiles->ys[py+1] - tile->y0;
+            for (int j = 0; j < 3; ++j)
+                for (int k = 0; k < 3; ++k)
+                    tile->nbr[3*j+k] = ((py+j-1+party) % party) * partx +
+                                       ((px+k-1+partx) % partx);
+            int n = tile_size(tiles, tile);
+            for (int b = 0; b < 3; ++b) {
+                tile->u[b] = central2d_alloc(n);
+                memset(tile->u[b], 0, n * sizeof(float));
             }
+            tile->stats = (double*) malloc(3*3*nfield * sizeof(double));
+            tile_copy_global(sim, tiles, tile, true);
+            tile_speed(tiles, tile, sim->speed);
+            tile_stats(tiles, tile, nfield);
+#ifdef PHASE_TIMERS
+            tile->ticks = 0;
+#endif
         }
+    }
+#ifdef PHASE_TIMERS
+    tiles->phase = (uint64_t*) calloc(threads * PHASE_COUNT, sizeof(uint64_t));
+    tiles->tick0 = phase_ticks();
+    tiles->wall0 = omp_get_wtime();
+#endif
+    return tiles;
+}
+
 
-        t += 2*dt*tbatch;
-        nstep += 2*tbatch;
+// Set up tiles for the current thread count and batch depth (the
+// solution is in u if we were using the wavefront scheme)
+static
+void central2d_tiles_setup(central2d_t* sim, int threads)
+{
+    central2d_wave_free(sim->wave);
+    sim->wave = NULL;
+    central2d_tiles_t* tiles = sim->tiles;
+    if (tiles && (tiles->threads != threads ||
+                  tiles->tbatch  != sim->tbatch ||
+                  tiles->tile_nx != sim->tile_nx ||
+                  tiles->tile_ny != sim->tile_ny)) {
+        central2d_sync(sim);
+        central2d_tiles_free(tiles);
+        sim->tiles = NULL;
     }
-    #pragma omp parallel
-    {
-        free(pu);
+    if (!sim->tiles)
+        sim->tiles = central2d_tiles_init(sim, threads);
+}
+
+
+// CFL-limited time step from the wave speeds for tile buffer cur
+static
+float central2d_tiles_dt(const central2d_tiles_t* tiles, int cur,
+                         float dx, float dy, float cfl)
+{
+    float cxy[2] = {1.0e-15f, 1.0e-15f};
+    int ntiles = tiles->partx * tiles->party;
+    for (int i = 0; i < ntiles; ++i) {
+        cxy[0] = fmaxf(cxy[0], tiles->tile[i].cxy[cur][0]);
+        cxy[1] = fmaxf(cxy[1], tiles->tile[i].cxy[cur][1]);
     }
+    return cfl / fmaxf(cxy[0]/dx, cxy[1]/dy);
+}
 
-    return nstep;
+
+// Does a step dt respect the CFL limit for the wave speeds cxy?
+static inline
+bool central2d_cfl_ok(const float* cxy, float dt,
+                      float dx, float dy, float cfl)
+{
+    return dt * fmaxf(cxy[0]/dx, cxy[1]/dy) <= cfl;
 }
 
 
-int central2d_run(central2d_t* sim, float tfinal, int threads)
+/**
+ * #### Waiting on other tiles
+ *
+ * The `done` counters, `reject` stamps and `seen` marks are the only
+ * shared state that changes while the threads are stepping.  A tile writes its
+ * results before it bumps its counter (and the atomics are
+ * sequentially consistent), so whoever sees the new count also sees
+ * the data.  While waiting, we give up the core; there may be more
+ * threads than cores.
+ */
+
+static inline
+int tile_done(central2d_tile_t* tile)
 {
-    return central2d_xrun(sim->u, sim->v, sim->scratch,
-                          sim->f, sim->g,
-                          sim->nx, sim->ny, sim->ng,
-                          sim->nfield, sim->flux, sim->speed,
-                          tfinal, sim->dx, sim->dy, sim->cfl, threads);
+    int done;
+    #pragma omp atomic read seq_cst
+    done = tile->done;
+    return done;
+}
+
+
+static inline
+void tile_finish(central2d_tile_t* tile, int done)
+{
+    #pragma omp atomic write seq_cst
+    tile->done = done;
+}
+
+
+// Can tile i take batch b (have it and its neighbors finished b-1)?
+static
+bool tile_ready(central2d_tiles_t* tiles, int i, int b)
+{
+    const int* nbr = tiles->tile[i].nbr;
+    for (int k = 0; k < 9; ++k)
+        if (tile_done(tiles->tile + nbr[k]) < b)
+            return false;
+    return true;
+}
+
+
+// Wait until every tile has finished b batches
+static
+void central2d_tiles_wait(central2d_tiles_t* tiles, int b)
+{
+    int ntiles = tiles->partx * tiles->party;
+    for (int i = 0; i < ntiles; ++i)
+        while (tile_done(tiles->tile + i) < b)
+            sched_yield();
+}
+
+
+// Note that this thread is done with the stamps for batch b and before
+static
+void central2d_tiles_seen(central2d_tiles_t* tiles, int thread, int b)
+{
+    #pragma omp atomic write seq_cst
+    tiles->seen[thread] = b;
+}
+
+
+// Stamp batch b as failed once nobody still needs to read batch b-3
+static
+void central2d_tiles_reject(central2d_tiles_t* tiles, int b)
+{
+    for (int t = 0; t < tiles->threads; ++t) {
+        for (;;) {
+            int seen;
+            #pragma omp atomic read seq_cst
+            seen = tiles->seen[t];
+            if (seen >= b-3)
+                break;
+            sched_yield();
+        }
+    }
+    #pragma omp atomic write seq_cst
+    tiles->reject[b%3] = b;
+}
+
+
+// Add this thread's phase timers to the totals for the tiles
+static inline
+void central2d_phase_fold(central2d_tiles_t* tiles, int thread)
+{
+#ifdef PHASE_TIMERS
+    uint64_t* acc = tiles->phase + thread*PHASE_COUNT;
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        acc[p] += phase_clock.acc[p];
+        phase_clock.acc[p] = 0;
+    }
+#endif
+}
+
+
+// Did batch b fail a CFL check (only valid once it is done everywhere)?
+static
+bool central2d_tiles_rejected(central2d_tiles_t* tiles, int b)
+{
+    int last;
+    #pragma omp atomic read seq_cst
+    last = tiles->reject[b%3];
+    return last == b;
+}
+
+
+void central2d_sync(central2d_t* sim)
+{
+    central2d_tiles_t* tiles = sim->tiles;
+    if (!tiles || tiles->synced)
+        return;
+    #pragma omp parallel num_threads(tiles->threads)
+    {
+        int t = omp_get_thread_num();
+        central2d_pin(tiles->cpu, t);
+        PHASE_BEGIN();
+        double t0 = trace_begin();
+        for (int i = tiles->first[t]; i < tiles->first[t+1]; ++i)
+            tile_copy_global(sim, tiles, tiles->tile + i, false);
+        trace_end("sync", t0, -1);
+        PHASE_LAP(PHASE_WRITEBACK);
+        central2d_phase_fold(tiles, t);
+    }
+    tiles->synced = true;
+}
+
+
+/**
+ * Changing the layout goes through a new copy of `u`: we bring `u` up
+ * to date, drop the tiles and the wavefront state (both are laid out
+ * like `u`, and the next run builds them again), and copy each row of
+ * each field to its place in a new array with the padded strides of
+ * the new layout, touching it in row bands as `central2d_init` does.
+ */
+
+void central2d_set_layout(central2d_t* sim, int layout)
+{
+    if (layout == sim->layout)
+        return;
+    central2d_sync(sim);
+    central2d_tiles_free(sim->tiles);
+    sim->tiles = NULL;
+    central2d_wave_free(sim->wave);
+    sim->wave = NULL;
+
+    int nfield = sim->nfield;
+    int nx_all = sim->nx + 2*sim->ng;
+    int ny_all = sim->ny + 2*sim->ng;
+    int c0 = sim->field_stride, s0 = sim->row_stride;
+    int c1 = layout_field_stride(layout, nx_all, ny_all);
+    int s1 = layout_row_stride(layout, nfield, nx_all);
+    float* old = sim->u;
+    float* u = central2d_alloc(layout_size(layout, nfield, nx_all, ny_all));
+    #pragma omp parallel for schedule(static)
+    for (int iy = 0; iy < ny_all; ++iy)
+        for (int k = 0; k < nfield; ++k)
+            memcpy(u + k*c1 + iy*s1, old + k*c0 + iy*s0,
+                   nx_all * sizeof(float));
+    central2d_release(old);
+    sim->u = u;
+    sim->layout = layout;
+    sim->field_stride = c1;
+    sim->row_stride = s1;
+}
+
+
+/**
+ * ### Conservation diagnostics
+ *
+ * The stepper leaves the sum, min and max of each field over each
+ * tile in `stats` as a side effect of the last step of every batch,
+ * so the global figures are just a reduction over the tiles.  We add
+ * the tile sums pairwise, so the rounding error grows only with the
+ * log of the tile count, and the result does not depend on the thread
+ * count.  Before the first run there are no tiles, and we sweep `u`
+ * in parallel a row at a time instead.
+ */
+
+// Pairwise sum of n values spaced stride apart
+static
+double pairwise_sum(const double* x, int n, int stride)
+{
+    if (n <= 8) {
+        double sum = 0;
+        for (int i = 0; i < n; ++i)
+            sum += x[i*stride];
+        return sum;
+    }
+    int h = n/2;
+    return pairwise_sum(x, h, stride) + pairwise_sum(x + h*stride, n-h, stride);
+}
+
+
+void central2d_stats(central2d_t* sim, double* total, float* lo, float* hi)
+{
+    central2d_tiles_t* tiles = sim->tiles;
+    int nfield = sim->nfield;
+    int stride = 3*nfield;
+    int nblock = (tiles ? tiles->partx * tiles->party : sim->ny);
+    double* part = (double*) malloc(nblock * stride * sizeof(double));
+    if (tiles) {
+        for (int i = 0; i < nblock; ++i)
+            memcpy(part + i*stride, tiles->tile[i].stats + stride*tiles->cur,
+                   stride * sizeof(double));
+    } else {
+        #pragma omp parallel for
+        for (int iy = 0; iy < nblock; ++iy) {
+            stats_clear(part + iy*stride, nfield);
+            for (int k = 0; k < nfield; ++k)
+                row_stats(part + iy*stride + 3*k,
+                          sim->u + central2d_offset(sim, k, 0, iy), sim->nx);
+        }
+    }
+
+    for (int k = 0; k < nfield; ++k) {
+        const double* pk = part + 3*k;
+        total[k] = pairwise_sum(pk, nblock, stride) * sim->dx * sim->dy;
+        double pmin = pk[1], pmax = pk[2];
+        for (int i = 1; i < nblock; ++i) {
+            pmin = fmin(pmin, pk[i*stride+1]);
+            pmax = fmax(pmax, pk[i*stride+2]);
+        }
+        if (lo)
+            lo[k] = pmin;
+        if (hi)
+            hi[k] = pmax;
+    }
+    free(part);
+}
+
+
+int central2d_tile_count(central2d_t* sim)
+{
+    central2d_tiles_t* tiles = sim->tiles;
+    return (tiles ? tiles->partx * tiles->party : 0);
+}
+
+
+void central2d_tile_rect(central2d_t* sim, int i,
+                         int* x0, int* y0, int* sx, int* sy)
+{
+    central2d_tile_t* tile = sim->tiles->tile + i;
+    *x0 = tile->x0;
+    *y0 = tile->y0;
+    *sx = tile->sx;
+    *sy = tile->sy;
+}
+
+
+/**
+ * ### Probes
+ *
+ * A probe is a list of cells: one for a point gauge, or the cells a
+ * polyline passes through (in order, without repeats).  The samples
+ * are taken by whichever thread steps the tile a point lives in,
+ * right after each pair of steps (see `central2d_step_batch`), and go
+ * into a buffer for that thread, tagged with the sample index and
+ * point; thread 0 keeps the sample times.  We only sort them out when
+ * writing the file.  If a lagged batch is redone, each thread simply
+ * forgets the samples it took since the start of that batch.
+ */
+
+struct central2d_probes_t {
+    int nprobe, probe_cap;           // Probes
+    central2d_probe_info_t* probe;
+    int npoint, point_cap;           // Points in all probes
+    central2d_probe_point_t* point;
+    long long nsample, time_cap;     // Samples taken so far
+    double* time;                    // Time of each sample
+    int nbuf;                        // Sample buffers (one per thread)
+    central2d_probe_buf_t* buf;
+};
+
+
+static
+void central2d_probes_free(central2d_probes_t* probes)
+{
+    if (!probes)
+        return;
+    for (int i = 0; i < probes->nbuf; ++i) {
+        free(probes->buf[i].key);
+        free(probes->buf[i].val);
+    }
+    free(probes->buf);
+    free(probes->time);
+    free(probes->point);
+    free(probes->probe);
+    free(probes);
+}
+
+
+// Add the cell containing (x, y) to the last probe, unless it is the
+// same as the last cell in the probe
+static
+void probe_add_point(central2d_t* sim, float x, float y)
+{
+    central2d_probes_t* probes = sim->probes;
+    central2d_probe_info_t* info = probes->probe + probes->nprobe-1;
+    int ix = (int) floorf(x / sim->dx) % sim->nx;
+    int iy = (int) floorf(y / sim->dy) % sim->ny;
+    ix += (ix < 0 ? sim->nx : 0);
+    iy += (iy < 0 ? sim->ny : 0);
+    if (info->npoint > 0) {
+        central2d_probe_point_t* last = probes->point + probes->npoint-1;
+        if (last->ix == ix && last->iy == iy)
+            return;
+    }
+    if (probes->npoint == probes->point_cap) {
+        probes->point_cap = 2*probes->point_cap + 16;
+        probes->point = (central2d_probe_point_t*)
+            realloc(probes->point,
+                    probes->point_cap * sizeof(central2d_probe_point_t));
+    }
+    central2d_probe_point_t* pt = probes->point + probes->npoint++;
+    pt->ix = ix;
+    pt->iy = iy;
+    pt->x = (ix + 0.5f) * sim->dx;
+    pt->y = (iy + 0.5f) * sim->dy;
+    ++info->npoint;
+}
+
+
+int central2d_probe(central2d_t* sim, const char* name,
+                    const float* xy, int n)
+{
+    if (!sim->probes)
+        sim->probes = (central2d_probes_t*) calloc(1, sizeof(central2d_probes_t));
+    central2d_probes_t* probes = sim->probes;
+    if (probes->nsample > 0 || n < 1)
+        return -1;
+
+    if (probes->nprobe == probes->probe_cap) {
+        probes->probe_cap = 2*probes->probe_cap + 4;
+        probes->probe = (central2d_probe_info_t*)
+            realloc(probes->probe,
+                    probes->probe_cap * sizeof(central2d_probe_info_t));
+    }
+    central2d_probe_info_t* info = probes->probe + probes->nprobe++;
+    memset(info, 0, sizeof(*info));
+    strncpy(info->name, name, sizeof(info->name)-1);
+    info->first = probes->npoint;
+
+    // Walk each segment in steps of half a cell
+    probe_add_point(sim, xy[0], xy[1]);
+    for (int j = 0; j+1 < n; ++j) {
+        float x0 = xy[2*j], y0 = xy[2*j+1];
+        float x1 = xy[2*j+2], y1 = xy[2*j+3];
+        int m = (int) ceilf(2*fmaxf(fabsf(x1-x0)/sim->dx,
+                                    fabsf(y1-y0)/sim->dy));
+        for (int i = 1; i <= m; ++i)
+            probe_add_point(sim, x0 + (x1-x0)*i/m, y0 + (y1-y0)*i/m);
+    }
+    return probes->nprobe-1;
+}
+
+
+// Make sure there is a sample buffer for each thread
+static
+void probe_buffers(central2d_probes_t* probes, int threads)
+{
+    if (probes->nbuf >= threads)
+        return;
+    probes->buf = (central2d_probe_buf_t*)
+        realloc(probes->buf, threads * sizeof(central2d_probe_buf_t));
+    memset(probes->buf + probes->nbuf, 0,
+           (threads - probes->nbuf) * sizeof(central2d_probe_buf_t));
+    probes->nbuf = threads;
+}
+
+
+// Find the points in tiles lo to hi-1, and where they are in the tile
+// buffers (the ids and offsets live in the same block as the array)
+static
+central2d_probe_batch_t* probe_batches(central2d_tiles_t* tiles,
+                                       central2d_probes_t* probes,
+                                       int lo, int hi, int thread)
+{
+    int npoint = probes->npoint;
+    central2d_probe_batch_t* pb = (central2d_probe_batch_t*)
+        malloc((hi-lo) * sizeof(central2d_probe_batch_t) +
+               2*npoint * sizeof(int));
+    int* id = (int*) (pb + (hi-lo));
+    int* cell = id + npoint;
+    int ngu = tiles->ngu;
+    for (int i = lo; i < hi; ++i) {
+        central2d_tile_t* tile = tiles->tile + i;
+        central2d_probe_batch_t* b = pb + (i-lo);
+        b->n = 0;
+        b->id = id;
+        b->cell = cell;
+        b->npoint = npoint;
+        b->sample = 0;
+        b->buf = probes->buf + thread;
+        for (int p = 0; p < npoint; ++p) {
+            int ix = probes->point[p].ix - tile->x0;
+            int iy = probes->point[p].iy - tile->y0;
+            if (ix < 0 || ix >= tile->sx || iy < 0 || iy >= tile->sy)
+                continue;
+            *id++ = p;
+            *cell++ = (ngu+iy)*tile_stride(tiles, tile) + ngu+ix;
+            ++b->n;
+        }
+    }
+    return pb;
+}
+
+
+// Record the time of a sample (only thread 0 calls this)
+static
+void probe_time(central2d_probes_t* probes, long long sample, double t)
+{
+    if (sample >= probes->time_cap) {
+        probes->time_cap = 2*sample + 64;
+        probes->time = (double*) realloc(probes->time,
+                                         probes->time_cap * sizeof(double));
+    }
+    probes->time[sample] = t;
+}
+
+
+int central2d_probe_write(central2d_t* sim, const char* fname)
+{
+    central2d_probes_t* probes = sim->probes;
+    if (!probes)
+        return 0;
+    int nfield = sim->nfield, npoint = probes->npoint;
+    long long nsample = probes->nsample;
+    float* val = (float*) calloc(nsample*npoint*nfield, sizeof(float));
+    for (int t = 0; t < probes->nbuf; ++t) {
+        central2d_probe_buf_t* buf = probes->buf + t;
+        for (int j = 0; j < buf->n; ++j)
+            memcpy(val + buf->key[j]*nfield, buf->val + j*nfield,
+                   nfield * sizeof(float));
+    }
+
+    central2d_probe_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CENTRAL2D_PROBE_MAGIC, 8);
+    hdr.version = CENTRAL2D_PROBE_VERSION;
+    hdr.byte_order = 0x01020304;
+    hdr.nfield = nfield;
+    hdr.nprobe = probes->nprobe;
+    hdr.npoint = npoint;
+    hdr.nsample = nsample;
+
+    FILE* fp = fopen(fname, "wb");
+    int status = -1;
+    if (fp &&
+        fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+        fwrite(probes->probe, sizeof(central2d_probe_info_t),
+               probes->nprobe, fp) == (size_t) probes->nprobe &&
+        fwrite(probes->point, sizeof(central2d_probe_point_t),
+               npoint, fp) == (size_t) npoint &&
+        fwrite(probes->time, sizeof(double), nsample, fp) == (size_t) nsample &&
+        fwrite(val, sizeof(float)*nfield*npoint, nsample, fp) == (size_t) nsample)
+        status = 0;
+    if (fp && fclose(fp) != 0)
+        status = -1;
+    free(val);
+    return status;
+}
+
+
+/**
+ * ### Advance a fixed time
+ *
+ * The `run` method advances from time 0 (initial conditions) to time
+ * `tfinal`.  Note that `run` can be called repeatedly; for example,
+ * we might want to advance for a period of time, write out a picture,
+ * advance more, and write another picture.  In this sense, `tfinal`
+ * should be interpreted as an offset from the time represented by
+ * the simulator at the start of the call, rather than as an absolute time.
+ *
+ * We always take an even number of steps so that the solution
+ * at the end lives on the main grid instead of the staggered grid.
+ *
+ * All the threads stay in one parallel region for the whole run,
+ * and there are no barriers in it.  Each thread steps the tiles it
+ * owns, batch by batch, taking each tile as soon as its neighbors
+ * have caught up (see `tile_ready`) rather than in a fixed order; so
+ * a thread that gets ahead keeps going instead of waiting for the
+ * slowest tile in the grid.  Each thread also works out the time
+ * steps for itself from the tile wave speeds (the arithmetic is the
+ * same everywhere, so everyone agrees on when to stop).
+ *
+ * How we pick the time step depends on `dt_mode`.  By default, it is
+ * the largest step the CFL condition allows for the current state,
+ * which means nobody can start batch `b` until every tile has
+ * finished batch `b-1` and reported its wave speeds.  In lagged mode,
+ * we use the step for the state one batch back, scaled by
+ * `dt_safety`, so threads can be a full batch apart.  Since the speeds
+ * may have grown in the meantime, each tile checks the CFL number for
+ * its own state at the start and end of the batch, and stamps the
+ * batch in `reject` if either check fails.  By the time anyone starts
+ * batch `b`, all tiles have finished batch `b-2`, so everyone can tell
+ * whether it failed; if so, we throw away batches `b-2` and `b-1` and
+ * go back to the state before them (which is still in the third tile
+ * buffer), taking an ordinary step from there.  The stamps live in a
+ * ring of three, and the wait before batch `b` does not stop a fast
+ * thread from stamping batch `b+1` before a slow one has looked at
+ * batch `b-2` (nor does anything hold back a thread with no tiles);
+ * so each thread marks in `seen` which stamps it is done with, and a
+ * tile only stamps a slot once every thread is done with the batch
+ * that was there before.  Rejections are rare, so the wait costs
+ * little.  In fixed mode, we
+ * always take `dt_fixed` and don't look at the wave speeds at all, so
+ * tiles are only held back by their neighbors.  In every mode, the
+ * last batch is cut short to end exactly at `tfinal`.
+ */
+
+static
+int central2d_xrun(central2d_t* sim, float tfinal)
+{
+    central2d_tiles_t* tiles = sim->tiles;
+    int nfield = sim->nfield;
+    flux_t flux = sim->flux;
+    speed_t speed = sim->speed;
+    float dx = sim->dx, dy = sim->dy, cfl = sim->cfl;
+    int dt_mode = sim->dt_mode;
+    float dt_fixed = sim->dt_fixed, dt_safety = sim->dt_safety;
+
+    int nstep = 0, rollbacks = 0;
+    int cur = tiles->cur, cur_end = cur;
+    int partx = tiles->partx;
+    int ntiles = partx * tiles->party;
+    int tbatch = tiles->tbatch;
+    int ng = tiles->ngu/tbatch;
+    for (int i = 0; i < ntiles; ++i)
+        tiles->tile[i].done = 0;
+    tiles->reject[0] = tiles->reject[1] = tiles->reject[2] = -1;
+    for (int t = 0; t < tiles->threads; ++t)
+        tiles->seen[t] = -1;
+
+    // Probe samples are numbered from the initial state, taken on the
+    // first run
+    central2d_probes_t* probes = sim->probes;
+    if (probes && probes->npoint == 0)
+        probes = NULL;
+    if (probes)
+        probe_buffers(probes, tiles->threads);
+    long long sample0 = (probes ? (probes->nsample ? probes->nsample : 1) : 0);
+
+    #pragma omp parallel num_threads(tiles->threads)
+    {
+        int thread = omp_get_thread_num();
+        central2d_pin(tiles->cpu, thread);
+        PHASE_BEGIN();
+        int lo = tiles->first[thread], hi = tiles->first[thread+1];
+        float* work = tiles->work[thread];
+        int pN = layout_size(tiles->layout, nfield,
+                             tiles->sx_max + 2*tiles->ngu,
+                             tiles->sy_max + 2*tiles->ngu);
+        float* pv = work;
+        float* pscratch = work + pN;
+
+        central2d_probe_batch_t* pb = NULL;
+        central2d_probe_buf_t* pbuf = NULL;
+        if (probes) {
+            pb = probe_batches(tiles, probes, lo, hi, thread);
+            pbuf = probes->buf + thread;
+            if (probes->nsample == 0) {
+                for (int i = lo; i < hi; ++i)
+                    probe_record(pb + (i-lo), tiles->tile[i].u[cur],
+                                 tile_field_stride(tiles, tiles->tile + i),
+                                 nfield, 0);
+                if (thread == 0)
+                    probe_time(probes, 0, sim->time);
+            }
+        }
+
+        // Wave speeds are stale after a fixed-step run
+        if (dt_mode != CENTRAL2D_DT_FIXED && !tiles->cxy_valid) {
+            PHASE_LAP(PHASE_OTHER);
+            double t0 = trace_begin();
+            for (int i = lo; i < hi; ++i)
+                tile_speed(tiles, tiles->tile + i, speed);
+            trace_end("speed", t0, -1);
+            PHASE_LAP(PHASE_SPEED);
+            t0 = trace_begin();
+            #pragma omp barrier
+            trace_end("barrier", t0, -1);
+            PHASE_LAP(PHASE_WAIT);
+        }
+
+        // Buffer read, time, step count and probe samples at the start
+        // of the last three batches, in case we have to go back
+        int r_hist[3], n_hist[3], s_hist[3];
+        float t_hist[3];
+
+        int r = cur;
+        float t = 0;
+        int nstep_local = 0, rollbacks_local = 0;
+        int bfirst = 0;  // First batch since the start or a rollback
+        for (int b = 0; ; ++b) {
+
+            // Go back if batch b-2 failed its check
+            if (dt_mode == CENTRAL2D_DT_LAGGED && b-2 >= bfirst) {
+                PHASE_LAP(PHASE_OTHER);
+                double t0 = trace_begin();
+                central2d_tiles_wait(tiles, b-1);
+                trace_end("wait all", t0, b-1);
+                PHASE_LAP(PHASE_WAIT);
+                if (central2d_tiles_rejected(tiles, b-2)) {
+                    r = r_hist[(b-2)%3];
+                    t = t_hist[(b-2)%3];
+                    nstep_local = n_hist[(b-2)%3];
+                    if (pbuf)
+                        pbuf->n = s_hist[(b-2)%3];
+                    bfirst = b;
+                    ++rollbacks_local;
+                }
+            }
+            if (dt_mode == CENTRAL2D_DT_LAGGED)
+                central2d_tiles_seen(tiles, thread, b-2);
+
+            bool check = (dt_mode == CENTRAL2D_DT_LAGGED && b > bfirst);
+            float dt;
+            PHASE_LAP(PHASE_OTHER);
+            if (dt_mode == CENTRAL2D_DT_FIXED)
+                dt = dt_fixed;
+            else if (check)
+                dt = dt_safety * central2d_tiles_dt(tiles, r_hist[(b-1)%3],
+                                                    dx, dy, cfl);
+            else {
+                double t0 = trace_begin();
+                central2d_tiles_wait(tiles, b);
+                trace_end("wait all", t0, b);
+                PHASE_LAP(PHASE_WAIT);
+                t0 = trace_begin();
+                dt = central2d_tiles_dt(tiles, r, dx, dy, cfl);
+                trace_end("dt", t0, b);
+            }
+            PHASE_LAP(PHASE_SPEED);
+            bool last = (t + 2*tbatch*dt >= tfinal);
+            if (last)
+                dt = (tfinal-t)/2/tbatch;
+
+            r_hist[b%3] = r;
+            t_hist[b%3] = t;
+            n_hist[b%3] = nstep_local;
+            s_hist[b%3] = (pbuf ? pbuf->n : 0);
+
+            long long sample = sample0 + nstep_local/2;
+            if (probes && thread == 0)
+                for (int p = 0; p < tbatch; ++p)
+                    probe_time(probes, sample + p,
+                               sim->time + t + 2*dt*(p+1));
+
+            // Step our tiles in whatever order they become ready
+            int w = (r+1) % 3;
+            int left = hi-lo;
+            PHASE_LAP(PHASE_OTHER);
+            double wait0 = -1;  // Start of a wait on the neighbors
+            while (left > 0) {
+                bool progress = false;
+                for (int i = lo; i < hi; ++i) {
+                    central2d_tile_t* tile = tiles->tile + i;
+                    if (tile->done > b || !tile_ready(tiles, i, b))
+                        continue;
+                    PHASE_LAP(PHASE_WAIT);
+                    PHASE_MARK(tile_t0);
+                    if (wait0 >= 0) {
+                        trace_end("wait", wait0, b);
+                        wait0 = -1;
+                    }
+                    double t0 = trace_begin();
+                    tile_exchange(tiles, i % partx, i / partx, nfield, r);
+                    trace_end("halo", t0, i);
+                    PHASE_LAP(PHASE_HALO);
+                    t0 = trace_begin();
+                    float* cxy = (dt_mode == CENTRAL2D_DT_FIXED ?
+                                  NULL : tile->cxy[w]);
+                    central2d_probe_batch_t* probe = (pb ? pb + (i-lo) : NULL);
+                    if (probe)
+                        probe->sample = sample;
+                    central2d_step_batch(tile->u[r], tile->u[w],
+                                         pv, pscratch,
+                                         tile->sx, tile->sy, ng,
+                                         tiles->layout,
+                                         nfield, flux, speed, cxy,
+                                         tile->stats + 3*nfield*w, probe,
+                                         dt, dx, dy, tbatch);
+                    trace_end("batch", t0, i);
+                    if (check &&
+                        !(central2d_cfl_ok(tile->cxy[r], dt, dx, dy, cfl) &&
+                          central2d_cfl_ok(cxy, dt, dx, dy, cfl)))
+                        central2d_tiles_reject(tiles, b);
+                    tile_finish(tile, b+1);
+                    PHASE_LAP(PHASE_OTHER);
+                    PHASE_SINCE(tile->ticks, tile_t0);
+                    progress = true;
+                    --left;
+                }
+                if (!progress) {
+                    if (wait0 < 0)
+                        wait0 = trace_begin();
+                    sched_yield();
+                }
+            }
+            PHASE_LAP(PHASE_WAIT);
+
+            r = w;
+            t += 2*dt*tbatch;
+            nstep_local += 2*tbatch;
+            if (!last)
+                continue;
+
+            // The last two batches haven't been checked yet
+            if (dt_mode == CENTRAL2D_DT_LAGGED) {
+                double t0 = trace_begin();
+                central2d_tiles_wait(tiles, b+1);
+                trace_end("wait all", t0, b+1);
+                PHASE_LAP(PHASE_WAIT);
+                int m = (b-1 >= bfirst && central2d_tiles_rejected(tiles, b-1) ?
+                         b-1 : central2d_tiles_rejected(tiles, b) ? b : -1);
+                central2d_tiles_seen(tiles, thread, b);
+                if (m >= 0) {
+                    r = r_hist[m%3];
+                    t = t_hist[m%3];
+                    nstep_local = n_hist[m%3];
+                    if (pbuf)
+                        pbuf->n = s_hist[m%3];
+                    bfirst = b+1;
+                    ++rollbacks_local;
+                    continue;
+                }
+            }
+            break;
+        }
+
+        free(pb);
+        PHASE_LAP(PHASE_OTHER);
+
+        // Charge the wait for the slowest thread here rather than
+        // leaving it to the implicit barrier
+        if (trace_enabled) {
+            double t0 = trace_begin();
+            #pragma omp barrier
+            trace_end("barrier", t0, -1);
+        }
+#ifdef PHASE_TIMERS
+        else {
+            #pragma omp barrier
+        }
+        PHASE_LAP(PHASE_WAIT);
+#endif
+        central2d_phase_fold(tiles, thread);
+
+        #pragma omp master
+        {
+            nstep = nstep_local;
+            rollbacks = rollbacks_local;
+            cur_end = r;
+        }
+    }
+
+    if (probes)
+        probes->nsample = sample0 + nstep/2;
+    tiles->cur = cur_end;
+    tiles->cxy_valid = (dt_mode != CENTRAL2D_DT_FIXED);
+    sim->rollbacks += rollbacks;
+    return nstep;
+}
+
+
+/**
+ * ### Wavefront tiling
+ *
+ * The halo tiles redo a ring of ghost cells in every step of a batch,
+ * and a deep batch makes that ring thick.  The wavefront scheme gets
+ * the same reuse of cached data without any redundant updates.  We
+ * cut the grid into bands of whole rows, one per thread, and take
+ * `tbatch` pairs of steps at a time; call the state after `l` steps of
+ * such a sweep level `l`.  Since each band row is a full grid row,
+ * the periodic ghost cells in x can be filled from the row itself as
+ * soon as it is written, and only y needs any thought.
+ *
+ * Output row `r` of an even step depends on input rows `r-1` to
+ * `r+2`, and of an odd step on rows `r-2` to `r+1` (that is the shift
+ * by `io`, seen from the output side).  So a band `[y0, y1)` can
+ * compute rows `[y0+1, y1-2)` of level 1, rows `[y0+3, y1-3)` of
+ * level 2, and so on, shrinking by three rows per step in all, using
+ * nothing but its own data: a trapezoid in space and time.  We walk
+ * the band once, with every level trailing the one before it by a
+ * few rows, so that each row goes through all the levels of the sweep
+ * while it is still in cache; the step kernel keeps its rings in a
+ * scratch block per level, and picks up each level where it left off.
+ *
+ * What is left is an upside-down trapezoid (a valley) around each
+ * band boundary, six rows wide at level 1 and growing by six rows per
+ * step.  Once both bands next to a boundary have finished their
+ * trapezoids, one thread computes the valley level by level in a small
+ * buffer of its own: each level needs three rows of the level below
+ * on each side from the trapezoids, plus the valley of the level
+ * below, which is already in the buffer.  Finally it copies the
+ * valley of the last level into `u`.  Trapezoids and valleys split
+ * the work of a sweep evenly, so each thread does one of each.
+ *
+ * The levels alternate between `u` (even) and a second full-size
+ * array `v` (odd), and level `l+2` overwrites level `l` in place.
+ * That only ever happens well inside the trapezoid: the rows of
+ * level `l` a valley still needs are within two rows of the edge of
+ * the trapezoid at level `l+1`, and the trapezoid at level `l+2` is
+ * narrower than that by at least the reach of a step on each side.
+ * Likewise, the rows in flight in the pipeline are well ahead of
+ * anything the next level writes.  Valleys at neighboring boundaries
+ * don't meet as long as every band has at least `6*tbatch` rows.
+ *
+ * Every cell is computed with the same arithmetic as in the plain
+ * sweep over the whole grid, so the results match the halo tiles with
+ * the same `tbatch` bit for bit.  The time step for a sweep comes from
+ * the wave speeds the last level of the previous sweep left behind,
+ * two generations of which we keep per band so that nobody clears
+ * the maxima another thread is still reading.
+ *
+ * As with the halo tiles, each thread is pinned to its own CPU, and
+ * each band's rows of `u` and `v` are first written by the thread
+ * that owns the band.  For `u`, which already holds the solution,
+ * that means moving it to a new array when we set up.
+ */
+
+#define WAVE_CHUNK 8    // Rows per level per turn of the pipeline
+
+struct central2d_wave_t {
+    int threads;        // Number of threads we were set up for
+    int tbatch;         // Step pairs per sweep
+    int nband;          // Number of bands (at most one per thread)
+    int* ys;            // Band boundaries in y (nband+1 entries)
+    float* v;           // Odd levels of a sweep (same layout as u)
+    float** work;       // Per-thread valley buffers and row scratch
+    int* cpu;           // CPU for thread t (-1 if we don't pin)
+    float (*cxy)[2][2]; // Max wave speeds for each band and generation
+    int cur;            // Generation of cxy for the current state
+    bool cxy_valid;     // Are the wave speeds for cur up to date?
+};
+
+
+static
+void central2d_wave_free(central2d_wave_t* wave)
+{
+    if (!wave)
+        return;
+    for (int i = 0; i < wave->threads; ++i)
+        central2d_release(wave->work[i]);
+    central2d_release(wave->v);
+    free(wave->work);
+    free(wave->cpu);
+    free(wave->ys);
+    free(wave->cxy);
+    free(wave);
+}
+
+
+// First and last row of level l that band [y0, y1) computes itself
+static inline
+int wave_lo(int y0, int l)
+{
+    return y0 + 3*(l/2) + l%2;
+}
+
+static inline
+int wave_hi(int y1, int l)
+{
+    return y1 - 3*(l/2) - 2*(l%2);
+}
+
+
+// Rows in a valley buffer (with a margin of one row at each end),
+// and the floats each of its two levels takes
+static inline
+int wave_rows(int tbatch)
+{
+    return 6*tbatch + 6;
+}
+
+static inline
+int wave_size(const central2d_t* sim, int tbatch)
+{
+    return layout_size(sim->layout, sim->nfield, sim->nx + 2*sim->ng,
+                       wave_rows(tbatch));
+}
+
+
+// Copy rows [r0, r1) between a valley buffer w (whose row 0 is grid
+// row base, with strides cw and rw) and a global array g (laid out
+// like u), wrapping around in y
+static
+void wave_copy_rows(central2d_t* sim, float* w, int cw, int rw, float* g,
+                    int base, int r0, int r1, bool to_global)
+{
+    int ny = sim->ny, ng = sim->ng;
+    int nx_all = sim->nx + 2*ng;
+    int c = sim->field_stride, rs = sim->row_stride;
+    for (int r = r0; r < r1; ++r) {
+        int iy = ((r % ny) + ny) % ny + ng;
+        for (int k = 0; k < sim->nfield; ++k) {
+            float* wr = w + k*cw + (r-base)*rw;
+            float* gr = g + k*c + iy*rs;
+            if (to_global)
+                memcpy(gr, wr, nx_all * sizeof(float));
+            else
+                memcpy(wr, gr, nx_all * sizeof(float));
+        }
+    }
+}
+
+
+// Sweep the trapezoid of band [y0, y1)
+static
+void wave_band(central2d_t* sim, central2d_wave_t* wave, int y0, int y1,
+               float* scratch, float* cxy, float dt)
+{
+    int nx = sim->nx, ng = sim->ng, nfield = sim->nfield;
+    int nx_all = nx + 2*ng;
+    int c = sim->field_stride, rs = sim->row_stride;
+    int nlevel = 2*wave->tbatch;
+    int nscratch = central2d_step_scratch(nx_all, nfield);
+    float* buf[2] = { sim->u, wave->v };
+
+    // Output rows of each level are ylo+io to yhi-1+io, as in the
+    // kernel; next is the next input row, and rows below done are
+    // finished
+    int ylo[nlevel+1], yhi[nlevel+1], next[nlevel+1], done[nlevel+1];
+    done[0] = y1 + ng;
+    for (int l = 1; l <= nlevel; ++l) {
+        int io = (l+1) % 2;
+        ylo[l] = wave_lo(y0, l) + ng - io;
+        yhi[l] = wave_hi(y1, l) + ng - io;
+        next[l] = ylo[l]-1;
+        done[l] = ylo[l];
+    }
+
+    while (next[nlevel] < yhi[nlevel]+2) {
+        for (int l = 1; l <= nlevel; ++l) {
+            int io = (l+1) % 2;
+            int jb = next[l] + WAVE_CHUNK;
+            jb = (jb < yhi[l]+2 ? jb : yhi[l]+2);
+            jb = (jb < done[l-1] ? jb : done[l-1]);
+            if (jb <= next[l])
+                continue;
+            central2d_step_rows(buf[(l+1)%2], buf[l%2],
+                                scratch + (l-1)*nscratch,
+                                io, nx, ng, c, rs, ylo[l], yhi[l],
+                                next[l], jb, true,
+                                nfield, sim->flux, sim->speed,
+                                (l == nlevel ? cxy : NULL), NULL,
+                                dt, sim->dx, sim->dy);
+            next[l] = jb;
+            done[l] = jb-2+io;
+        }
+    }
+}
+
+
+// Fill in the valley around the band boundary at row y, in buffer w
+static
+void wave_valley(central2d_t* sim, central2d_wave_t* wave, int y,
+                 float* w, float* scratch, float* cxy, float dt)
+{
+    int nx = sim->nx, ng = sim->ng, nfield = sim->nfield;
+    int tbatch = wave->tbatch;
+    int nlevel = 2*tbatch;
+    int cw = layout_field_stride(sim->layout, nx + 2*ng, wave_rows(tbatch));
+    int rw = layout_row_stride(sim->layout, nfield, nx + 2*ng);
+    int base = y - wave_rows(tbatch)/2;
+    float* buf[2] = { sim->u, wave->v };
+    float* wl[2] = { w, w + wave_size(sim, tbatch) };
+
+    for (int l = 1; l <= nlevel; ++l) {
+        int io = (l+1) % 2;
+        int hi = wave_hi(y, l), lo = wave_lo(y, l);
+        int hi0 = wave_hi(y, l-1), lo0 = wave_lo(y, l-1);
+        wave_copy_rows(sim, wl[(l+1)%2], cw, rw, buf[(l+1)%2],
+                       base, hi0-3, hi0, false);
+        wave_copy_rows(sim, wl[(l+1)%2], cw, rw, buf[(l+1)%2],
+                       base, lo0, lo0+3, false);
+        central2d_step_rows(wl[(l+1)%2], wl[l%2], scratch,
+                            io, nx, ng, cw, rw,
+                            hi-base-io, lo-base-io,
+                            hi-base-io-1, lo-base-io+2, true,
+                            nfield, sim->flux, sim->speed,
+                            (l == nlevel ? cxy : NULL), NULL,
+                            dt, sim->dx, sim->dy);
+    }
+    wave_copy_rows(sim, wl[0], cw, rw, sim->u, base,
+                   wave_hi(y, nlevel), wave_lo(y, nlevel), true);
+}
+
+
+static
+central2d_wave_t* central2d_wave_init(central2d_t* sim, int threads)
+{
+    int nx = sim->nx, ny = sim->ny, ng = sim->ng, nfield = sim->nfield;
+    int nx_all = nx + 2*ng;
+    int c = sim->field_stride, rs = sim->row_stride;
+
+    // Bands need 6*tbatch rows (see central2d_use_wave), and the x
+    // wrap needs ng columns (as do the halo tiles)
+    int tbatch_max = ny/6;
+    assert(tbatch_max >= 1 && nx >= ng);
+    if (sim->tbatch > tbatch_max)
+        sim->tbatch = tbatch_max;
+
+    central2d_wave_t* wave =
+        (central2d_wave_t*) malloc(sizeof(central2d_wave_t));
+    wave->threads = threads;
+    wave->tbatch = sim->tbatch;
+    wave->nband = ny / (6*wave->tbatch);
+    if (wave->nband > threads)
+        wave->nband = threads;
+    wave->ys = (int*) malloc((wave->nband+1) * sizeof(int));
+    central2d_partition(wave->ys, ny, wave->nband);
+    wave->cxy = (float (*)[2][2]) malloc(wave->nband * sizeof(*wave->cxy));
+    wave->cur = 0;
+    wave->cxy_valid = false;
+    wave->v = central2d_alloc(central2d_size(sim));
+    wave->work = (float**) malloc(threads * sizeof(float*));
+    wave->cpu = (int*) malloc(threads * sizeof(int));
+    central2d_cpus(wave->cpu, threads);
+
+    int nwork = 2*wave_size(sim, wave->tbatch) +
+        2*wave->tbatch * central2d_step_scratch(nx_all, nfield);
+
+    // Each thread writes its own work array and band of u and v first;
+    // u moves to a new array for this, and the first and last bands
+    // take the ghost rows at their ends
+    float* old = sim->u;
+    float* u = central2d_alloc(central2d_size(sim));
+    #pragma omp parallel num_threads(threads)
+    {
+        int t = omp_get_thread_num();
+        central2d_pin(wave->cpu, t);
+        wave->work[t] = central2d_alloc(nwork);
+        memset(wave->work[t], 0, nwork * sizeof(float));
+        if (t < wave->nband) {
+            int y0 = wave->ys[t] + (t == 0 ? 0 : ng);
+            int y1 = wave->ys[t+1] + (t == wave->nband-1 ? 2*ng : ng);
+            for (int iy = y0; iy < y1; ++iy)
+                for (int k = 0; k < nfield; ++k) {
+                    memcpy(u + k*c + iy*rs, old + k*c + iy*rs,
+                           nx_all * sizeof(float));
+                    memset(wave->v + k*c + iy*rs, 0,
+                           nx_all * sizeof(float));
+                }
+        }
+    }
+    central2d_release(old);
+    sim->u = u;
+    return wave;
+}
+
+
+// Set up the wavefront state, taking over from the tiles if need be
+static
+void central2d_wave_setup(central2d_t* sim, int threads)
+{
+    if (sim->tiles) {
+        central2d_sync(sim);
+        central2d_tiles_free(sim->tiles);
+        sim->tiles = NULL;
+    }
+    central2d_wave_t* wave = sim->wave;
+    if (wave && (wave->threads != threads || wave->tbatch != sim->tbatch)) {
+        central2d_wave_free(wave);
+        sim->wave = NULL;
+    }
+    if (!sim->wave)
+        sim->wave = central2d_wave_init(sim, threads);
+}
+
+
+// CFL-limited time step from the band wave speeds of generation cur
+static
+float central2d_wave_dt(const central2d_wave_t* wave, int cur,
+                        float dx, float dy, float cfl)
+{
+    float cxy[2] = {1.0e-15f, 1.0e-15f};
+    for (int i = 0; i < wave->nband; ++i) {
+        cxy[0] = fmaxf(cxy[0], wave->cxy[i][cur][0]);
+        cxy[1] = fmaxf(cxy[1], wave->cxy[i][cur][1]);
+    }
+    return cfl / fmaxf(cxy[0]/dx, cxy[1]/dy);
+}
+
+
+/**
+ * The run itself has two barriers per sweep, one between the
+ * trapezoids and the valleys and one after the valleys; otherwise it
+ * follows `central2d_xrun`, with each thread pinning itself and
+ * working out the time steps for itself.  Before the first sweep,
+ * each band fills its ghost cells in x (the trapezoids assume they
+ * are current) and, if need be, gets its wave speeds.
+ */
+
+static
+int central2d_wrun(central2d_t* sim, float tfinal)
+{
+    central2d_wave_t* wave = sim->wave;
+    int nx = sim->nx, ng = sim->ng, nfield = sim->nfield;
+    int c = sim->field_stride, rs = sim->row_stride;
+    float dx = sim->dx, dy = sim->dy, cfl = sim->cfl;
+    bool fixed = (sim->dt_mode == CENTRAL2D_DT_FIXED);
+    int tbatch = wave->tbatch;
+    bool need_cxy = (!fixed && !wave->cxy_valid);
+    int nstep = 0, cur_end = wave->cur;
+
+    #pragma omp parallel num_threads(wave->threads)
+    {
+        int thread = omp_get_thread_num();
+        central2d_pin(wave->cpu, thread);
+        bool mine = (thread < wave->nband);
+        int y0 = (mine ? wave->ys[thread] : 0);
+        int y1 = (mine ? wave->ys[thread+1] : 0);
+        float* w = wave->work[thread];
+        float* scratch = w + 2*wave_size(sim, tbatch);
+        int cur = wave->cur;
+
+        if (mine) {
+            double t0 = trace_begin();
+            for (int iy = y0+ng; iy < y1+ng; ++iy)
+                for (int k = 0; k < nfield; ++k) {
+                    float* row = sim->u + k*c + iy*rs;
+                    memcpy(row, row + nx, ng * sizeof(float));
+                    memcpy(row + nx+ng, row + ng, ng * sizeof(float));
+                }
+            if (need_cxy) {
+                float* cxy = wave->cxy[thread][cur];
+                cxy[0] = 1.0e-15f;
+                cxy[1] = 1.0e-15f;
+                for (int iy = y0; iy < y1; ++iy)
+                    sim->speed(cxy, sim->u + central2d_offset(sim, 0, 0, iy),
+                               nx, c);
+            }
+            trace_end("speed", t0, -1);
+        }
+        double t0 = trace_begin();
+        #pragma omp barrier
+        trace_end("barrier", t0, -1);
+
+        float t = 0;
+        int nstep_local = 0;
+        for (int b = 0; ; ++b) {
+            float dt = (fixed ? sim->dt_fixed :
+                        central2d_wave_dt(wave, cur, dx, dy, cfl));
+            bool last = (t + 2*tbatch*dt >= tfinal);
+            if (last)
+                dt = (tfinal-t)/2/tbatch;
+
+            float* cxy = NULL;
+            if (mine && !fixed) {
+                cxy = wave->cxy[thread][1-cur];
+                cxy[0] = 1.0e-15f;
+                cxy[1] = 1.0e-15f;
+            }
+            if (mine) {
+                t0 = trace_begin();
+                wave_band(sim, wave, y0, y1, scratch, cxy, dt);
+                trace_end("trapezoid", t0, thread);
+            }
+            t0 = trace_begin();
+            #pragma omp barrier
+            trace_end("barrier", t0, b);
+            if (mine) {
+                t0 = trace_begin();
+                wave_valley(sim, wave, y1, w, scratch, cxy, dt);
+                trace_end("valley", t0, thread);
+            }
+            t0 = trace_begin();
+            #pragma omp barrier
+            trace_end("barrier", t0, b);
+
+            cur = 1-cur;
+            t += 2*dt*tbatch;
+            nstep_local += 2*tbatch;
+            if (last)
+                break;
+        }
+
+        #pragma omp master
+        {
+            nstep = nstep_local;
+            cur_end = cur;
+        }
+    }
+
+    wave->cur = cur_end;
+    wave->cxy_valid = !fixed;
+    return nstep;
+}
+
+
+// Use the wavefront scheme for this run (is it asked for, and can we)?
+static inline
+bool central2d_use_wave(central2d_t* sim)
+{
+    return (sim->tiling == CENTRAL2D_TILING_WAVEFRONT &&
+            !(sim->probes && sim->probes->npoint > 0) &&
+            sim->ny >= 6);
+}
+
+
+void central2d_setup(central2d_t* sim, int threads)
+{
+    if (central2d_use_wave(sim))
+        central2d_wave_setup(sim, threads);
+    else
+        central2d_tiles_setup(sim, threads);
+}
+
+
+int central2d_run(central2d_t* sim, float tfinal, int threads)
+{
+    int nstep;
+    if (central2d_use_wave(sim)) {
+        central2d_wave_setup(sim, threads);
+        nstep = central2d_wrun(sim, tfinal);
+    } else {
+        central2d_tiles_setup(sim, threads);
+        nstep = central2d_xrun(sim, tfinal);
+        sim->tiles->synced = false;
+    }
+    sim->time += tfinal;
+    return nstep;
+}
+
+
+/**
+ * ### Checkpoint and restart
+ *
+ * The header is padded out to a page, so that the data that follows
+ * starts on a page boundary and stays aligned when the file is mapped.
+ * On restart, we map the whole file privately (so the file never
+ * changes under us, and writes to `u` only copy the pages they touch)
+ * and set `u` to point just past the header.  The last few bytes of
+ * the header page double as the allocation header that
+ * `central2d_release` looks at; they are only changed in our private
+ * copy of the page.
+ */
+
+#define CENTRAL2D_CHECKPOINT_HEADER 4096
+
+// Layout descriptions, indexed by central2d_layout_t
+static const char* central2d_layout_names[] = {
+    "float32 u[nfield][ny+2*ng][nx+2*ng]",
+    "float32 u[ny+2*ng][nfield][nx+2*ng]"
+};
+
+static
+void central2d_checkpoint_header(central2d_t* sim, central2d_checkpoint_t* hdr)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, CENTRAL2D_CHECKPOINT_MAGIC, 8);
+    hdr->version = CENTRAL2D_CHECKPOINT_VERSION;
+    hdr->byte_order = 0x01020304;
+    hdr->header_size = CENTRAL2D_CHECKPOINT_HEADER;
+    hdr->float_size = sizeof(float);
+    hdr->nfield = sim->nfield;
+    hdr->nx = sim->nx;
+    hdr->ny = sim->ny;
+    hdr->ng = sim->ng;
+    hdr->dx = sim->dx;
+    hdr->dy = sim->dy;
+    hdr->cfl = sim->cfl;
+    hdr->time = sim->time;
+    hdr->data_size = (long long) central2d_size(sim) * sizeof(float);
+    snprintf(hdr->layout, sizeof(hdr->layout), "%s",
+             central2d_layout_names[sim->layout]);
+    hdr->field_stride = sim->field_stride;
+    hdr->row_stride = sim->row_stride;
+}
+
+
+int central2d_checkpoint(central2d_t* sim, const char* fname)
+{
+    central2d_sync(sim);
+
+    char page[CENTRAL2D_CHECKPOINT_HEADER];
+    central2d_checkpoint_t hdr;
+    central2d_checkpoint_header(sim, &hdr);
+    memset(page, 0, sizeof(page));
+    memcpy(page, &hdr, sizeof(hdr));
+
+    char tmpname[strlen(fname) + 5];
+    sprintf(tmpname, "%s.tmp", fname);
+    FILE* fp = fopen(tmpname, "wb");
+    if (!fp)
+        return -1;
+    int ok = (fwrite(page, sizeof(page), 1, fp) == 1 &&
+              fwrite(sim->u, hdr.data_size, 1, fp) == 1);
+    ok = (fclose(fp) == 0 && ok);
+    if (!ok || rename(tmpname, fname) != 0) {
+        remove(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+
+central2d_t* central2d_restart(const char* fname,
+                               flux_t flux, speed_t speed)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    // Check that the header describes a file we can map as it is
+    central2d_checkpoint_t hdr;
+    struct stat st;
+    int layout = -1;
+    memset(&hdr, 0, sizeof(hdr));
+    if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr))
+        for (int i = 0; i < 2; ++i)
+            if (strncmp(hdr.layout, central2d_layout_names[i],
+                        sizeof(hdr.layout)) == 0)
+                layout = i;
+
+    // Version 1 files were written before we padded the rows
+    bool rows = (layout == CENTRAL2D_LAYOUT_ROWS);
+    long long nx_all = hdr.nx + 2*hdr.ng, ny_all = hdr.ny + 2*hdr.ng;
+    if (hdr.version == 1) {
+        hdr.field_stride = (rows ? nx_all : nx_all * ny_all);
+        hdr.row_stride = (rows ? hdr.nfield * nx_all : nx_all);
+    }
+    long long fs = hdr.field_stride, rs = hdr.row_stride;
+    if (layout < 0 ||
+        fstat(fd, &st) != 0 ||
+        memcmp(hdr.magic, CENTRAL2D_CHECKPOINT_MAGIC, 8) != 0 ||
+        (hdr.version != 1 && hdr.version != CENTRAL2D_CHECKPOINT_VERSION) ||
+        hdr.byte_order != 0x01020304 ||
+        hdr.float_size != sizeof(float) ||
+        hdr.header_size < sizeof(hdr) + CENTRAL2D_ALLOC_HEADER ||
+        hdr.header_size % CENTRAL2D_ALLOC_HEADER != 0 ||
+        hdr.nfield < 1 || hdr.nx < 1 || hdr.ny < 1 || hdr.ng < 0 ||
+        fs < (rows ? nx_all : ny_all * rs) ||
+        rs < (rows ? hdr.nfield * fs : nx_all) ||
+        hdr.data_size != (long long) sizeof(float) *
+                         ((hdr.nfield-1)*fs + (ny_all-1)*rs + nx_all) ||
+        st.st_size < (off_t) (hdr.header_size + hdr.data_size)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t bytes = hdr.header_size + hdr.data_size;
+    char* base = (char*) mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    central2d_t* sim = central2d_new(hdr.nx, hdr.ny, hdr.ng, hdr.dx, hdr.dy,
+                                     hdr.nfield, flux, speed, hdr.cfl);
+    sim->time = hdr.time;
+    sim->layout = layout;
+    sim->field_stride = hdr.field_stride;
+    sim->row_stride = hdr.row_stride;
+    sim->u = (float*) (base + hdr.header_size);
+    central2d_alloc_header(sim->u)->base = base;
+    central2d_alloc_header(sim->u)->bytes = bytes;
+    return sim;
+}
+
+
+/**
+ * ### Reporting placement
+ *
+ * To check that the placement works, each thread reports where it is
+ * running and (on Linux) asks the kernel which node holds each page
+ * of its current tile buffers.  The wavefront scheme just reports its
+ * bands.
+ */
+
+#ifdef __linux__
+// Count pages in [u, u+n) that are on the given node
+static
+long central2d_local_pages(const float* u, int n, int node, long* total)
+{
+    long count = 0;
+    enum { NPAGE = 256 };
+    long page = sysconf(_SC_PAGESIZE);
+    const char* p = (const char*) u;
+    const char* end = (const char*) (u + n);
+    p -= (size_t) p % page;
+    while (p < end) {
+        void* pages[NPAGE];
+        int status[NPAGE];
+        long np = 0;
+        for (; np < NPAGE && p < end; ++np, p += page)
+            pages[np] = (void*) p;
+        if (syscall(SYS_move_pages, 0, np, pages, NULL, status, 0) != 0)
+            return -1;
+        for (long j = 0; j < np; ++j)
+            count += (status[j] == node);
+        *total += np;
+    }
+    return count;
+}
+#endif
+
+
+void central2d_placement(central2d_t* sim, int threads, FILE* fp)
+{
+    if (central2d_use_wave(sim)) {
+        central2d_wave_setup(sim, threads);
+        central2d_wave_t* wave = sim->wave;
+        fprintf(fp, "Wavefront: %d bands of %d-%d rows, %d step pairs "
+                "per sweep\n", wave->nband, sim->ny / wave->nband,
+                (sim->ny + wave->nband-1) / wave->nband, wave->tbatch);
+        return;
+    }
+    central2d_tiles_setup(sim, threads);
+    central2d_tiles_t* tiles = sim->tiles;
+    int cpu[threads], node[threads];
+    long local[threads], pages[threads];
+
+    #pragma omp parallel num_threads(threads)
+    {
+        int t = omp_get_thread_num();
+        central2d_pin(tiles->cpu, t);
+        cpu[t] = node[t] = -1;
+        local[t] = pages[t] = 0;
+#ifdef __linux__
+        unsigned c, m;
+        if (syscall(SYS_getcpu, &c, &m, NULL) == 0) {
+            cpu[t] = c;
+            node[t] = m;
+        }
+        for (int i = tiles->first[t]; i < tiles->first[t+1]; ++i) {
+            central2d_tile_t* tile = tiles->tile + i;
+            int n = tile_size(tiles, tile);
+            long count = central2d_local_pages(tile->u[tiles->cur], n,
+                                               node[t], pages + t);
+            local[t] = (count < 0 || local[t] < 0 ? -1 : local[t] + count);
+        }
+#endif
+    }
+
+    fprintf(fp, "Tiles: %d x %d, %s\n", tiles->partx, tiles->party,
+            tiles->cpu[0] >= 0 ? "threads pinned" :
+            "threads placed by OpenMP (or not at all)");
+    for (int t = 0; t < threads; ++t) {
+        int lo = tiles->first[t], hi = tiles->first[t+1];
+        long cells = 0;
+        for (int i = lo; i < hi; ++i)
+            cells += (long) tiles->tile[i].sx * tiles->tile[i].sy;
+        fprintf(fp, "  Thread %d: cpu %d, node %d, tiles %d-%d (%ld cells)",
+                t, cpu[t], node[t], lo, hi-1, cells);
+        if (local[t] >= 0 && pages[t] > 0)
+            fprintf(fp, ", %.0f%% of tile pages local",
+                    100.0 * local[t] / pages[t]);
+        fprintf(fp, "\n");
+    }
+}
+
+
+void central2d_timers(central2d_t* sim, FILE* fp)
+{
+#ifdef PHASE_TIMERS
+    static const char* names[PHASE_COUNT] = {
+        "halo", "flux", "predict", "hflux", "correct",
+        "speed", "write", "wait", "other"
+    };
+    central2d_tiles_t* tiles = sim->tiles;
+    if (!tiles)
+        return;
+    double wall = omp_get_wtime() - tiles->wall0;
+    if (wall <= 0)
+        return;
+    double sec = wall / (double) (phase_ticks() - tiles->tick0);
+
+    int threads = tiles->threads;
+    fprintf(fp, "Phase times (s) since the tiles were set up:\n  thread");
+    for (int p = 0; p < PHASE_COUNT; ++p)
+        fprintf(fp, " %9s", names[p]);
+    fprintf(fp, "\n");
+    double total[PHASE_COUNT] = {0};
+    double busy_min = INFINITY, busy_max = 0, busy_sum = 0;
+    for (int t = 0; t < threads; ++t) {
+        const uint64_t* acc = tiles->phase + t*PHASE_COUNT;
+        double busy = 0;
+        fprintf(fp, "  %6d", t);
+        for (int p = 0; p < PHASE_COUNT; ++p) {
+            double x = acc[p] * sec;
+            fprintf(fp, " %9.3e", x);
+            total[p] += x;
+            if (p != PHASE_WAIT)
+                busy += x;
+        }
+        fprintf(fp, "\n");
+        busy_min = fmin(busy_min, busy);
+        busy_max = fmax(busy_max, busy);
+        busy_sum += busy;
+    }
+    fprintf(fp, "  %6s", "total");
+    for (int p = 0; p < PHASE_COUNT; ++p)
+        fprintf(fp, " %9.3e", total[p]);
+    fprintf(fp, "\n");
+
+    // Imbalance: how much longer the busiest thread works than average
+    double busy_mean = busy_sum / threads;
+    fprintf(fp, "Busy time per thread: min %.3e, mean %.3e, max %.3e "
+            "(imbalance %.1f%%)\n", busy_min, busy_mean, busy_max,
+            busy_mean > 0 ? 100 * (busy_max / busy_mean - 1) : 0);
+
+    int ntiles = tiles->partx * tiles->party, slow = 0;
+    double tile_min = INFINITY, tile_sum = 0;
+    for (int i = 0; i < ntiles; ++i) {
+        double x = tiles->tile[i].ticks * sec;
+        tile_min = fmin(tile_min, x);
+        tile_sum += x;
+        if (tiles->tile[i].ticks > tiles->tile[slow].ticks)
+            slow = i;
+    }
+    fprintf(fp, "Time per tile: min %.3e, mean %.3e, max %.3e "
+            "(tile %d, %d x %d cells)\n", tile_min, tile_sum / ntiles,
+            tiles->tile[slow].ticks * sec, slow,
+            tiles->tile[slow].sx, tiles->tile[slow].sy);
+#else
+    (void) sim;
+    (void) fp;
+#endif
+}
+
+
+/**
+ * ### Tuning the batch depth and tile size
+ *
+ * Deeper batches mean fewer exchanges (and barriers) per step, but
+ * every extra level costs a ring of redundant work in the ghost cells
+ * and makes the tile buffers bigger.  Similarly, the cache-based tile
+ * size is only an educated guess.  Where the balance lies depends
+ * on the grid, the thread count, and the machine, so we just measure.
+ * For each candidate depth, we try the cache-sized tiles and tiles
+ * with half and twice the edge length (unless the caller fixed the
+ * tile size).  Each candidate runs from the current state for the
+ * time that a multiple of every candidate depth would take at the
+ * current time step, and then we put the state back the way we found
+ * it.  The steps may still come out differently (the wave speeds can
+ * change along the way, and lagged steps can be redone), so we compare
+ * the wall time per step that the run kept, rather than the total.
+ */
+
+#define TBATCH_TUNE_MAX   4
+#define TBATCH_TUNE_PAIRS 12
+
+int central2d_autotune(central2d_t* sim, int threads)
+{
+    central2d_sync(sim);
+    int rollbacks = sim->rollbacks;
+    central2d_probes_t* probes = sim->probes;
+    sim->probes = NULL;
+    size_t N = central2d_size(sim);
+    float* u0 = (float*) malloc(N * sizeof(float));
+    memcpy(u0, sim->u, N * sizeof(float));
+
+    bool tune_tiles = (sim->tile_nx == 0 && sim->tile_ny == 0);
+    int tile_nx = sim->tile_nx, tile_ny = sim->tile_ny;
+    int best = 0, best_nx = tile_nx, best_ny = tile_ny;
+    double tbest = 0;
+    for (int tbatch = 1; tbatch <= TBATCH_TUNE_MAX; ++tbatch) {
+        int edge = central2d_tile_edge(sim->nfield, sim->ng*tbatch);
+        for (int scale = 0; scale < (tune_tiles ? 3 : 1); ++scale) {
+            int e = (scale == 0 ? 0 : scale == 1 ? edge/2 : 2*edge);
+            sim->tile_nx = (tune_tiles ? e : tile_nx);
+            sim->tile_ny = (tune_tiles ? e : tile_ny);
+            sim->tbatch = tbatch;
+            central2d_tiles_setup(sim, threads);
+            if (sim->tiles->tbatch != tbatch)
+                continue;
+
+            float dt = (sim->dt_mode == CENTRAL2D_DT_FIXED ? sim->dt_fixed :
+                        central2d_tiles_dt(sim->tiles, sim->tiles->cur,
+                                           sim->dx, sim->dy, sim->cfl));
+            double t0 = omp_get_wtime();
+            int nstep = central2d_xrun(sim, 2*TBATCH_TUNE_PAIRS*dt);
+            double per_step = (omp_get_wtime() - t0) / nstep;
+            if (!best || per_step < tbest) {
+                tbest = per_step;
+                best = tbatch;
+                best_nx = sim->tile_nx;
+                best_ny = sim->tile_ny;
+            }
+
+            // Restore the initial state
+            central2d_tiles_free(sim->tiles);
+            sim->tiles = NULL;
+            memcpy(sim->u, u0, N * sizeof(float));
+        }
+    }
+
+    free(u0);
+    sim->rollbacks = rollbacks;
+    sim->probes = probes;
+    sim->tbatch = (best ? best : 1);
+    sim->tile_nx = best_nx;
+    sim->tile_ny = best_ny;
+    return sim->tbatch;
 }
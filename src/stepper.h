@@ -2,6 +2,7 @@
 #define STEPPER_H
 
 #include <math.h>
+#include <stdio.h>
 
 //ldoc
 /**
@@ -16,6 +17,9 @@
  * (used to control the time step).  We define callback types for these
  * two functions, with the assumption that the different components
  * of the solution and fluxes are separated by `field_stride`.
+ * The speed function folds the cells it is given into the running
+ * maxima in `cxy`; the stepper calls both a row at a time from inside
+ * its parallel region, so neither should start threads of its own.
  *
  */
 typedef void (*flux_t)(float* FU, float* GU, const float* U,
@@ -31,12 +35,43 @@ typedef void (*speed_t)(float* cxy, const float* U,
  * (the `flux` and `speed` functions mentioned above as well as
  * the number of fields `nfield`); the spatial discretization
  * (`nx`, `ny`, `ng`, `dx`, `dy`); and the time discretization (`cfl`).
- * In addition, we have storage for the current solution and for
- * various quantities that are internally important (fluxes and
- * numerical derivatives).  These latter should probably be hidden,
- * but I haven't done so yet.
+ * In addition, we have storage for the current solution.
+ *
+ * While running, the solution actually lives in a set of tiles owned
+ * by the stepper.  Each tile keeps its own block of the grid (plus a
+ * halo of ghost cells) for as long as the simulator lives, and tiles
+ * only exchange ghost strips with their neighbors between time steps.
+ * The global array `u` is a snapshot that is only brought up to date
+ * by `central2d_sync`.  The tile data structure is private to the
+ * stepper.
  *
  */
+typedef struct central2d_tiles_t central2d_tiles_t;
+typedef struct central2d_wave_t central2d_wave_t;
+typedef struct central2d_probes_t central2d_probes_t;
+
+typedef enum {
+    CENTRAL2D_DT_CFL,     // Largest stable step for the current state
+    CENTRAL2D_DT_LAGGED,  // Step for the previous state, checked after
+    CENTRAL2D_DT_FIXED    // Always dt_fixed
+} central2d_dt_mode_t;
+
+typedef enum {
+    CENTRAL2D_TILING_HALO,      // Tiles with halos of ghost cells
+    CENTRAL2D_TILING_WAVEFRONT  // Bands swept by trapezoids and valleys
+} central2d_tiling_t;
+
+typedef enum {
+    CENTRAL2D_LAYOUT_PLANES,  // Each field a plane of its own
+    CENTRAL2D_LAYOUT_ROWS     // Fields interleaved a row at a time
+} central2d_layout_t;
+
+typedef enum {
+    CENTRAL2D_PAGES_DEFAULT,  // Whatever the system gives us
+    CENTRAL2D_PAGES_THP,      // Ask for transparent huge pages
+    CENTRAL2D_PAGES_HUGETLB   // Explicit huge pages (THP if none are free)
+} central2d_pages_t;
+
 typedef struct central2d_t {
 
     int nfield;   // Number of components in system
@@ -44,17 +79,28 @@ typedef struct central2d_t {
     int ng;       // Number of ghost cells
     float dx, dy; // Cell width in x/y
     float cfl;    // Max allowed CFL number
+    int tbatch;   // Step pairs between halo exchanges (default 1)
+    int tile_nx;  // Requested tile size in x (0 to size tiles to cache)
+    int tile_ny;  // Requested tile size in y (0 to size tiles to cache)
+    int tiling;   // How to block the stepping (central2d_tiling_t)
+    int layout;   // How the fields are stored (central2d_layout_t)
+    int dt_mode;     // How to pick the time step (central2d_dt_mode_t)
+    float dt_fixed;  // Time step in fixed mode
+    float dt_safety; // Fraction of the lagged CFL step to take (default 0.9)
+    int rollbacks;   // Batches redone after failed CFL checks (lagged mode)
+    double time;     // Simulated time since the initial conditions
 
     // Flux and speed functions
     flux_t flux;
     speed_t speed;
 
     // Storage
-    float* u;
-    float* v;
-    float* f;
-    float* g;
-    float* scratch;
+    float* u;                  // Global solution snapshot
+    int field_stride;          // Floats between fields in u
+    int row_stride;            // Floats between rows in u
+    central2d_tiles_t* tiles;  // Tile state (NULL before the first run)
+    central2d_wave_t* wave;    // Wavefront state (NULL unless used)
+    central2d_probes_t* probes; // Probe points and samples (or NULL)
 
 } central2d_t;
 
@@ -80,18 +126,285 @@ void central2d_free(central2d_t* sim);
  */
 int  central2d_offset(central2d_t* sim, int k, int ix, int iy);
 
+/**
+ * ### Field layout
+ *
+ * By default (`CENTRAL2D_LAYOUT_PLANES`), each field is a plane of
+ * its own, so the fields of a cell are a whole plane apart and every
+ * row the stepper works on touches `nfield` distant streams of
+ * memory.  With `CENTRAL2D_LAYOUT_ROWS`, the fields are interleaved a
+ * row at a time (row `iy` of field 0, then row `iy` of field 1, and
+ * so on), so they are only a row apart, a row of all the fields is
+ * one contiguous block, and the stepper hands rows to the flux
+ * function in place rather than gathering them first.  The layout
+ * applies to `u` and to the stepper's own buffers alike, and the
+ * flux and speed functions see it as a `field_stride` of one row.
+ * `central2d_set_layout` rearranges `u` (and drops the tiles, which
+ * are rebuilt in the new layout by the next run); code that goes
+ * through `central2d_offset` or passes the field stride along works
+ * with either layout.
+ *
+ */
+void central2d_set_layout(central2d_t* sim, int layout);
+
+/**
+ * ### Padding and huge pages
+ *
+ * The arrays are aligned to 64-byte cache lines, and the rows are
+ * padded out to a pitch that keeps every row on a cache line boundary
+ * without being a multiple of a large power of two (the planes of the
+ * fields are padded the same way).  So `row_stride` is generally a
+ * bit more than `nx + 2*ng`, and `field_stride` a bit more than
+ * `row_stride * (ny + 2*ng)`; use `central2d_offset` rather than
+ * working out indices by hand.  The padding is never read.
+ *
+ * `central2d_set_pages` says how to back the large arrays (anything
+ * of 2 MB or more) allocated after the call: with whatever pages the
+ * system hands out (the default), with transparent huge pages where
+ * the kernel can find them (`CENTRAL2D_PAGES_THP`), or with explicit
+ * huge pages from the pool the administrator set aside
+ * (`CENTRAL2D_PAGES_HUGETLB`; if the pool runs dry, we say so once
+ * and fall back on transparent huge pages).  Huge pages cut the TLB
+ * misses of sweeping big grids, but they are placed on memory nodes
+ * 2 MB at a time.
+ *
+ */
+void central2d_set_pages(int mode);
+
 /**
  * ### Running the simulation
  *
  * The `central2d_run` function advances the simulation from the
- * current state by time `tfinal`.  It returns the number of steps
- * taken, determined by the CFL restriction and by the requirement
- * that we always take steps in multiples of two so that we end
- * at the reference grid.
+ * current state by time `tfinal` (and adds it to `time`).  It returns
+ * the number of steps taken, determined by the CFL restriction and by
+ * the requirement that we always take steps in multiples of two so
+ * that we end at the reference grid.
  *
  */
 int central2d_run(central2d_t* sim, float tfinal, int threads);
 
+/**
+ * The tiles are set up by the first call to `central2d_run` (and set
+ * up again if the thread count or blocking changes).  To keep that
+ * cost out of a timing, call `central2d_setup` with the same thread
+ * count beforehand.
+ *
+ */
+void central2d_setup(central2d_t* sim, int threads);
+
+/**
+ * The first call to `central2d_run` copies `u` into the tiles; after
+ * that, the tiles hold the authoritative state, and `u` is only
+ * refreshed when we ask for it.  Call `central2d_sync` before reading
+ * `u` (e.g. to write a frame or check conservation).  Calling it when
+ * `u` is already current costs nothing.
+ *
+ */
+void central2d_sync(central2d_t* sim);
+
+/**
+ * To check conservation, `central2d_stats` gives the integral of each
+ * field over the domain in `total`, and (if `lo` and `hi` are not
+ * null) the smallest and largest value of each field; each array has
+ * `nfield` entries.  The stepper collects the pieces it needs while
+ * it steps, so this is cheap after a run and does not need `u` to be
+ * synced.
+ *
+ */
+void central2d_stats(central2d_t* sim, double* total, float* lo, float* hi);
+
+/**
+ * ### Temporal blocking and tile sizes
+ *
+ * The tiles carry enough ghost cells to take `tbatch` pairs of steps
+ * between halo exchanges, at the cost of recomputing a shrinking ring
+ * of ghost cells in each step.  The depth can be set directly in
+ * `tbatch` before a run (it is clipped so that the halos are no wider
+ * than the tiles).  By default, tiles are sized so that their working
+ * set fits in L2; `tile_nx` and `tile_ny` override this.  Grids need
+ * not divide evenly into tiles, and there may be many more tiles than
+ * threads.  `central2d_autotune` times a few short runs with
+ * different depths and tile sizes, leaves the solution as it found
+ * it, and keeps the fastest settings (returning the depth).
+ *
+ */
+int central2d_autotune(central2d_t* sim, int threads);
+
+/**
+ * ### Wavefront tiling
+ *
+ * The halo tiles pay for their deep batches with redundant work in
+ * the ghost cells.  Setting `tiling` to `CENTRAL2D_TILING_WAVEFRONT`
+ * switches to a scheme that updates every cell exactly once per step:
+ * the grid is cut into bands of full rows, one per thread, and each
+ * sweep of `tbatch` step pairs is done as a trapezoid in space and
+ * time for each band, pipelined a few rows at a time so that all the
+ * levels of the sweep stay in cache, and then an upside-down
+ * trapezoid (a valley) across each band boundary.  The results are
+ * the same as with halo tiles of the same depth.  Every band needs at
+ * least `6*tbatch` rows, so the depth is clipped to `ny/6`, and there
+ * may be fewer bands than threads on short grids.  Probes need the
+ * halo tiles, so a simulator with probes uses them whatever `tiling`
+ * says, as does a grid with fewer than six rows (too short for even
+ * one band); lagged time steps are taken as ordinary CFL steps (the sweep
+ * waits on every band anyway); and `central2d_autotune` tunes for the
+ * halo tiles.  With the wavefront scheme, the solution lives in `u`
+ * itself, so there are no tiles to report on.
+ *
+ */
+
+/**
+ * ### Choosing the time step
+ *
+ * By default (`CENTRAL2D_DT_CFL`), each batch of steps uses the
+ * largest time step the CFL condition allows for the current state,
+ * which forces all tiles to finish a batch before any can start the
+ * next.  With `CENTRAL2D_DT_LAGGED`, we instead take `dt_safety`
+ * times the step allowed for the state one batch back, and verify
+ * the CFL number after the fact; a batch that fails the check is
+ * redone with the ordinary step, and counted in `rollbacks`.  With
+ * `CENTRAL2D_DT_FIXED`, every step is `dt_fixed` (except that the
+ * last one in a run is shortened to hit the end time), and it is up
+ * to the caller to know that this is stable.
+ *
+ */
+
+/**
+ * Code that wants to work on the solution a tile at a time (like the
+ * output writer) can ask for the tile layout.  `central2d_tile_count`
+ * returns the number of tiles (zero before the first run), and
+ * `central2d_tile_rect` gives the first interior cell and the size
+ * of tile `i`.
+ *
+ */
+int  central2d_tile_count(central2d_t* sim);
+void central2d_tile_rect(central2d_t* sim, int i,
+                         int* x0, int* y0, int* sx, int* sy);
+
+/**
+ * ### Checkpoint and restart
+ *
+ * `central2d_checkpoint` writes the grid metadata, the simulated
+ * time, and all the fields to a file, and `central2d_restart` makes
+ * a new simulator from such a file (the flux and speed functions
+ * have to be supplied again).  The file has a fixed-size header
+ * (`central2d_checkpoint_t`) followed by the global solution array
+ * exactly as it is laid out in `u`, padding and all (the `layout`
+ * string says which field layout that is, the header gives the
+ * strides, and the restarted simulator keeps both), so a restart
+ * just maps the file into memory rather than reading and parsing it.
+ * Version 1 files, from before the padding, still restart (with
+ * unpadded strides).  Both return zero or a non-null pointer on
+ * success; the checkpoint is written to a temporary file and renamed,
+ * so an earlier checkpoint with the same name survives a crash in the
+ * middle of writing.
+ *
+ */
+#define CENTRAL2D_CHECKPOINT_MAGIC   "SWCHKPT"
+#define CENTRAL2D_CHECKPOINT_VERSION 2
+
+typedef struct central2d_checkpoint_t {
+    char magic[8];             // CENTRAL2D_CHECKPOINT_MAGIC
+    unsigned int version;      // CENTRAL2D_CHECKPOINT_VERSION
+    unsigned int byte_order;   // 0x01020304 as written by the host
+    unsigned int header_size;  // Offset of the data in the file
+    unsigned int float_size;   // sizeof(float)
+    int nfield;                // Number of fields
+    int nx, ny, ng;            // Grid size and ghost cells per side
+    float dx, dy;              // Cell size
+    float cfl;                 // Max allowed CFL number
+    double time;               // Simulated time
+    long long data_size;       // Bytes of data after the header
+    char layout[64];           // Description of the data layout
+    int field_stride;          // Floats between fields (version 2)
+    int row_stride;            // Floats between rows (version 2)
+} central2d_checkpoint_t;
+
+int central2d_checkpoint(central2d_t* sim, const char* fname);
+central2d_t* central2d_restart(const char* fname,
+                               flux_t flux, speed_t speed);
+
+/**
+ * ### Probes
+ *
+ * To follow the solution at a few places without writing whole
+ * frames, we can set up probes before the first run.
+ * `central2d_probe` adds a probe named `name` through the `n` points
+ * `(xy[2*i], xy[2*i+1])`: a single point is a gauge, and more make a
+ * polyline, which samples every cell it passes through.  It returns
+ * the probe number, or -1 if sampling has already started.  The
+ * stepper samples all fields at every probe cell in the initial state
+ * and after every pair of time steps (every step that lands on the
+ * main grid), and keeps the samples in memory;
+ * `central2d_probe_write` writes them out (returning zero on success).
+ *
+ * The file holds a `central2d_probe_header_t`, then `nprobe` probe
+ * descriptions (`central2d_probe_info_t`, whose points are `first` to
+ * `first+npoint-1`), `npoint` point descriptions
+ * (`central2d_probe_point_t`), the time of each sample (`nsample`
+ * doubles), and finally the samples as floats, indexed by sample,
+ * then point, then field.  Numbers are in the byte order of the
+ * writer.
+ *
+ */
+#define CENTRAL2D_PROBE_MAGIC   "SWPROBE"
+#define CENTRAL2D_PROBE_VERSION 1
+
+typedef struct central2d_probe_header_t {
+    char magic[8];             // CENTRAL2D_PROBE_MAGIC
+    int version;               // CENTRAL2D_PROBE_VERSION
+    unsigned int byte_order;   // 0x01020304 as written by the host
+    int nfield;                // Fields sampled at each point
+    int nprobe;                // Number of probes
+    int npoint;                // Points in all probes
+    int reserved;
+    long long nsample;         // Samples per point
+} central2d_probe_header_t;
+
+typedef struct central2d_probe_info_t {
+    char name[32];             // Probe name (NUL-terminated)
+    int first;                 // First point of the probe
+    int npoint;                // Number of points
+} central2d_probe_info_t;
+
+typedef struct central2d_probe_point_t {
+    int ix, iy;                // Cell index
+    float x, y;                // Cell center
+} central2d_probe_point_t;
+
+int central2d_probe(central2d_t* sim, const char* name,
+                    const float* xy, int n);
+int central2d_probe_write(central2d_t* sim, const char* fname);
+
+/**
+ * ### Thread and memory placement
+ *
+ * Each tile is allocated and first touched by the thread that steps
+ * it, and threads are pinned to CPUs (unless `OMP_PROC_BIND` or
+ * `OMP_PLACES` is set, in which case OpenMP places them), so tile
+ * data stays in the memory of the socket that uses it.
+ * `central2d_placement` sets up the tiles for the given thread count
+ * (as `central2d_run` would) and prints which CPU and memory node
+ * each thread is on, which tiles it owns, and how much of their
+ * memory is local.
+ *
+ */
+void central2d_placement(central2d_t* sim, int threads, FILE* fp);
+
+/**
+ * ### Phase timers
+ *
+ * If the stepper is built with `PHASE_TIMERS` defined (see
+ * `timers.h`), every thread keeps track of how long it spends in
+ * each phase of the stepping, and of how long it spends on each of its
+ * tiles.  `central2d_timers` prints the time per phase and thread
+ * since the tiles were last set up, how unevenly the busy (non-waiting)
+ * time is spread over the threads, and the range of time per tile.
+ * Without the timers, it prints nothing.
+ *
+ */
+void central2d_timers(central2d_t* sim, FILE* fp);
+
 /**
  * ### Applying boundary conditions
  *
@@ -103,12 +416,14 @@ int central2d_run(central2d_t* sim, float tfinal, int threads);
  * (which may vary from field to field).  For this exercise, we're always
  * going to use periodic BCs.  But I want to leave the interface function
  * public in the eventuality that I might swap in a function pointer
- * for applying the BCs.
+ * for applying the BCs.  Inside the time stepper, the periodic
+ * conditions are applied implicitly by the halo exchange, which
+ * wraps around the tile grid.  The function fills the ghost cells of
+ * `u` itself, using the simulator's strides, so it works with either
+ * layout; if the tiles may hold a newer state, call `central2d_sync`
+ * first.
  *
  */
-void central2d_periodic(float* u, const float* src, int nx, int ny, int ng,
-                        int partx, int party, int px, int py, int nfield, int tbatch);
-
-void central2d_periodic_full(float* u, int nx, int ny, int ng, int nfield);
+void central2d_periodic_full(central2d_t* sim);
 //ldoc off
 #endif /* STEPPER_H */
@@ -0,0 +1,117 @@
+/*
+ * Row-streaming step kernel template, included by stepper.c once per
+ * instance (see "Specialized steppers" there).  Before including,
+ * define
+ *
+ *   STEP_ROWS                        name of the function
+ *   STEP_NFIELD                      field count (nfield if not fixed)
+ *   STEP_FLUX(fu, gu, u, n, stride)  fluxes of n cells
+ *   STEP_SPEED(cxy, u, n, stride)    fold n cells into the wave speeds
+ *
+ * Every instance takes the same arguments, so the generic one can
+ * stand in for any of them; a specialized instance just ignores the
+ * ones it has fixed.
+ */
+
+static
+void STEP_ROWS(float* restrict u, float* restrict v,
+               float* restrict scratch,
+               int io, int nx, int ng, int c, int rs,
+               int ylo, int yhi, int ja, int jb, bool xwrap,
+               int nfield, flux_t flux, speed_t speed,
+               float* cxy, double* stats,
+               float dt, float dx, float dy)
+{
+    int pitch = central2d_pad(nx + 2*ng);    // Row buffer pitch
+    int rowN = STEP_NFIELD * pitch;
+
+    float dtcdx2 = 0.5 * dt / dx;
+    float dtcdy2 = 0.5 * dt / dy;
+
+    // Output cells (before the odd-step shift) and row buffers
+    int xlo = ng-io, xhi = nx+ng-io;
+    float* restrict ur = scratch;              // Staged row of u
+    float* restrict fu = scratch +   rowN;     // Ring of F(u) rows
+    float* restrict gu = scratch + 4*rowN;     // Ring of G(u) rows
+    float* restrict vr = scratch + 7*rowN;     // Predicted row
+    float* restrict fv = scratch + 8*rowN;     // F at half step
+    float* restrict gv = scratch + 9*rowN;     // G at half step
+    float* restrict sd = scratch + 10*rowN;    // s and d, two rows
+    float* restrict ux = scratch + 14*rowN;
+    float* restrict uy = ux + pitch;
+
+    for (int j = ja; j < jb; ++j) {
+
+        // Fluxes on the incoming row (staged into ur unless the
+        // fields of a row are already a row buffer apart)
+        int a = xlo-1, b = xhi+2;
+        const float* uj = u + j*rs;
+        if (c != pitch) {
+            for (int k = 0; k < STEP_NFIELD; ++k)
+                memcpy(ur + k*pitch + a, u + k*c + j*rs + a,
+                       (b-a) * sizeof(float));
+            uj = ur;
+        }
+        STEP_FLUX(fu + (j%3)*rowN + a, gu + (j%3)*rowN + a, uj + a,
+                  b-a, pitch);
+        PHASE_LAP(PHASE_FLUX);
+
+        // Predictor and half-step fluxes for the row below
+        int jp = j-1;
+        if (jp < ylo)
+            continue;
+        int n = xhi+1-xlo;
+        for (int k = 0; k < STEP_NFIELD; ++k) {
+            const float* fk = fu + (jp%3)*rowN + k*pitch;
+            const float* uk = u + k*c + jp*rs;
+            float* vk = vr + k*pitch;
+            limited_deriv1(ux+xlo, fk+xlo, n);
+            limited_deriv3(uy+xlo,
+                           gu + ((jp-1)%3)*rowN + k*pitch + xlo,
+                           gu + ( jp   %3)*rowN + k*pitch + xlo,
+                           gu + ((jp+1)%3)*rowN + k*pitch + xlo, n);
+            for (int ix = xlo; ix < xhi+1; ++ix)
+                vk[ix] = uk[ix] - dtcdx2 * ux[ix] - dtcdy2 * uy[ix];
+        }
+        PHASE_LAP(PHASE_PREDICT);
+        STEP_FLUX(fv + xlo, gv + xlo, vr + xlo, n, pitch);
+        PHASE_LAP(PHASE_HALF_FLUX);
+
+        // Corrector: s and d for row jp, then output row jp-1
+        for (int k = 0; k < STEP_NFIELD; ++k) {
+            const float* uk = u + k*c + jp*rs;
+            float* s1 = sd + (4*k + 2*(jp&1)) * pitch;
+            float* d1 = s1 + pitch;
+            float* s0 = sd + (4*k + 2*((jp-1)&1)) * pitch;
+            float* d0 = s0 + pitch;
+            limited_deriv1(ux+xlo, uk+xlo, n);
+            limited_derivk(uy+xlo, uk+xlo, n, rs);
+            central2d_kernels.correct_sd(s1, d1, ux, uy,
+                                         uk, fv + k*pitch, gv + k*pitch,
+                                         dtcdx2, dtcdy2, xlo, xhi);
+            if (jp == ylo)
+                continue;
+            float* vk = v + k*c + (jp-1+io)*rs + io;
+            for (int ix = xlo; ix < xhi; ++ix)
+                vk[ix] = (s1[ix]+s0[ix])-(d1[ix]-d0[ix]);
+            if (xwrap) {
+                float* row = v + k*c + (jp-1+io)*rs;
+                memcpy(row, row + nx, ng * sizeof(float));
+                memcpy(row + nx+ng, row + ng, ng * sizeof(float));
+            }
+        }
+        PHASE_LAP(PHASE_CORRECT);
+        if (cxy && jp > ylo)
+            STEP_SPEED(cxy, v + (jp-1+io)*rs + xlo+io, xhi-xlo, c);
+        if (stats && jp > ylo)
+            for (int k = 0; k < STEP_NFIELD; ++k)
+                row_stats(stats + 3*k, v + k*c + (jp-1+io)*rs + xlo+io,
+                          xhi-xlo);
+        PHASE_LAP(PHASE_SPEED);
+    }
+}
+
+#undef STEP_ROWS
+#undef STEP_NFIELD
+#undef STEP_FLUX
+#undef STEP_SPEED
@@ -0,0 +1,97 @@
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include <stdint.h>
+
+//ldoc on
+/**
+ * # Phase timers
+ *
+ * To see where the time goes inside a run, the stepper can charge
+ * every stretch of time on every thread to one of a few phases.  The
+ * timers are only compiled in if `PHASE_TIMERS` is defined (build
+ * with `make TIMERS=-DPHASE_TIMERS`); otherwise all the macros below
+ * expand to nothing, so they cost nothing in a production build.
+ *
+ * The timers work like laps on a stopwatch: each thread remembers
+ * when it last looked at the clock, and `PHASE_LAP(p)` charges the
+ * time since then to phase `p` and restarts the count.  So the code
+ * only has to mark the end of each phase, and every tick between
+ * `PHASE_BEGIN` and the last lap lands in exactly one phase.  The
+ * phases are
+ *
+ * - `PHASE_HALO`: pulling ghost strips from neighboring tiles
+ * - `PHASE_FLUX`: staging incoming rows and evaluating their fluxes
+ * - `PHASE_PREDICT`: limited derivatives and the predictor
+ * - `PHASE_HALF_FLUX`: fluxes of the predicted (half step) values
+ * - `PHASE_CORRECT`: limited derivatives, corrector, output rows
+ * - `PHASE_SPEED`: wave speeds and row statistics of the output, and
+ *   the reduction of the tile speeds to a time step
+ * - `PHASE_WRITEBACK`: copying tiles back to the global array
+ * - `PHASE_WAIT`: waiting on other tiles and threads
+ * - `PHASE_OTHER`: everything else (bookkeeping, probes)
+ *
+ * The clock is the time stamp counter on x86 (a few cycles to read),
+ * and the monotonic system clock elsewhere; the stepper converts
+ * ticks to seconds when it reports (see `central2d_timers`).
+ *
+ */
+
+typedef enum {
+    PHASE_HALO,
+    PHASE_FLUX,
+    PHASE_PREDICT,
+    PHASE_HALF_FLUX,
+    PHASE_CORRECT,
+    PHASE_SPEED,
+    PHASE_WRITEBACK,
+    PHASE_WAIT,
+    PHASE_OTHER,
+    PHASE_COUNT
+} phase_t;
+
+//ldoc off
+#ifdef PHASE_TIMERS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t phase_ticks(void)
+{
+    return __rdtsc();
+}
+#else
+#include <time.h>
+static inline uint64_t phase_ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+// Per-thread stopwatch
+typedef struct phase_clock_t {
+    uint64_t last;              // Ticks at the last lap
+    uint64_t acc[PHASE_COUNT];  // Ticks charged to each phase
+} phase_clock_t;
+
+static __thread phase_clock_t phase_clock;
+
+#define PHASE_BEGIN() (phase_clock.last = phase_ticks())
+#define PHASE_LAP(p) do {                                   \
+        uint64_t phase_now_ = phase_ticks();                \
+        phase_clock.acc[p] += phase_now_ - phase_clock.last; \
+        phase_clock.last = phase_now_;                      \
+    } while (0)
+#define PHASE_MARK(var) uint64_t var = phase_clock.last
+#define PHASE_SINCE(acc, var) ((acc) += phase_clock.last - (var))
+
+#else
+
+#define PHASE_BEGIN()
+#define PHASE_LAP(p)
+#define PHASE_MARK(var)
+#define PHASE_SINCE(acc, var)
+
+#endif /* PHASE_TIMERS */
+#endif /* TIMERS_H */
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <omp.h>
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * A thread's buffer is a list of blocks of events.  Each thread
+ * remembers which trace its buffer belongs to, so that a thread that
+ * still points at a buffer from an earlier (closed) trace starts a
+ * new one.  Times are kept in seconds relative to the start of the
+ * trace and written in microseconds, as the format wants.
+ */
+
+#define TRACE_BLOCK 4096
+
+typedef struct trace_event_t {
+    const char* name;
+    double t0, dur;            // Start and duration (s)
+    long long arg;             // Argument (or negative for none)
+} trace_event_t;
+
+typedef struct trace_block_t {
+    struct trace_block_t* next;
+    int n;
+    trace_event_t ev[TRACE_BLOCK];
+} trace_block_t;
+
+typedef struct trace_buf_t {
+    struct trace_buf_t* next;  // Next buffer on the shared list
+    int tid;                   // Row in the trace
+    char name[32];             // Label for the row
+    trace_block_t* first;
+    trace_block_t* last;
+} trace_buf_t;
+
+bool trace_enabled = false;
+
+static char* trace_fname = NULL;
+static double trace_start = 0;
+static int trace_generation = 0;
+static int trace_ntid = 0;
+static trace_buf_t* trace_bufs = NULL;
+static __thread trace_buf_t* trace_mine = NULL;
+static __thread int trace_mine_generation = 0;
+
+
+double trace_now(void)
+{
+    return omp_get_wtime() - trace_start;
+}
+
+
+static trace_buf_t* trace_buf(void)
+{
+    if (trace_mine_generation == trace_generation)
+        return trace_mine;
+
+    trace_buf_t* buf = (trace_buf_t*) calloc(1, sizeof(trace_buf_t));
+    buf->tid = __atomic_fetch_add(&trace_ntid, 1, __ATOMIC_RELAXED);
+    snprintf(buf->name, sizeof(buf->name), "thread %d",
+             omp_get_thread_num());
+    buf->first = buf->last =
+        (trace_block_t*) calloc(1, sizeof(trace_block_t));
+    buf->next = __atomic_load_n(&trace_bufs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_bufs, &buf->next, buf,
+                                        true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+        ;
+    trace_mine = buf;
+    trace_mine_generation = trace_generation;
+    return buf;
+}
+
+
+void trace_record(const char* name, double t0, long long arg)
+{
+    double t1 = trace_now();
+    trace_buf_t* buf = trace_buf();
+    trace_block_t* block = buf->last;
+    if (block->n == TRACE_BLOCK) {
+        block->next = (trace_block_t*) calloc(1, sizeof(trace_block_t));
+        block = buf->last = block->next;
+    }
+    trace_event_t* ev = block->ev + block->n++;
+    ev->name = name;
+    ev->t0 = t0;
+    ev->dur = t1 - t0;
+    ev->arg = arg;
+}
+
+
+void trace_thread_name(const char* name)
+{
+    if (!trace_enabled)
+        return;
+    trace_buf_t* buf = trace_buf();
+    snprintf(buf->name, sizeof(buf->name), "%s", name);
+}
+
+
+bool trace_open(const char* fname)
+{
+    if (trace_enabled)
+        trace_close();
+    FILE* fp = fopen(fname, "w");
+    if (!fp)
+        return false;
+    fclose(fp);
+    trace_fname = strdup(fname);
+    trace_start = omp_get_wtime();
+    trace_bufs = NULL;
+    trace_ntid = 0;
+    ++trace_generation;
+    trace_enabled = true;
+    return true;
+}
+
+
+/**
+ * The file holds a `traceEvents` array of complete (`"ph": "X"`)
+ * events, plus a metadata event naming each thread's row.
+ */
+
+int trace_close(void)
+{
+    if (!trace_enabled)
+        return 0;
+    trace_enabled = false;
+
+    int status = 0;
+    FILE* fp = fopen(trace_fname, "w");
+    if (fp) {
+        fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        bool first = true;
+        for (trace_buf_t* buf = trace_bufs; buf; buf = buf->next) {
+            fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+                    "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                    first ? "" : ",\n", buf->tid, buf->name);
+            first = false;
+            for (trace_block_t* b = buf->first; b; b = b->next)
+                for (int i = 0; i < b->n; ++i) {
+                    trace_event_t* ev = b->ev + i;
+                    fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", "
+                            "\"pid\": 1, \"tid\": %d, \"ts\": %.3f, "
+                            "\"dur\": %.3f", ev->name, buf->tid,
+                            1e6 * ev->t0, 1e6 * ev->dur);
+                    if (ev->arg >= 0)
+                        fprintf(fp, ", \"args\": {\"n\": %lld}", ev->arg);
+                    fprintf(fp, "}");
+                }
+        }
+        fprintf(fp, "\n]}\n");
+        if (fclose(fp) != 0)
+            status = -1;
+    } else
+        status = -1;
+
+    while (trace_bufs) {
+        trace_buf_t* buf = trace_bufs;
+        trace_bufs = buf->next;
+        while (buf->first) {
+            trace_block_t* b = buf->first;
+            buf->first = b->next;
+            free(b);
+        }
+        free(buf);
+    }
+    free(trace_fname);
+    trace_fname = NULL;
+    return status;
+}
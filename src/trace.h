@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+//ldoc on
+/**
+ * # Timeline traces
+ *
+ * Totals per phase don't show *when* a thread sat idle.  For that, the
+ * solver and the driver can record a timeline: each interesting piece
+ * of work (a tile's halo exchange and batch of steps, a wait on the
+ * neighbors, a time step reduction, a frame written) becomes an event
+ * with a start time, a duration, and optionally an integer argument
+ * such as the tile number.  `trace_open` starts recording, and
+ * `trace_close` writes everything recorded to a file in the Chrome
+ * trace event format (JSON), which `chrome://tracing` and the Perfetto
+ * UI can show as one row per thread.
+ *
+ * Each thread appends to its own buffer, so recording takes no locks;
+ * a thread's buffer is put on a shared list (with an atomic push) the
+ * first time it records anything.  Buffers grow in blocks, and events
+ * are only formatted when the file is written.  When no trace is open,
+ * recording an event is a test of `trace_enabled` and nothing more.
+ * `trace_close` must be called when no other thread is recording.
+ *
+ * A span is timed by taking `t0 = trace_begin()` at the start and
+ * calling `trace_end(name, t0, arg)` at the end; the name must be a
+ * string that lives until the trace is closed (in practice, a literal).
+ * Pass a negative `arg` to leave it out.  `trace_thread_name` labels
+ * the calling thread's row (OpenMP threads get a default label).
+ *
+ */
+
+extern bool trace_enabled;
+
+bool trace_open(const char* fname);
+int  trace_close(void);
+void trace_thread_name(const char* name);
+
+double trace_now(void);
+void trace_record(const char* name, double t0, long long arg);
+
+static inline double trace_begin(void)
+{
+    return trace_enabled ? trace_now() : 0;
+}
+
+static inline void trace_end(const char* name, double t0, long long arg)
+{
+    if (trace_enabled)
+        trace_record(name, t0, arg);
+}
+
+//ldoc off
+#endif /* TRACE_H */
@@ -0,0 +1,102 @@
+/*
+ * Vector macros for one instruction set at a time.
+ *
+ * Define VEC_ISA to one of VEC_SSE42, VEC_AVX2, or VEC_AVX512 and
+ * include this file; then include a kernel template written in terms
+ * of the macros below.  The file has no include guard on purpose:
+ * including it again with a different VEC_ISA redefines everything.
+ *
+ *   VEC          vector type            VW           lanes per vector
+ *   VEC_TARGET   function attribute     VNAME(f)     f with ISA suffix
+ *   VLOAD(p)     unaligned load         VSTORE(p,a)  unaligned store
+ *   VSET1(x)     broadcast              VADD, VSUB, VMUL, VDIV, VMIN
+ *   VAND, VOR    bitwise ops            VANDNOT(a,b) (~a) & b
+ */
+
+#include <immintrin.h>
+
+// Same numbering as the simd_level_t levels in kernels.h
+#define VEC_SSE42  1
+#define VEC_AVX2   2
+#define VEC_AVX512 3
+
+#undef VEC
+#undef VW
+#undef VEC_TARGET
+#undef VSUFFIX
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VMIN
+#undef VAND
+#undef VOR
+#undef VANDNOT
+
+#define VCAT_(a, b) a ## _ ## b
+#define VCAT(a, b)  VCAT_(a, b)
+#define VNAME(f)    VCAT(f, VSUFFIX)
+
+#if VEC_ISA == VEC_SSE42
+
+#define VEC         __m128
+#define VW          4
+#define VEC_TARGET  __attribute__((target("sse4.2")))
+#define VSUFFIX     sse42
+#define VLOAD       _mm_loadu_ps
+#define VSTORE      _mm_storeu_ps
+#define VSET1       _mm_set1_ps
+#define VADD        _mm_add_ps
+#define VSUB        _mm_sub_ps
+#define VMUL        _mm_mul_ps
+#define VDIV        _mm_div_ps
+#define VMIN        _mm_min_ps
+#define VAND        _mm_and_ps
+#define VOR         _mm_or_ps
+#define VANDNOT     _mm_andnot_ps
+
+#elif VEC_ISA == VEC_AVX2
+
+#define VEC         __m256
+#define VW          8
+#define VEC_TARGET  __attribute__((target("avx2")))
+#define VSUFFIX     avx2
+#define VLOAD       _mm256_loadu_ps
+#define VSTORE      _mm256_storeu_ps
+#define VSET1       _mm256_set1_ps
+#define VADD        _mm256_add_ps
+#define VSUB        _mm256_sub_ps
+#define VMUL        _mm256_mul_ps
+#define VDIV        _mm256_div_ps
+#define VMIN        _mm256_min_ps
+#define VAND        _mm256_and_ps
+#define VOR         _mm256_or_ps
+#define VANDNOT     _mm256_andnot_ps
+
+#elif VEC_ISA == VEC_AVX512
+
+// AVX-512F has no float logic ops (those are in DQ), so go via ints
+#define VEC         __m512
+#define VW          16
+#define VEC_TARGET  __attribute__((target("avx512f")))
+#define VSUFFIX     avx512
+#define VLOAD       _mm512_loadu_ps
+#define VSTORE      _mm512_storeu_ps
+#define VSET1       _mm512_set1_ps
+#define VADD        _mm512_add_ps
+#define VSUB        _mm512_sub_ps
+#define VMUL        _mm512_mul_ps
+#define VDIV        _mm512_div_ps
+#define VMIN        _mm512_min_ps
+#define VLOGIC_(op, a, b) \
+    _mm512_castsi512_ps(op(_mm512_castps_si512(a), _mm512_castps_si512(b)))
+#define VAND(a, b)    VLOGIC_(_mm512_and_si512, a, b)
+#define VOR(a, b)     VLOGIC_(_mm512_or_si512, a, b)
+#define VANDNOT(a, b) VLOGIC_(_mm512_andnot_si512, a, b)
+
+#else
+#error "vec.h: unknown VEC_ISA"
+#endif
@@ -0,0 +1,541 @@
+#define _GNU_SOURCE
+#include "viz.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+// Block size (in frame cells) for chunks when there are no tiles yet
+#define VIZ_BLOCK 256
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * Frames go through a ring of `lag` staging slots.  `viz_frame` waits
+ * for a free slot, encodes the chunks of the current solution into
+ * it, and hands it to the writer thread, which writes the slots out
+ * in order.  Each slot keeps its buffers from frame to frame.
+ */
+
+typedef struct viz_slot_t {
+    int frame;                 // Frame number
+    double time;               // Simulated time
+    int nchunk, cap;           // Chunks in use and allocated
+    viz_chunk_t* chunk;        // Chunk table
+    unsigned char** data;      // Encoded data for each chunk
+    size_t* size;              // Allocated size of each data buffer
+} viz_slot_t;
+
+struct viz_t {
+    FILE* fp;
+    viz_header_t hdr;
+    viz_opts_t opts;
+    int nframe;                // Next frame number
+    long long end;             // Where the next frame record goes
+    int nindex, index_cap;     // Frames written so far
+    viz_index_t* index;
+    viz_slot_t* slot;          // Staging slots (opts.lag of them)
+    int queued, written;       // Frames handed off and written
+    bool closing;              // No more frames coming
+    int status;                // -1 once a write has failed, else 0
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t writer;
+};
+
+
+/**
+ * ### Encoding chunks
+ *
+ * Each chunk is gathered from the global solution into a contiguous
+ * array, quantized if asked, and (optionally) shuffled and deflated.
+ * If deflating doesn't help, we keep the chunk as it was.
+ */
+
+static
+void viz_shuffle(unsigned char* restrict dst, const unsigned char* restrict src,
+                 int n, int size)
+{
+    for (int b = 0; b < size; ++b)
+        for (int i = 0; i < n; ++i)
+            dst[b*n + i] = src[i*size + b];
+}
+
+
+static
+void viz_reserve(viz_slot_t* slot, int c, size_t bytes)
+{
+    if (slot->size[c] < bytes) {
+        free(slot->data[c]);
+        slot->data[c] = (unsigned char*) malloc(bytes);
+        slot->size[c] = bytes;
+    }
+}
+
+
+static
+void viz_encode(viz_t* viz, central2d_t* sim, viz_slot_t* slot, int c)
+{
+    viz_chunk_t* ch = slot->chunk + c;
+    int vskip = viz->opts.vskip;
+    int n = ch->sx * ch->sy;
+
+    // Gather the chunk and find its range
+    float* v = (float*) malloc(n * sizeof(float));
+    for (int iy = 0; iy < ch->sy; ++iy) {
+        const float* row = sim->u + central2d_offset(sim, ch->field, 0,
+                                                     (ch->y0 + iy) * vskip);
+        for (int ix = 0; ix < ch->sx; ++ix)
+            v[iy*ch->sx + ix] = row[(ch->x0 + ix) * vskip];
+    }
+    float lo = v[0], hi = v[0];
+    for (int i = 1; i < n; ++i) {
+        lo = fminf(lo, v[i]);
+        hi = fmaxf(hi, v[i]);
+    }
+
+    // Quantize (in place; the integers are no wider than the floats)
+    float error = viz->opts.error;
+    ch->encoding = VIZ_F32;
+    ch->lo = 0;
+    ch->scale = 1;
+    int size = sizeof(float);
+    if (error > 0 && (hi - lo) / (2*error) < 4.0e9) {
+        uint32_t* q = (uint32_t*) v;
+        float scale = 2*error;
+        uint32_t last = 0;
+        for (int i = 0; i < n; ++i) {
+            uint32_t qi = (uint32_t) llround((v[i] - (double) lo) / scale);
+            q[i] = qi - last;
+            last = qi;
+        }
+        ch->encoding = VIZ_STEP;
+        ch->lo = lo;
+        ch->scale = scale;
+    } else if (error <= 0 && viz->opts.bits == 16) {
+        uint16_t* q = (uint16_t*) v;
+        float scale = (hi - lo) / 65535;
+        for (int i = 0; i < n; ++i) {
+            long qi = (scale > 0 ? lrint((v[i] - (double) lo) / scale) : 0);
+            q[i] = (uint16_t) (qi < 0 ? 0 : qi > 65535 ? 65535 : qi);
+        }
+        ch->encoding = VIZ_U16;
+        ch->lo = lo;
+        ch->scale = scale;
+        size = sizeof(uint16_t);
+    }
+
+    // Compress if asked and if it helps
+    size_t raw = (size_t) n * size;
+    ch->flags = 0;
+    if (viz->opts.compress > 0) {
+        unsigned char* shuffled = (unsigned char*) malloc(raw);
+        viz_shuffle(shuffled, (const unsigned char*) v, n, size);
+        uLongf bytes = compressBound(raw);
+        viz_reserve(slot, c, bytes);
+        if (compress2(slot->data[c], &bytes, shuffled, raw,
+                      viz->opts.compress) == Z_OK && bytes < raw) {
+            ch->flags = VIZ_ZLIB;
+            ch->bytes = bytes;
+        }
+        free(shuffled);
+    }
+    if (!ch->flags) {
+        viz_reserve(slot, c, raw);
+        memcpy(slot->data[c], v, raw);
+        ch->bytes = raw;
+    }
+    free(v);
+}
+
+
+/**
+ * ### Laying out the chunks
+ *
+ * A tile covering cells `[x0, x0+sx)` of the solver grid covers the
+ * frame cells whose `vskip` multiples land in that range.  Tiles that
+ * are narrower than `vskip` may not cover any frame cells at all, in
+ * which case we skip them.
+ */
+
+static
+void viz_add_chunks(viz_t* viz, viz_slot_t* slot,
+                    int x0, int y0, int x1, int y1)
+{
+    if (x1 <= x0 || y1 <= y0)
+        return;
+    int nfield = viz->opts.nfield;
+    if (slot->nchunk + nfield > slot->cap) {
+        int cap = 2*slot->cap + nfield;
+        slot->chunk = (viz_chunk_t*) realloc(slot->chunk,
+                                             cap * sizeof(viz_chunk_t));
+        slot->data = (unsigned char**) realloc(slot->data,
+                                               cap * sizeof(unsigned char*));
+        slot->size = (size_t*) realloc(slot->size, cap * sizeof(size_t));
+        for (int c = slot->cap; c < cap; ++c) {
+            slot->data[c] = NULL;
+            slot->size[c] = 0;
+        }
+        slot->cap = cap;
+    }
+    for (int k = 0; k < nfield; ++k) {
+        viz_chunk_t* ch = slot->chunk + slot->nchunk++;
+        memset(ch, 0, sizeof(*ch));
+        ch->field = k;
+        ch->x0 = x0;
+        ch->y0 = y0;
+        ch->sx = x1 - x0;
+        ch->sy = y1 - y0;
+    }
+}
+
+
+static
+void viz_layout(viz_t* viz, central2d_t* sim, viz_slot_t* slot)
+{
+    int vskip = viz->opts.vskip;
+    int ntiles = central2d_tile_count(sim);
+    slot->nchunk = 0;
+    if (ntiles > 0) {
+        for (int i = 0; i < ntiles; ++i) {
+            int x0, y0, sx, sy;
+            central2d_tile_rect(sim, i, &x0, &y0, &sx, &sy);
+            viz_add_chunks(viz, slot,
+                           (x0 + vskip-1) / vskip, (y0 + vskip-1) / vskip,
+                           (x0+sx + vskip-1) / vskip, (y0+sy + vskip-1) / vskip);
+        }
+    } else {
+        int nx = viz->hdr.nx, ny = viz->hdr.ny;
+        for (int y0 = 0; y0 < ny; y0 += VIZ_BLOCK)
+            for (int x0 = 0; x0 < nx; x0 += VIZ_BLOCK)
+                viz_add_chunks(viz, slot, x0, y0,
+                               (x0+VIZ_BLOCK < nx ? x0+VIZ_BLOCK : nx),
+                               (y0+VIZ_BLOCK < ny ? y0+VIZ_BLOCK : ny));
+    }
+}
+
+
+/**
+ * ### The writer thread
+ *
+ * The writer works out where each chunk goes in the frame record,
+ * writes the record, flushes it (so a crash loses at most the frames
+ * in flight), and notes it in the index.  If a write fails (say, the
+ * disk is full), the writer notes that in `status` and drops the rest
+ * of the frames, and `viz_close` reports it; the frames before the
+ * failed one are intact, as after a crash.
+ */
+
+static
+void viz_note(viz_t* viz, long long offset, double time)
+{
+    if (viz->nindex == viz->index_cap) {
+        viz->index_cap = 2*viz->index_cap + 16;
+        viz->index = (viz_index_t*) realloc(viz->index,
+                                            viz->index_cap * sizeof(viz_index_t));
+    }
+    viz->index[viz->nindex].offset = offset;
+    viz->index[viz->nindex].time = time;
+    ++viz->nindex;
+}
+
+
+static
+void viz_write_slot(viz_t* viz, viz_slot_t* slot)
+{
+    viz_frame_t fr;
+    memset(&fr, 0, sizeof(fr));
+    memcpy(fr.magic, VIZ_FRAME_MAGIC, 4);
+    fr.frame = slot->frame;
+    fr.time = slot->time;
+    fr.nchunk = slot->nchunk;
+    long long offset = sizeof(fr) + (long long) slot->nchunk * sizeof(viz_chunk_t);
+    for (int c = 0; c < slot->nchunk; ++c) {
+        slot->chunk[c].offset = offset;
+        offset += slot->chunk[c].bytes;
+    }
+    fr.bytes = offset;
+
+    // After a failed write, the rest of the file can't be trusted
+    if (viz->status != 0)
+        return;
+    bool ok = (fwrite(&fr, sizeof(fr), 1, viz->fp) == 1 &&
+               fwrite(slot->chunk, sizeof(viz_chunk_t), slot->nchunk,
+                      viz->fp) == (size_t) slot->nchunk);
+    for (int c = 0; ok && c < slot->nchunk; ++c)
+        ok = (fwrite(slot->data[c], 1, slot->chunk[c].bytes, viz->fp) ==
+              (size_t) slot->chunk[c].bytes);
+    if (fflush(viz->fp) != 0 || !ok) {
+        viz->status = -1;
+        return;
+    }
+
+    viz_note(viz, viz->end, slot->time);
+    viz->end += fr.bytes;
+}
+
+
+static
+void* viz_writer(void* arg)
+{
+    viz_t* viz = (viz_t*) arg;
+    trace_thread_name("viz writer");
+    pthread_mutex_lock(&viz->lock);
+    for (;;) {
+        while (viz->written == viz->queued && !viz->closing)
+            pthread_cond_wait(&viz->cond, &viz->lock);
+        if (viz->written == viz->queued)
+            break;
+        viz_slot_t* slot = viz->slot + viz->written % viz->opts.lag;
+        pthread_mutex_unlock(&viz->lock);
+        double t0 = trace_begin();
+        viz_write_slot(viz, slot);
+        trace_end("write", t0, slot->frame);
+        pthread_mutex_lock(&viz->lock);
+        ++viz->written;
+        pthread_cond_broadcast(&viz->cond);
+    }
+    pthread_mutex_unlock(&viz->lock);
+    return NULL;
+}
+
+
+/**
+ * ### Opening and closing
+ */
+
+static
+void viz_make_header(viz_header_t* hdr, central2d_t* sim,
+                     const viz_opts_t* opts)
+{
+    int vskip = opts->vskip;
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, VIZ_MAGIC, 8);
+    hdr->version = VIZ_VERSION;
+    hdr->byte_order = 0x01020304;
+    hdr->nx = (sim->nx + vskip-1) / vskip;
+    hdr->ny = (sim->ny + vskip-1) / vskip;
+    hdr->vskip = vskip;
+    hdr->nfield = opts->nfield;
+    hdr->dx = sim->dx * vskip;
+    hdr->dy = sim->dy * vskip;
+    hdr->bits = opts->bits;
+    hdr->error = opts->error;
+    hdr->compress = opts->compress;
+}
+
+
+static
+viz_t* viz_start(FILE* fp, central2d_t* sim, const viz_opts_t* opts)
+{
+    viz_t* viz = (viz_t*) malloc(sizeof(viz_t));
+    viz->fp = fp;
+    viz->opts = *opts;
+    if (viz->opts.vskip < 1)
+        viz->opts.vskip = 1;
+    if (viz->opts.nfield < 1 || viz->opts.nfield > sim->nfield)
+        viz->opts.nfield = sim->nfield;
+    if (viz->opts.lag < 1)
+        viz->opts.lag = 1;
+    if (viz->opts.threads < 1)
+        viz->opts.threads = 1;
+    viz_make_header(&viz->hdr, sim, &viz->opts);
+    viz->nframe = 0;
+    viz->end = sizeof(viz_header_t);
+    viz->nindex = viz->index_cap = 0;
+    viz->index = NULL;
+    viz->slot = (viz_slot_t*) calloc(viz->opts.lag, sizeof(viz_slot_t));
+    viz->queued = viz->written = 0;
+    viz->closing = false;
+    viz->status = 0;
+    pthread_mutex_init(&viz->lock, NULL);
+    pthread_cond_init(&viz->cond, NULL);
+    return viz;
+}
+
+
+static
+void viz_run(viz_t* viz)
+{
+    pthread_create(&viz->writer, NULL, viz_writer, viz);
+}
+
+
+viz_t* viz_open(const char* fname, central2d_t* sim, const viz_opts_t* opts)
+{
+    FILE* fp = fopen(fname, "w+b");
+    if (!fp)
+        return NULL;
+    viz_t* viz = viz_start(fp, sim, opts);
+    if (fwrite(&viz->hdr, sizeof(viz_header_t), 1, fp) != 1)
+        viz->status = -1;
+    viz_run(viz);
+    return viz;
+}
+
+
+// Free the writer state (the writer thread is gone, and fp is closed)
+static
+void viz_free(viz_t* viz)
+{
+    pthread_mutex_destroy(&viz->lock);
+    pthread_cond_destroy(&viz->cond);
+    for (int i = 0; i < viz->opts.lag; ++i) {
+        viz_slot_t* slot = viz->slot + i;
+        for (int c = 0; c < slot->cap; ++c)
+            free(slot->data[c]);
+        free(slot->chunk);
+        free(slot->data);
+        free(slot->size);
+    }
+    free(viz->slot);
+    free(viz->index);
+    free(viz);
+}
+
+
+int viz_close(viz_t* viz)
+{
+    if (!viz)
+        return 0;
+    pthread_mutex_lock(&viz->lock);
+    viz->closing = true;
+    pthread_cond_broadcast(&viz->cond);
+    pthread_mutex_unlock(&viz->lock);
+    pthread_join(viz->writer, NULL);
+
+    // Index and trailer (unless a frame is already missing)
+    int status = viz->status;
+    if (status == 0 &&
+        !(fwrite(VIZ_INDEX_MAGIC, 1, 4, viz->fp) == 4 &&
+          fwrite(&viz->nindex, sizeof(int), 1, viz->fp) == 1 &&
+          fwrite(viz->index, sizeof(viz_index_t), viz->nindex,
+                 viz->fp) == (size_t) viz->nindex &&
+          fwrite(&viz->end, sizeof(long long), 1, viz->fp) == 1 &&
+          fwrite(VIZ_END_MAGIC, 1, 8, viz->fp) == 8))
+        status = -1;
+    if (fclose(viz->fp) != 0)
+        status = -1;
+
+    viz_free(viz);
+    return status;
+}
+
+
+/**
+ * ### Writing a frame
+ */
+
+void viz_frame(viz_t* viz, central2d_t* sim)
+{
+    if (!viz)
+        return;
+
+    // Wait for a free staging slot
+    double t0 = trace_begin();
+    pthread_mutex_lock(&viz->lock);
+    while (viz->queued - viz->written >= viz->opts.lag)
+        pthread_cond_wait(&viz->cond, &viz->lock);
+    viz_slot_t* slot = viz->slot + viz->queued % viz->opts.lag;
+    pthread_mutex_unlock(&viz->lock);
+    trace_end("wait writer", t0, viz->nframe);
+
+    central2d_sync(sim);
+    slot->frame = viz->nframe++;
+    slot->time = sim->time;
+    viz_layout(viz, sim, slot);
+    #pragma omp parallel for schedule(dynamic) num_threads(viz->opts.threads)
+    for (int c = 0; c < slot->nchunk; ++c)
+        viz_encode(viz, sim, slot, c);
+
+    pthread_mutex_lock(&viz->lock);
+    ++viz->queued;
+    pthread_cond_broadcast(&viz->cond);
+    pthread_mutex_unlock(&viz->lock);
+}
+
+
+/**
+ * ### Picking up after a restart
+ *
+ * We don't trust the index of an old file (the run may have died
+ * before writing it), so we walk the frame records, keep those up to
+ * `frame`, and cut the file off after the last one we keep.  A file
+ * with a different header (or in the old raw format) is replaced.
+ * Frames are numbered as in the run, so the next number follows the
+ * last frame we kept.  If that is not `frame` itself (the run may
+ * have died before writing it, or the file is new), we write the
+ * current state as frame `frame`, leaving a gap in the numbers for
+ * any frames that were lost.
+ */
+
+static
+bool viz_scan(viz_t* viz, FILE* fp, int frame)
+{
+    viz_header_t hdr;
+    fseeko(fp, 0, SEEK_END);
+    long long size = ftello(fp);
+    fseeko(fp, 0, SEEK_SET);
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, VIZ_MAGIC, 8) != 0 ||
+        hdr.version != VIZ_VERSION ||
+        hdr.byte_order != viz->hdr.byte_order ||
+        hdr.nx != viz->hdr.nx || hdr.ny != viz->hdr.ny ||
+        hdr.vskip != viz->hdr.vskip || hdr.nfield != viz->hdr.nfield)
+        return false;
+
+    int last = -1;
+    for (;;) {
+        viz_frame_t fr;
+        fseeko(fp, viz->end, SEEK_SET);
+        if (fread(&fr, sizeof(fr), 1, fp) != 1 ||
+            memcmp(fr.magic, VIZ_FRAME_MAGIC, 4) != 0 ||
+            fr.frame > frame || fr.bytes < (long long) sizeof(fr) ||
+            viz->end + fr.bytes > size)
+            break;
+        viz_note(viz, viz->end, fr.time);
+        viz->end += fr.bytes;
+        last = fr.frame;
+    }
+    fflush(fp);
+    if (ftruncate(fileno(fp), viz->end) != 0)
+        return false;
+    fseeko(fp, viz->end, SEEK_SET);
+    viz->nframe = last + 1;
+    return true;
+}
+
+
+viz_t* viz_reopen(const char* fname, central2d_t* sim,
+                  const viz_opts_t* opts, int frame)
+{
+    viz_t* viz = NULL;
+    FILE* fp = fopen(fname, "r+b");
+    if (fp) {
+        viz = viz_start(fp, sim, opts);
+        if (viz_scan(viz, fp, frame)) {
+            viz_run(viz);
+        } else {
+            fclose(fp);
+            viz_free(viz);
+            viz = NULL;
+        }
+    }
+    if (!viz)
+        viz = viz_open(fname, sim, opts);
+
+    if (viz && viz->nframe <= frame) {
+        viz->nframe = frame;
+        viz_frame(viz, sim);
+    }
+    return viz;
+}
@@ -0,0 +1,149 @@
+#ifndef VIZ_H
+#define VIZ_H
+
+#include "stepper.h"
+
+//ldoc on
+/**
+ * # Output files
+ *
+ * The simulator writes snapshots of the solution for the Python
+ * visualizer (and anything else that wants them).  An output file
+ * starts with a header (`viz_header_t`) and is followed by one record
+ * per frame.  A frame record starts with a `viz_frame_t`, which gives
+ * the frame number, the simulated time, the number of chunks and the
+ * size of the whole record, so that a reader can hop from frame to
+ * frame without reading the data.  Next comes a table of chunks
+ * (`viz_chunk_t`), each a rectangle of one field, and then the chunk
+ * data.  When the file is closed properly, we add an index of frame
+ * offsets and times, followed by a trailer pointing back at it; a
+ * file from a run that died in the middle has no index, but can
+ * still be read (and appended to) by walking the frame records.
+ *
+ * The data for a chunk is stored in one of three encodings:
+ *
+ * - `VIZ_F32`: plain single-precision values.
+ * - `VIZ_U16`: 16-bit integers `q`, with value `lo + scale*q`, where
+ *   `lo` and `lo + 65535*scale` are the chunk minimum and maximum.
+ * - `VIZ_STEP`: 32-bit integers `q` with value `lo + scale*q`, where
+ *   `scale` is twice the requested error bound.  The integers are
+ *   stored as differences from the previous value in the chunk (in
+ *   row-major order, wrapping mod 2^32), which are mostly small.
+ *
+ * If `VIZ_ZLIB` is set in the chunk flags, the bytes of the values
+ * are regrouped by significance (all first bytes, then all second
+ * bytes, and so on), and the result is compressed with zlib.  All
+ * numbers are in the byte order of the machine that wrote the file,
+ * which the header records.
+ *
+ */
+
+#define VIZ_MAGIC       "SWVIZ01"
+#define VIZ_FRAME_MAGIC "SWFR"
+#define VIZ_INDEX_MAGIC "SWIX"
+#define VIZ_END_MAGIC   "SWVIZEND"
+#define VIZ_VERSION     1
+
+typedef enum {
+    VIZ_F32  = 0,
+    VIZ_U16  = 1,
+    VIZ_STEP = 2
+} viz_encoding_t;
+
+#define VIZ_ZLIB 1
+
+typedef struct viz_header_t {
+    char magic[8];             // VIZ_MAGIC
+    int version;               // VIZ_VERSION
+    unsigned int byte_order;   // 0x01020304 as written by the host
+    int nx, ny;                // Frame size (after downsampling)
+    int vskip;                 // Downsampling factor
+    int nfield;                // Fields in each frame (h first)
+    float dx, dy;              // Cell size of the frame grid
+    int bits;                  // 16 for 16-bit quantization, else 0
+    float error;               // Quantization error bound (or 0)
+    int compress;              // zlib level (0 for none)
+    int reserved[3];
+} viz_header_t;
+
+typedef struct viz_frame_t {
+    char magic[4];             // VIZ_FRAME_MAGIC
+    int frame;                 // Frame number
+    double time;               // Simulated time
+    int nchunk;                // Number of chunks
+    int reserved;
+    long long bytes;           // Size of the frame record
+} viz_frame_t;
+
+typedef struct viz_chunk_t {
+    int field;                 // Field index
+    int x0, y0;                // First cell in the frame grid
+    int sx, sy;                // Chunk size
+    int encoding;              // viz_encoding_t
+    float lo, scale;           // Quantization offset and step
+    long long offset;          // Start of data, from start of frame
+    int bytes;                 // Stored size of the data
+    int flags;                 // VIZ_ZLIB if compressed
+} viz_chunk_t;
+
+/**
+ * The index at the end of a file is `VIZ_INDEX_MAGIC`, the number of
+ * frames (an `int`), and a `viz_index_t` per frame; it is followed by
+ * the offset of the index (a `long long`) and `VIZ_END_MAGIC`.
+ *
+ */
+typedef struct viz_index_t {
+    long long offset;          // Start of the frame record
+    double time;               // Simulated time
+} viz_index_t;
+
+/**
+ * ## Writing
+ *
+ * The options say how much to write and how to pack it: every
+ * `vskip`th cell of the first `nfield` fields, quantized to 16 bits
+ * if `bits` is 16, or to within `error` if that is positive, and
+ * compressed at zlib level `compress` (zero to store the chunks as
+ * they are).  The chunks of a frame are the solver tiles (clipped to
+ * the downsampled grid), or fixed-size blocks before the tiles are
+ * set up; they are encoded in parallel with `threads` threads, and
+ * then handed to a background thread to write.  The solver only waits
+ * for the writer when `lag` frames are already waiting.
+ *
+ */
+typedef struct viz_opts_t {
+    int vskip;                 // Keep every vskip-th cell in x and y
+    int nfield;                // Number of fields to write
+    int bits;                  // 16 for 16-bit quantization, else 0
+    float error;               // Quantization error bound (or 0)
+    int compress;              // zlib level (0 for none)
+    int lag;                   // Frames the writer may fall behind
+    int threads;               // Threads for encoding
+} viz_opts_t;
+
+typedef struct viz_t viz_t;
+
+viz_t* viz_open(const char* fname, central2d_t* sim, const viz_opts_t* opts);
+void viz_frame(viz_t* viz, central2d_t* sim);
+
+/**
+ * `viz_close` waits for the writer, writes the frame index, and
+ * returns zero if every write to the file succeeded (or -1 if not).
+ *
+ */
+int viz_close(viz_t* viz);
+
+/**
+ * When we restart from a checkpoint, `viz_reopen` keeps the frames in
+ * an existing file up to and including `frame`, drops any later ones,
+ * and appends from there.  If there is no usable file, it starts a
+ * new one.  Either way, if the file does not hold frame `frame`, the
+ * current state is written as that frame, and later frames are
+ * numbered on from it, as in the run.
+ *
+ */
+viz_t* viz_reopen(const char* fname, central2d_t* sim,
+                  const viz_opts_t* opts, int frame);
+
+//ldoc off
+#endif /* VIZ_H */
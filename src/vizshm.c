@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include "vizshm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * The simulator is the only writer of everything but `consumed`, so
+ * publishing is just a check for a free slot, a parallel gather of
+ * the frame into it, and a release store of the new `published`
+ * count.  Nothing here waits on the consumer: a consumer that is slow
+ * (or has gone away) just makes us drop frames.
+ */
+
+struct vizshm_t {
+    char* name;                // Shared object name
+    unsigned char* base;       // Mapping of the whole object
+    size_t bytes;              // Size of the mapping
+    vizshm_header_t* hdr;      // Header at the start of the mapping
+    viz_opts_t opts;
+    int nframe;                // Frames offered so far
+};
+
+
+static inline
+vizshm_slot_t* vizshm_slot(vizshm_t* shm, uint64_t n)
+{
+    vizshm_header_t* hdr = shm->hdr;
+    return (vizshm_slot_t*) (shm->base + hdr->data_offset +
+                             (n % hdr->nslot) * hdr->slot_bytes);
+}
+
+
+vizshm_t* vizshm_open(const char* name, central2d_t* sim,
+                      const viz_opts_t* opts, int nslot)
+{
+    int vskip = opts->vskip < 1 ? 1 : opts->vskip;
+    int nfield = opts->nfield;
+    if (nfield < 1 || nfield > sim->nfield)
+        nfield = sim->nfield;
+    if (nslot < 2)
+        nslot = 2;
+    int nx = (sim->nx + vskip-1) / vskip;
+    int ny = (sim->ny + vskip-1) / vskip;
+
+    // Round slots up to whole pages so each frame starts page-aligned
+    long page = sysconf(_SC_PAGESIZE);
+    long long data_offset = (sizeof(vizshm_header_t) + page-1) / page * page;
+    long long slot_bytes = sizeof(vizshm_slot_t) +
+        (long long) nfield * nx * ny * sizeof(float);
+    slot_bytes = (slot_bytes + page-1) / page * page;
+    size_t bytes = data_offset + nslot * slot_bytes;
+
+    // Start from a fresh object; old consumers keep the old one
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, bytes) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void* base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    vizshm_t* shm = (vizshm_t*) malloc(sizeof(vizshm_t));
+    shm->name = strdup(name);
+    shm->base = (unsigned char*) base;
+    shm->bytes = bytes;
+    shm->hdr = (vizshm_header_t*) base;
+    shm->opts = *opts;
+    shm->opts.vskip = vskip;
+    shm->opts.nfield = nfield;
+    if (shm->opts.threads < 1)
+        shm->opts.threads = 1;
+    shm->nframe = 0;
+
+    // The object is zero-filled, so the counters start at zero; the
+    // magic goes in last so a consumer never sees half a header
+    vizshm_header_t* hdr = shm->hdr;
+    hdr->version = VIZSHM_VERSION;
+    hdr->byte_order = 0x01020304;
+    hdr->nx = nx;
+    hdr->ny = ny;
+    hdr->vskip = vskip;
+    hdr->nfield = nfield;
+    hdr->dx = sim->dx * vskip;
+    hdr->dy = sim->dy * vskip;
+    hdr->nslot = nslot;
+    hdr->state = VIZSHM_LIVE;
+    hdr->slot_bytes = slot_bytes;
+    hdr->data_offset = data_offset;
+    hdr->pid = getpid();
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr->magic, VIZSHM_MAGIC, 8);
+    return shm;
+}
+
+
+void vizshm_frame(vizshm_t* shm, central2d_t* sim)
+{
+    if (!shm)
+        return;
+    vizshm_header_t* hdr = shm->hdr;
+    int frame = shm->nframe++;
+
+    // Drop the frame if the consumer still holds every slot
+    uint64_t n = hdr->published;
+    uint64_t consumed = __atomic_load_n(&hdr->consumed, __ATOMIC_ACQUIRE);
+    if (n - consumed >= (uint64_t) hdr->nslot) {
+        __atomic_store_n(&hdr->dropped, hdr->dropped + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // Gather straight into the slot, a band of rows per thread
+    central2d_sync(sim);
+    vizshm_slot_t* slot = vizshm_slot(shm, n);
+    float* data = (float*) (slot + 1);
+    int nx = hdr->nx, ny = hdr->ny, vskip = hdr->vskip;
+    #pragma omp parallel for num_threads(shm->opts.threads)
+    for (int j = 0; j < hdr->nfield * ny; ++j) {
+        int k = j / ny, iy = j % ny;
+        const float* row = sim->u + central2d_offset(sim, k, 0, iy*vskip);
+        float* out = data + (size_t) j * nx;
+        for (int ix = 0; ix < nx; ++ix)
+            out[ix] = row[ix*vskip];
+    }
+    slot->seq = n;
+    slot->frame = frame;
+    slot->time = sim->time;
+    __atomic_store_n(&hdr->published, n + 1, __ATOMIC_RELEASE);
+}
+
+
+long long vizshm_close(vizshm_t* shm)
+{
+    if (!shm)
+        return 0;
+    vizshm_header_t* hdr = shm->hdr;
+    long long dropped = hdr->dropped;
+    __atomic_store_n(&hdr->state, VIZSHM_DONE, __ATOMIC_RELEASE);
+    munmap(shm->base, shm->bytes);
+    shm_unlink(shm->name);
+    free(shm->name);
+    free(shm);
+    return dropped;
+}
@@ -0,0 +1,87 @@
+#ifndef VIZSHM_H
+#define VIZSHM_H
+
+#include <stdint.h>
+#include "stepper.h"
+#include "viz.h"
+
+//ldoc on
+/**
+ * # Live frame streaming
+ *
+ * Besides (or instead of) writing an output file, the simulator can
+ * publish frames into a ring buffer in POSIX shared memory, where a
+ * consumer on the same node can look at them while the run goes on.
+ * The shared object starts with a page holding a `vizshm_header_t`,
+ * followed by `nslot` slots of `slot_bytes` bytes each (starting at
+ * `data_offset`).  A slot is a `vizshm_slot_t` followed by the frame:
+ * `nfield` arrays of `nx*ny` single-precision values, row-major, in
+ * the byte order of the host.
+ *
+ * The ring is driven by two counters.  The simulator bumps `published`
+ * after it fills a slot, and the consumer bumps `consumed` when it is
+ * done with one; frame number `n` (counting from zero) lives in slot
+ * `n % nslot`.  The consumer can read slots from `consumed` up to
+ * `published` in place, since the simulator never touches a slot that
+ * has not been released.  If every slot is still in use when a new
+ * frame comes along, the simulator drops that frame and bumps
+ * `dropped` rather than wait.  A consumer that only wants the latest
+ * frame can set `consumed` to `published - 1` before reading.  The
+ * counters are read and written atomically (acquire/release), and
+ * `state` becomes `VIZSHM_DONE` when the run is over.
+ *
+ * The simulator removes any old object with the same name when it
+ * starts, and unlinks its own when it finishes; consumers that still
+ * have it mapped can keep reading.
+ *
+ */
+
+#define VIZSHM_MAGIC   "SWSHM01"
+#define VIZSHM_VERSION 1
+#define VIZSHM_LIVE    1
+#define VIZSHM_DONE    2
+
+typedef struct vizshm_header_t {
+    char magic[8];             // VIZSHM_MAGIC
+    int version;               // VIZSHM_VERSION
+    unsigned int byte_order;   // 0x01020304 as written by the host
+    int nx, ny;                // Frame size (after downsampling)
+    int vskip;                 // Downsampling factor
+    int nfield;                // Fields in each frame (h first)
+    float dx, dy;              // Cell size of the frame grid
+    int nslot;                 // Slots in the ring
+    int state;                 // VIZSHM_LIVE or VIZSHM_DONE
+    long long slot_bytes;      // Size of a slot (header and data)
+    long long data_offset;     // Start of the first slot
+    uint64_t published;        // Frames put in the ring (simulator)
+    uint64_t dropped;          // Frames dropped on a full ring (simulator)
+    uint64_t consumed;         // Frames released (consumer)
+    long long pid;             // Process id of the simulator
+} vizshm_header_t;
+
+typedef struct vizshm_slot_t {
+    uint64_t seq;              // Ring position of the frame (from 0)
+    int frame;                 // Frames offered before this one
+    int reserved;
+    double time;               // Simulated time
+    char pad[40];              // Data starts 64 bytes into the slot
+} vizshm_slot_t;
+
+/**
+ * `vizshm_open` creates the shared object `name` (a POSIX shared
+ * memory name such as `"/shallow"`) with `nslot` slots, using the
+ * `vskip`, `nfield` and `threads` fields of the options.  It returns
+ * `NULL` if the object can't be set up.  `vizshm_frame` publishes the
+ * current solution (or drops it), and `vizshm_close` marks the stream
+ * done, unmaps it, and returns the number of frames dropped.
+ *
+ */
+typedef struct vizshm_t vizshm_t;
+
+vizshm_t* vizshm_open(const char* name, central2d_t* sim,
+                      const viz_opts_t* opts, int nslot);
+void vizshm_frame(vizshm_t* shm, central2d_t* sim);
+long long vizshm_close(vizshm_t* shm);
+
+//ldoc off
+#endif /* VIZSHM_H */
@@ -3,14 +3,26 @@
 --
 nx = tonumber(args[2]) or 200
 threads = tonumber(args[3]) or -1
+tbatch = tonumber(args[4]) or args[4] or 1
 vskip = math.floor(nx/200)
 
+-- Settings used when no thread count is given (see run_bench)
+bench = {
+  reps = 5,
+  warmup = 1,
+  scaling = "both",
+  csv = "bench.csv",
+  json = "bench.json"
+}
+
 pond = {
   init = function(x,y) return 1, 0, 0 end,
   out = "pond.out",
   nx = nx,
   vskip = vskip,
-  threads = threads
+  threads = threads,
+  tbatch = tbatch,
+  bench = bench
 }
 
 river = {
@@ -18,7 +30,9 @@ river = {
   out = "river.out",
   nx = nx,
   vskip = vskip,
-  threads = threads
+  threads = threads,
+  tbatch = tbatch,
+  bench = bench
 }
 
 dam = {
@@ -32,7 +46,9 @@ dam = {
   out = "dam_break.out",
   nx = nx,
   vskip = vskip,
-  threads = threads
+  threads = threads,
+  tbatch = tbatch,
+  bench = bench
 }
 
 wave = {
@@ -43,7 +59,24 @@ wave = {
   frames = 100,
   nx = nx,
   vskip = vskip,
-  threads = threads
+  threads = threads,
+  tbatch = tbatch,
+  bench = bench
+}
+
+-- Lagged steps far past the CFL limit, so that nearly every batch
+-- fails its check and gets redone; with small tiles and many threads,
+-- the threads drift apart around back-to-back rollbacks
+rollback = {
+  init = dam.init,
+  out = "rollback.out",
+  nx = nx,
+  vskip = vskip,
+  threads = threads > 0 and threads or 16,
+  tbatch = tbatch,
+  tile_nx = 8,
+  dt = "lagged",
+  dt_safety = 4
 }
 
 simulate(_G[args[1]])
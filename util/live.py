@@ -0,0 +1,98 @@
+#!/usr/bin/env python
+
+"""
+Watch a running shallow water simulation.
+
+Attaches to the shared memory ring set up by the simulator when the
+simulation table has `stream = "/name"` (see src/vizshm.h), and shows
+the water height of the latest frame as the run goes on.  Frames are
+read in place; the simulator never waits for us, and drops frames if
+we fall behind.
+
+Usage: live.py [/name]
+"""
+
+import mmap
+import os
+import sys
+import time
+import numpy as np
+import matplotlib.pyplot as plt
+
+
+class SimStream(object):
+    """Consumer side of the shared memory frame ring."""
+
+    def __init__(self, name):
+        path = '/dev/shm/' + name.lstrip('/')
+        while not os.path.exists(path):
+            time.sleep(0.1)
+        fd = os.open(path, os.O_RDWR)
+        self.mm = mmap.mmap(fd, 0)
+        os.close(fd)
+        while self.mm[:8] != b'SWSHM01\0':
+            time.sleep(0.01)
+        self.header = np.frombuffer(self.mm, np.dtype([
+            ('magic', 'S8'), ('version', 'i4'), ('byte_order', 'u4'),
+            ('nx', 'i4'), ('ny', 'i4'), ('vskip', 'i4'), ('nfield', 'i4'),
+            ('dx', 'f4'), ('dy', 'f4'), ('nslot', 'i4'), ('state', 'i4'),
+            ('slot_bytes', 'i8'), ('data_offset', 'i8'),
+            ('published', 'u8'), ('dropped', 'u8'), ('consumed', 'u8'),
+            ('pid', 'i8')]), 1)[0]
+        self.slot_dt = np.dtype([('seq', 'u8'), ('frame', 'i4'),
+                                 ('reserved', 'i4'), ('time', 'f8')])
+        self.nx = int(self.header['nx'])
+        self.ny = int(self.header['ny'])
+        self.nfield = int(self.header['nfield'])
+
+    def done(self):
+        return self.header['state'] == 2
+
+    def latest(self):
+        """Return (frame, time, fields) for the newest frame, or None.
+
+        The fields are a view of the slot, valid until `release`.
+        """
+        published = int(self.header['published'])
+        if published == int(self.header['consumed']):
+            return None
+        self.header['consumed'] = published - 1
+        base = int(self.header['data_offset']) + \
+            (published-1) % int(self.header['nslot']) * \
+            int(self.header['slot_bytes'])
+        slot = np.frombuffer(self.mm, self.slot_dt, 1, base)[0]
+        u = np.frombuffer(self.mm, np.float32,
+                          self.nfield*self.nx*self.ny, base+64)
+        return (int(slot['frame']), float(slot['time']),
+                u.reshape(self.nfield, self.ny, self.nx))
+
+    def release(self):
+        self.header['consumed'] = self.header['consumed'] + 1
+
+
+def main(name='/shallow'):
+    sim = SimStream(name)
+    plt.ion()
+    image = None
+    while True:
+        frame = sim.latest()
+        if frame is None:
+            if sim.done():
+                break
+            plt.pause(0.01)
+            continue
+        i, t, u = frame
+        h = u[0].copy()
+        sim.release()
+        if image is None:
+            image = plt.imshow(h, origin='lower', vmin=0, vmax=2)
+            plt.colorbar()
+        else:
+            image.set_data(h)
+        plt.title('Frame %d, t = %g' % (i, t))
+        plt.pause(0.001)
+    print('Frames dropped: %d' % sim.header['dropped'])
+
+
+if __name__ == "__main__":
+    main(*sys.argv[1:])
@@ -0,0 +1,76 @@
+#!/usr/bin/env python
+
+"""
+Read and plot probe time series from a shallow water simulation.
+
+The file layout is described with `central2d_probe` in src/stepper.h.
+`read_probes` returns the sample times and a dictionary mapping each
+probe name to its cell centers (an npoint-by-2 array) and samples (an
+nsample-by-npoint-by-nfield array).  Run as a script, it plots the
+water height at each point gauge over time, and the height along each
+polyline as an image against time and distance.
+
+Usage: probes.py probes.out [plot.png]
+"""
+
+import sys
+import numpy as np
+import matplotlib
+matplotlib.use('Agg')
+import matplotlib.pyplot as plt
+
+
+def read_probes(fname):
+    data = open(fname, 'rb').read()
+    if data[:8] != b'SWPROBE\0':
+        raise ValueError('%s is not a probe file' % fname)
+    e = '<' if np.frombuffer(data[12:16], '<u4')[0] == 0x01020304 else '>'
+    hdr = np.frombuffer(data, np.dtype([
+        ('magic', 'S8'), ('version', e+'i4'), ('byte_order', e+'u4'),
+        ('nfield', e+'i4'), ('nprobe', e+'i4'), ('npoint', e+'i4'),
+        ('reserved', e+'i4'), ('nsample', e+'i8')]), 1)[0]
+    nfield, nprobe = int(hdr['nfield']), int(hdr['nprobe'])
+    npoint, nsample = int(hdr['npoint']), int(hdr['nsample'])
+    offset = hdr.dtype.itemsize
+    info = np.frombuffer(data, np.dtype([
+        ('name', 'S32'), ('first', e+'i4'), ('npoint', e+'i4')]),
+        nprobe, offset)
+    offset += info.nbytes
+    points = np.frombuffer(data, np.dtype([
+        ('ix', e+'i4'), ('iy', e+'i4'), ('x', e+'f4'), ('y', e+'f4')]),
+        npoint, offset)
+    offset += points.nbytes
+    times = np.frombuffer(data, e+'f8', nsample, offset)
+    offset += times.nbytes
+    values = np.frombuffer(data, e+'f4', nsample*npoint*nfield, offset)
+    values = values.reshape(nsample, npoint, nfield)
+
+    probes = {}
+    for p in info:
+        sel = slice(int(p['first']), int(p['first']) + int(p['npoint']))
+        xy = np.stack([points['x'][sel], points['y'][sel]], axis=1)
+        probes[p['name'].decode()] = (xy, values[:, sel, :])
+    return times, probes
+
+
+def main(infile, outfile='probes.png'):
+    times, probes = read_probes(infile)
+    fig, axes = plt.subplots(len(probes), 1, figsize=(8, 3*len(probes)),
+                             squeeze=False)
+    for ax, name in zip(axes[:, 0], sorted(probes)):
+        xy, u = probes[name]
+        if len(xy) == 1:
+            ax.plot(times, u[:, 0, 0])
+            ax.set_ylabel('h')
+        else:
+            s = np.concatenate([[0], np.cumsum(np.hypot(*np.diff(xy, axis=0).T))])
+            ax.pcolormesh(times, s, u[:, :, 0].T, shading='auto')
+            ax.set_ylabel('distance')
+        ax.set_title(name)
+        ax.set_xlabel('t')
+    fig.tight_layout()
+    fig.savefig(outfile)
+
+
+if __name__ == "__main__":
+    main(*sys.argv[1:])
@@ -14,6 +14,143 @@ import matplotlib.pyplot as plt
 from mpl_toolkits.mplot3d import Axes3D
 import matplotlib.animation as manimation
 import sys
+import zlib
+
+
+class SimOutput(object):
+    """Read frames from a simulator output file.
+
+    The format is described in src/viz.h: a header, then a record per
+    frame holding a table of chunks (rectangles of one field, possibly
+    quantized and compressed), then an index of frame offsets.  Only
+    the chunks needed for a frame (and region) are read.  Files in the
+    old raw format (two floats of header, then raw height frames) are
+    read as well.
+    """
+
+    def __init__(self, fname):
+        self.f = open(fname, 'rb')
+        head = self.f.read(64)
+        if head[:8] != b'SWVIZ01\0':
+            self._open_raw(head)
+            return
+        e = '<' if np.frombuffer(head[12:16], '<u4')[0] == 0x01020304 else '>'
+        self.header = np.frombuffer(head, np.dtype([
+            ('magic', 'S8'), ('version', e+'i4'), ('byte_order', e+'u4'),
+            ('nx', e+'i4'), ('ny', e+'i4'), ('vskip', e+'i4'),
+            ('nfield', e+'i4'), ('dx', e+'f4'), ('dy', e+'f4'),
+            ('bits', e+'i4'), ('error', e+'f4'), ('compress', e+'i4'),
+            ('reserved', e+'i4', 3)]))[0]
+        self.frame_dt = np.dtype([
+            ('magic', 'S4'), ('frame', e+'i4'), ('time', e+'f8'),
+            ('nchunk', e+'i4'), ('reserved', e+'i4'), ('bytes', e+'i8')])
+        self.chunk_dt = np.dtype([
+            ('field', e+'i4'), ('x0', e+'i4'), ('y0', e+'i4'),
+            ('sx', e+'i4'), ('sy', e+'i4'), ('encoding', e+'i4'),
+            ('lo', e+'f4'), ('scale', e+'f4'), ('offset', e+'i8'),
+            ('bytes', e+'i4'), ('flags', e+'i4')])
+        self.e = e
+        self.raw = False
+        self.nx = int(self.header['nx'])
+        self.ny = int(self.header['ny'])
+        self.nfield = int(self.header['nfield'])
+        self._read_index()
+
+    def _open_raw(self, head):
+        xy = np.frombuffer(head[:8], 'f4')
+        self.raw = True
+        self.nx, self.ny, self.nfield = int(xy[0]), int(xy[1]), 1
+        self.f.seek(0, 2)
+        nframe = (self.f.tell() - 8) // (4*self.nx*self.ny)
+        self.offsets = [8 + 4*self.nx*self.ny*i for i in range(nframe)]
+        self.times = [float('nan')] * nframe
+
+    def _read_index(self):
+        """Use the index at the end if there is one, else walk the frames."""
+        e = self.e
+        self.f.seek(0, 2)
+        size = self.f.tell()
+        if size >= 16:
+            self.f.seek(size-16)
+            tail = self.f.read(16)
+            if tail[8:] == b'SWVIZEND':
+                start = int(np.frombuffer(tail[:8], e+'i8')[0])
+                self.f.seek(start)
+                head = self.f.read(8)
+                if head[:4] == b'SWIX':
+                    n = int(np.frombuffer(head[4:], e+'i4')[0])
+                    index = np.frombuffer(self.f.read(16*n), np.dtype([
+                        ('offset', e+'i8'), ('time', e+'f8')]))
+                    self.offsets = [int(o) for o in index['offset']]
+                    self.times = [float(t) for t in index['time']]
+                    return
+        self.offsets, self.times = [], []
+        offset = 64
+        while offset + self.frame_dt.itemsize <= size:
+            self.f.seek(offset)
+            fr = np.frombuffer(self.f.read(self.frame_dt.itemsize),
+                               self.frame_dt)[0]
+            if fr['magic'] != b'SWFR' or offset + fr['bytes'] > size:
+                break
+            self.offsets.append(offset)
+            self.times.append(float(fr['time']))
+            offset += int(fr['bytes'])
+
+    def __len__(self):
+        return len(self.offsets)
+
+    def time(self, i):
+        """Simulated time of frame i (NaN for old raw files)."""
+        return self.times[i]
+
+    def _decode(self, ch, data):
+        e, n = self.e, int(ch['sx']*ch['sy'])
+        size = 2 if ch['encoding'] == 1 else 4
+        if ch['flags'] & 1:
+            data = zlib.decompress(data)
+            data = np.frombuffer(data, np.uint8).reshape(size, n).T.tobytes()
+        if ch['encoding'] == 0:
+            v = np.frombuffer(data, e+'f4')
+        elif ch['encoding'] == 1:
+            q = np.frombuffer(data, e+'u2')
+            v = ch['lo'] + float(ch['scale']) * q.astype(np.float64)
+        else:
+            q = np.cumsum(np.frombuffer(data, e+'u4'), dtype=np.uint32)
+            v = ch['lo'] + float(ch['scale']) * q.astype(np.float64)
+        return v.astype(np.float32).reshape(int(ch['sy']), int(ch['sx']))
+
+    def frame(self, i, field=0, region=None):
+        """Return field of frame i as an ny-by-nx array.
+
+        If region = (x0, x1, y0, y1) is given, return just those cells
+        (in frame coordinates), reading only the chunks that overlap.
+        """
+        x0, x1, y0, y1 = region or (0, self.nx, 0, self.ny)
+        out = np.zeros((y1-y0, x1-x0), np.float32)
+        if self.raw:
+            self.f.seek(self.offsets[i])
+            u = np.fromfile(self.f, 'f4', self.nx*self.ny)
+            out[:] = u.reshape(self.ny, self.nx)[y0:y1, x0:x1]
+            return out
+        base = self.offsets[i]
+        self.f.seek(base)
+        fr = np.frombuffer(self.f.read(self.frame_dt.itemsize), self.frame_dt)[0]
+        nchunk = int(fr['nchunk'])
+        chunks = np.frombuffer(self.f.read(nchunk*self.chunk_dt.itemsize),
+                               self.chunk_dt)
+        for ch in chunks:
+            cx0, cy0 = int(ch['x0']), int(ch['y0'])
+            cx1, cy1 = cx0 + int(ch['sx']), cy0 + int(ch['sy'])
+            if (ch['field'] != field or cx1 <= x0 or cx0 >= x1 or
+                    cy1 <= y0 or cy0 >= y1):
+                continue
+            self.f.seek(base + int(ch['offset']))
+            v = self._decode(ch, self.f.read(int(ch['bytes'])))
+            ax0, ax1 = max(x0, cx0), min(x1, cx1)
+            ay0, ay1 = max(y0, cy0), min(y1, cy1)
+            out[ay0-y0:ay1-y0, ax0-x0:ax1-x0] = \
+                v[ay0-cy0:ay1-cy0, ax0-cx0:ax1-cx0]
+        return out
 
 
 def main(infile="waves.out", outfile="out.mp4", startpic="start.png"):
@@ -25,15 +162,14 @@ def main(infile="waves.out", outfile="out.mp4", startpic="start.png"):
         startpic: Name of picture generated at first frame
     """
 
-    u = np.fromfile(infile, dtype=np.dtype('f4'))
-    nx = int(u[0])
-    ny = int(u[1])
+    sim = SimOutput(infile)
+    nx = sim.nx
+    ny = sim.ny
     x = range(0,nx)
     y = range(0,ny)
-    u = u[2:]
-    nframe = len(u) // (nx*ny)
+    nframe = len(sim)
     stride = nx // 20
-    u = np.reshape(u, (nframe,nx,ny))
+    u = np.array([sim.frame(i) for i in range(nframe)])
     X, Y = np.meshgrid(x,y)
 
     fig = plt.figure(figsize=(10,10))